@@ -6,8 +6,30 @@
 #include <functional>
 #include <cmath>
 #include <cstdint>
+#include <type_traits>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define ARRAY_NEW_SIZE_FACTOR (2 << 5)
+#define ARRAY_GROWTH_FACTOR 2
+#define CONCURRENT_FIRST_SEGMENT (2 << 9)
+#define MATRIX_GEMM_BLOCK (2 << 5)
+#define REDUCTION_LANES 8
+#define STREAM_COPY_MIN_BYTES (2 << 24)
+#define ARENA_CHUNK_BYTES (2 << 20)
+#define POOL_MIN_BYTES (2 << 4)
+#define POOL_MAX_BYTES (2 << 19)
+#define PARALLEL_GRAIN (2 << 11)
+#define SPLIT_BLOCK (2 << 7)
 #define MAX_VEC_DIMS (2 << 10)
 #define SEPARATOR " "
 #define COMPLEX_IMG "i"
@@ -38,1892 +60,8976 @@
 #pragma message ("Removing Matrix assertions can improve performance, however, undefined behavior have HIGH probability of happening")
 #endif
 
-//VEC
+//STATS
+//counters of heap traffic, copies, moves and expressions evaluated into containers (each one is a
+//temporary or a result), per kind of container. Counting is compiled in with STUFF_STATS only, so
+//a release build can be instrumented without the cost of a debug build. Without it every
+//stats_count vanishes and stats() returns zeros.
+//STATS_MEMORY counts every buffer of the library, containers and temporaries alike
+//__builtin_is_constant_evaluated came with GCC 9 and Clang 9, GCC only has __has_builtin from 10 on
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_is_constant_evaluated)
+#define STUFF_CONSTANT_EVALUATED
+#endif
+#endif
+#if !defined(STUFF_CONSTANT_EVALUATED) && defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 9
+#define STUFF_CONSTANT_EVALUATED
+#endif
+
 namespace stuff
 {
-    #ifdef VEC_DEBUG
-    static std::size_t VEC_DEBUG_COUNT = 0;
-    #endif
+    //true while the compiler evaluates a constant expression, constexpr code uses it to skip counters
+    //and intrinsics. Compilers without the builtin always take the run time path
+    constexpr bool constantEvaluated()
+    {
+#if defined(STUFF_CONSTANT_EVALUATED)
+        return __builtin_is_constant_evaluated();
+#else
+        return false;
+#endif
+    }
 
-    template <typename E, typename T>
-    class VecExpression
+    enum StatsKind { STATS_MEMORY, STATS_VEC, STATS_ARRAY, STATS_MATRIX, STATS_KINDS };
+
+    struct Stats
     {
-    public:
-        T operator[](std::size_t i) const { return static_cast<const E&>(*this)[i]; }
-        T operator()(std::size_t i) const { return static_cast<const E&>(*this)(i); }
-        std::size_t dim() const { return static_cast<const E&>(*this).dim(); }
+        std::uint64_t allocs;
+        std::uint64_t bytes;
+        std::uint64_t reallocs;
+        std::uint64_t frees;
+        std::uint64_t copies;
+        std::uint64_t moves;
+        std::uint64_t materializations;
     };
 
-    template <std::size_t dims, typename T>
-    class Vec : public VecExpression<Vec<dims, T>, T>
+    //one cache line per kind, threads counting different kinds don't fight over it
+    struct alignas(64) StatsCounters
     {
-    public:
-        static_assert(dims * sizeof(T) < MAX_VEC_DIMS, "You're trying to use a my::Vec with "
-                                                        "a resulting size greater than 2^10. "
-                                                        "If you really need a my::Vec this big "
-                                                        "consider changing MAX_VEC_DIMS, but "
-                                                        "by doing that, you should know your risks. "
-                                                        "Consider using my::Array instead.");
+        std::atomic<std::uint64_t> allocs;
+        std::atomic<std::uint64_t> bytes;
+        std::atomic<std::uint64_t> reallocs;
+        std::atomic<std::uint64_t> frees;
+        std::atomic<std::uint64_t> copies;
+        std::atomic<std::uint64_t> moves;
+        std::atomic<std::uint64_t> materializations;
+    };
 
-        Vec()
-        {
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = T();
-            #ifdef VEC_DEBUG
-            std::cout << "CLEAN CONSTRUCT\t" << "VEC DEBUG COUNT: " << VEC_DEBUG_COUNT++ << std::endl;
-            #endif
-        }
+    inline StatsCounters& statsCounters(StatsKind kind)
+    {
+        static StatsCounters counters[STATS_KINDS];
+        return counters[kind];
+    }
 
-        template <typename... args>
-        Vec(T item0, args... rest)
+    //snapshot of the counters of kind, each one is read atomically but not all of them together
+    inline Stats stats(StatsKind kind)
+    {
+        StatsCounters& c = statsCounters(kind);
+        Stats ret;
+        ret.allocs = c.allocs.load(std::memory_order_relaxed);
+        ret.bytes = c.bytes.load(std::memory_order_relaxed);
+        ret.reallocs = c.reallocs.load(std::memory_order_relaxed);
+        ret.frees = c.frees.load(std::memory_order_relaxed);
+        ret.copies = c.copies.load(std::memory_order_relaxed);
+        ret.moves = c.moves.load(std::memory_order_relaxed);
+        ret.materializations = c.materializations.load(std::memory_order_relaxed);
+        return ret;
+    }
+
+    inline void resetStats()
+    {
+        for (int k = 0; k < STATS_KINDS; ++k)
         {
-            T new_data[] = {item0, rest...};
-            #ifdef VEC_DEBUG
-            std::cout << "VARIADIC TEMPLATE CONSTRUCT\t" << "VEC DEBUG COUNT: " << VEC_DEBUG_COUNT++ << std::endl;
-            #endif
-            static_assert(sizeof(new_data) / sizeof(T) == dims, "Number of arguments doesn't match with number of dimension for vector");
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = new_data[i];
+            StatsCounters& c = statsCounters((StatsKind)k);
+            c.allocs.store(0, std::memory_order_relaxed);
+            c.bytes.store(0, std::memory_order_relaxed);
+            c.reallocs.store(0, std::memory_order_relaxed);
+            c.frees.store(0, std::memory_order_relaxed);
+            c.copies.store(0, std::memory_order_relaxed);
+            c.moves.store(0, std::memory_order_relaxed);
+            c.materializations.store(0, std::memory_order_relaxed);
         }
+    }
+}
 
-        Vec(const Vec<dims, T> &o)
-        {
-            #ifdef VEC_DEBUG
-            std::cout << "COPY CONSTRUCT\t" << "VEC DEBUG COUNT: " << VEC_DEBUG_COUNT++ << std::endl;
-            #endif
+#ifdef STUFF_STATS
+#define stats_count(kind, counter, n) do { if (!stuff::constantEvaluated()) stuff::statsCounters(stuff::kind).counter.fetch_add((n), std::memory_order_relaxed); } while (0)
+#else
+#define stats_count(kind, counter, n)
+#endif
 
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = o.data[i];
-        }
+//PROFILE
+//with STUFF_PROFILE every heavy kernel (expression evaluation, gemm, factorizations, matrix
+//functions, reductions) records calls and elapsed time and, on Linux, cycles, instructions and
+//last level cache misses from perf_event_open. Counters are kept per call site and expression type,
+//profileReport() prints them from inside the process. Hardware counters belong to the calling
+//thread and are inclusive (a gemm inside expm counts in both), work done by pool threads only
+//shows up in the elapsed time. Without STUFF_PROFILE profile_kernel vanishes.
+#ifdef STUFF_PROFILE
+#include <ostream>
+#include <chrono>
+#include <cstdio>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+namespace stuff
+{
+    enum ProfileEvent { PROFILE_CYCLES, PROFILE_INSTRUCTIONS, PROFILE_LLC_MISSES, PROFILE_EVENTS };
 
-        Vec(Vec<dims, T> &&o)
+    //counters of one kernel instantiation. Sites link themselves into a list when first used
+    class ProfileSite
+    {
+    public:
+        ProfileSite(const char* kernel_, const char* signature_): 
+        kernel(kernel_), signature(signature_), calls(0), nanoseconds(0), next(nullptr)
         {
-            #ifdef VEC_DEBUG
-            std::cout << "MOVE CONSTRUCT\t" << "VEC DEBUG COUNT: " << VEC_DEBUG_COUNT++ << std::endl;
-            #endif
+            for (std::size_t e = 0; e < PROFILE_EVENTS; ++e)
+                events[e].store(0, std::memory_order_relaxed);
+            next = head().load(std::memory_order_relaxed);
+            while (!head().compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed))
+                ;
+        }
 
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = o.data[i];
+        ProfileSite(const ProfileSite&) = delete;
+        ProfileSite& operator=(const ProfileSite&) = delete;
+
+        void add(std::uint64_t ns, const std::uint64_t* deltas)
+        {
+            calls.fetch_add(1, std::memory_order_relaxed);
+            nanoseconds.fetch_add(ns, std::memory_order_relaxed);
+            if (deltas != nullptr)
+                for (std::size_t e = 0; e < PROFILE_EVENTS; ++e)
+                    events[e].fetch_add(deltas[e], std::memory_order_relaxed);
         }
-        
-        template <typename K>
-        Vec(const VecExpression<K, T>& expr)
+
+        static std::atomic<ProfileSite*>& head()
         {
-            #ifdef VEC_DEBUG
-            std::cout << "COPY EXPR CONSTRUCT\t" << "VEC DEBUG COUNT: " << VEC_DEBUG_COUNT++ << std::endl;
-            #endif
-            vec_assert(dims == expr.dim());
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = expr[i];
+            static std::atomic<ProfileSite*> first(nullptr);
+            return first;
         }
 
-        ~Vec() = default;
+        const char *kernel;
+        const char *signature;
+        std::atomic<std::uint64_t> calls;
+        std::atomic<std::uint64_t> nanoseconds;
+        std::atomic<std::uint64_t> events[PROFILE_EVENTS];
+        ProfileSite *next;
+    };
 
-        Vec<dims, T>& operator=(const Vec<dims, T>& o)
+    //hardware counters of the current thread, one perf event group opened on first use
+    class PerfCounters
+    {
+    public:
+        PerfCounters(): leader(-1)
         {
-            #ifdef VEC_DEBUG
-            std::cout << "COPY ASSIGN\t" << "VEC DEBUG COUNT: " << VEC_DEBUG_COUNT++ << std::endl;
+            for (std::size_t e = 0; e < PROFILE_EVENTS; ++e)
+            {
+                fds[e] = -1;
+                slot[e] = -1;
+            }
+            #if defined(__linux__)
+            const std::uint64_t configs[PROFILE_EVENTS] = {
+                PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+            };
+            int opened = 0;
+            for (std::size_t e = 0; e < PROFILE_EVENTS; ++e)
+            {
+                perf_event_attr attr;
+                memset((void*)&attr, 0, sizeof(attr));
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.size = sizeof(attr);
+                attr.config = configs[e];
+                attr.disabled = leader == -1? 1: 0;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP;
+                fds[e] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+                if (fds[e] == -1)
+                    continue;
+                if (leader == -1)
+                    leader = fds[e];
+                slot[e] = opened++;
+            }
+            if (leader != -1)
+                ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
             #endif
-
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = o.data[i];
-            return *this;
         }
 
-        Vec<dims, T>& operator=(Vec<dims, T>&& o)
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        ~PerfCounters()
         {
-            #ifdef VEC_DEBUG
-            std::cout << "MOVE ASSIGN\t" << "VEC DEBUG COUNT: " << VEC_DEBUG_COUNT++ << std::endl;
+            #if defined(__linux__)
+            for (std::size_t e = 0; e < PROFILE_EVENTS; ++e)
+                if (fds[e] != -1)
+                    close(fds[e]);
             #endif
-
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = o.data[i];
-            return *this;
         }
 
-        template <typename K>
-        Vec<dims, T>& operator=(const VecExpression<K, T>& expr)
+        //false when there are no hardware counters (not Linux, no permission, virtual machine...).
+        //Events that couldn't be opened read as 0
+        bool read(std::uint64_t* values) const
         {
-            #ifdef VEC_DEBUG
-            std::cout << "COPY EXPR ASSIGN\t" << "VEC DEBUG COUNT: " << VEC_DEBUG_COUNT++ << std::endl;
+            if (leader == -1)
+                return false;
+            #if defined(__linux__)
+            std::uint64_t buffer[1 + PROFILE_EVENTS];
+            if (::read(leader, (void*)buffer, sizeof(buffer)) <= 0)
+                return false;
+            for (std::size_t e = 0; e < PROFILE_EVENTS; ++e)
+                values[e] = slot[e] == -1? 0: buffer[1 + slot[e]];
+            return true;
+            #else
+            (void)values;
+            return false;
             #endif
-            
-            vec_assert(dims == expr.dim());
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = expr[i];
-            return *this;
         }
 
-        //removed %dims
-        const T& operator[] (std::size_t i) const { return data[i]; }
-        const T& operator() (std::size_t i) const { return data[i]; }
-
-        T& operator[] (std::size_t i) { return data[i]; }
-        T& operator() (std::size_t i) { return data[i]; }
-
-        std::size_t dim() const { return dims; }
-
-        Vec<dims, T>& forEach(const std::function<T(std::size_t)> &func)
+        static const PerfCounters& local()
         {
-            for (std::size_t i = 0; i < dims; ++i)
-                data[i] = func(i);
+            static thread_local PerfCounters counters;
+            return counters;
         }
 
     private:
-        T data[dims];
+        int leader;
+        int fds[PROFILE_EVENTS];
+        int slot[PROFILE_EVENTS];
     };
 
-    template <typename P1, typename P2, typename T>
-    class VecSum : public VecExpression<VecSum<P1, P2, T>, T>
+    //adds the time and the counter deltas of its lifetime to a site
+    class ProfileScope
     {
     public:
-        VecSum(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        ProfileScope(ProfileSite& s): site(s)
         {
-            if (p1.dim() != p2.dim())
-            {
-                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
-                exit(-1);
-            }
+            counting = PerfCounters::local().read(begin_events);
+            begin = std::chrono::steady_clock::now();
         }
-        T operator[] (std::size_t i) const { return p1[i] + p2[i]; }
-        T operator() (std::size_t i) const { return p1[i] + p2[i]; }
-        std::size_t dim() const { return p1.dim(); }
-
-    private:
-        const P1& p1;
-        const P2& p2;
-    };
 
-    template <typename P1, typename P2, typename T>
-    VecSum<P1, P2, T> operator+(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
-    {
-        return VecSum<P1, P2, T>(
-            *static_cast<const P1*>(&v1),
-            *static_cast<const P2*>(&v2)
-            );
-    }
+        ProfileScope(const ProfileScope&) = delete;
+        ProfileScope& operator=(const ProfileScope&) = delete;
 
-    template <typename P1, typename P2, typename T>
-    class VecSub : public VecExpression<VecSub<P1, P2, T>, T>
-    {
-    public:
-        VecSub(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        ~ProfileScope()
         {
-            if (p1.dim() != p2.dim())
+            std::uint64_t ns = (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - begin).count();
+            std::uint64_t end_events[PROFILE_EVENTS];
+            if (counting && PerfCounters::local().read(end_events))
             {
-                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
-                exit(-1);
+                for (std::size_t e = 0; e < PROFILE_EVENTS; ++e)
+                    end_events[e] -= begin_events[e];
+                site.add(ns, end_events);
             }
+            else
+                site.add(ns, nullptr);
         }
-        T operator[] (std::size_t i) const { return p1[i] - p2[i]; }
-        T operator() (std::size_t i) const { return p1[i] - p2[i]; }
-        std::size_t dim() const { return p1.dim(); }
 
     private:
-        const P1& p1;
-        const P2& p2;
+        ProfileSite& site;
+        bool counting;
+        std::uint64_t begin_events[PROFILE_EVENTS];
+        std::chrono::steady_clock::time_point begin;
     };
 
-    template <typename P1, typename P2, typename T>
-    VecSub<P1, P2, T> operator-(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
+    inline void profileReset()
     {
-        return VecSub<P1, P2, T>(
-            *static_cast<const P1*>(&v1),
-            *static_cast<const P2*>(&v2)
-            );
+        for (ProfileSite *s = ProfileSite::head().load(std::memory_order_acquire); s != nullptr; s = s->next)
+        {
+            s->calls.store(0, std::memory_order_relaxed);
+            s->nanoseconds.store(0, std::memory_order_relaxed);
+            for (std::size_t e = 0; e < PROFILE_EVENTS; ++e)
+                s->events[e].store(0, std::memory_order_relaxed);
+        }
     }
 
-    template <typename P1, typename P2, typename T>
-    class VecMul : public VecExpression<VecMul<P1, P2, T>, T>
+    //one line per site that was called: calls, time, cycles, instructions, instructions per cycle
+    //and LLC misses per thousand instructions, followed by the kernel signature.
+    //Low IPC with many misses per instruction means the kernel waits on memory
+    inline void profileReport(std::ostream& out)
     {
-    public:
-        VecMul(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        char line[256];
+        std::uint64_t dummy[PROFILE_EVENTS];
+        if (!PerfCounters::local().read(dummy))
+            out << "hardware counters not available, only calls and times are recorded" << std::endl;
+        snprintf(line, sizeof(line), "%-20s %10s %12s %14s %14s %6s %12s %8s",
+                 "kernel", "calls", "time (ms)", "cycles", "instructions", "IPC", "LLC misses", "MPKI");
+        out << line << std::endl;
+        for (ProfileSite *s = ProfileSite::head().load(std::memory_order_acquire); s != nullptr; s = s->next)
         {
-            if (p1.dim() != p2.dim())
-            {
-                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
-                exit(-1);
-            }
+            std::uint64_t calls = s->calls.load(std::memory_order_relaxed);
+            if (calls == 0)
+                continue;
+            double cycles = (double)s->events[PROFILE_CYCLES].load(std::memory_order_relaxed);
+            double instructions = (double)s->events[PROFILE_INSTRUCTIONS].load(std::memory_order_relaxed);
+            double misses = (double)s->events[PROFILE_LLC_MISSES].load(std::memory_order_relaxed);
+            snprintf(line, sizeof(line), "%-20s %10llu %12.3f %14.0f %14.0f %6.2f %12.0f %8.2f",
+                     s->kernel, (unsigned long long)calls, s->nanoseconds.load(std::memory_order_relaxed) * 1e-6,
+                     cycles, instructions, cycles > 0? instructions / cycles: 0.0, 
+                     misses, instructions > 0? misses * 1000.0 / instructions: 0.0);
+            out << line << std::endl << "    " << s->signature << std::endl;
         }
-        T operator[] (std::size_t i) const { return p1[i] * p2[i]; }
-        T operator() (std::size_t i) const { return p1[i] * p2[i]; }
-        std::size_t dim() const { return p1.dim(); }
-
-    private:
-        const P1& p1;
-        const P2& p2;
-    };
-
-    template <typename P1, typename P2, typename T>
-    VecMul<P1, P2, T> operator*(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
-    {
-        return VecMul<P1, P2, T>(
-            *static_cast<const P1*>(&v1),
-            *static_cast<const P2*>(&v2)
-            );
     }
+}
 
-    template <typename P1, typename P2, typename T>
-    class VecDiv : public VecExpression<VecDiv<P1, P2, T>, T>
+#if defined(_MSC_VER)
+#define PROFILE_SIGNATURE __FUNCSIG__
+#else
+#define PROFILE_SIGNATURE __PRETTY_FUNCTION__
+#endif
+//one site per instantiation of the enclosing function, so each expression type gets its own line
+#define profile_kernel(name) \
+    static stuff::ProfileSite profile_site_(name, PROFILE_SIGNATURE); \
+    stuff::ProfileScope profile_scope_(profile_site_)
+#else
+#define profile_kernel(name)
+#endif
+
+//MEMORY
+//element storage for Array and Matrix. Trivially copyable types are copied with memcpy
+//(or non temporal stores for copies bigger than STREAM_COPY_MIN_BYTES, so huge copies don't
+//evict the whole cache) and don't need zeroed memory when every element is written anyway.
+//
+//Every buffer (containers and temporaries inside the library) comes from memAlloc & co, which
+//use the MemoryResource set for the current thread by a MemoryScope, or malloc if there is none.
+namespace stuff
+{
+    class MemoryResource
     {
     public:
-        VecDiv(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
-        {
-            if (p1.dim() != p2.dim())
-            {
-                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
-                exit(-1);
-            }
-        }        
-        T operator[] (std::size_t i) const { return p1[i] / p2[i]; }
-        T operator() (std::size_t i) const { return p1[i] / p2[i]; }
-        std::size_t dim() const { return p1.dim(); }
-
-    private:
-        const P1& p1;
-        const P2& p2;
+        virtual ~MemoryResource() = default;
+        //blocks must be aligned to 16 bytes
+        virtual void* allocate(std::size_t bytes) = 0;
+        //`bytes` is the same size given to allocate
+        virtual void deallocate(void* p, std::size_t bytes) = 0;
     };
 
-    template <typename P1, typename P2, typename T>
-    VecDiv<P1, P2, T> operator/(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
-    {
-        return VecDiv<P1, P2, T>(
-            *static_cast<const P1*>(&v1),
-            *static_cast<const P2*>(&v2)
-            );
-    }
-
-    template <typename P1, typename T>
-    class VecScaM : public VecExpression<VecScaM<P1, T>, T>
+    //each block starts with the resource that owns it, so it can still be freed after the
+    //scope that allocated it is gone. nullptr means plain malloc
+    struct alignas(16) MemoryHeader
     {
-    public:
-        VecScaM(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T operator[] (std::size_t i) const { return p1[i] * s; }
-        T operator() (std::size_t i) const { return p1[i] * s; }
-        std::size_t dim() const { return p1.dim(); }
-
-    private:
-        const P1& p1;
-        const T& s;
+        MemoryResource *owner;
+        std::size_t bytes;
     };
 
-    template <typename P1, typename T>
-    VecScaM<P1, T> operator*(const VecExpression<P1, T>& v1, const T& v2)
+    inline MemoryResource*& currentMemoryResource()
     {
-        return VecScaM<P1, T>(
-            *static_cast<const P1*>(&v1),
-            v2
-            );
+        static thread_local MemoryResource *current = nullptr;
+        return current;
     }
 
-    template <typename P1, typename T>
-    VecScaM<P1, T> operator*(const T& v2, const VecExpression<P1, T>& v1)
+    inline void* memAlloc(std::size_t bytes)
     {
-        return VecScaM<P1, T>(
-            *static_cast<const P1*>(&v1),
-            v2
-            );
+        MemoryResource *r = currentMemoryResource();
+        std::size_t total = sizeof(MemoryHeader) + bytes;
+        MemoryHeader *h = (MemoryHeader*)(r == nullptr? malloc(total): r->allocate(total));
+        if (h == nullptr)
+            return nullptr;
+        h->owner = r;
+        h->bytes = bytes;
+        stats_count(STATS_MEMORY, allocs, 1);
+        stats_count(STATS_MEMORY, bytes, bytes);
+        return (void*)(h + 1);
     }
 
-    template <typename P1, typename T>
-    class VecScaDiv : public VecExpression<VecScaDiv<P1, T>, T>
+    inline void* memCalloc(std::size_t n, std::size_t size)
     {
-    public:
-        VecScaDiv(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T operator[] (std::size_t i) const { return p1[i] / s; }
-        T operator() (std::size_t i) const { return p1[i] / s; }
-        std::size_t dim() const { return p1.dim(); }
+        MemoryResource *r = currentMemoryResource();
+        std::size_t total = sizeof(MemoryHeader) + n * size;
+        MemoryHeader *h;
+        if (r == nullptr)
+            h = (MemoryHeader*)calloc(1, total);
+        else
+        {
+            h = (MemoryHeader*)r->allocate(total);
+            if (h != nullptr)
+                memset((void*)h, 0, total);
+        }
+        if (h == nullptr)
+            return nullptr;
+        h->owner = r;
+        h->bytes = n * size;
+        stats_count(STATS_MEMORY, allocs, 1);
+        stats_count(STATS_MEMORY, bytes, n * size);
+        return (void*)(h + 1);
+    }
 
-    private:
-        const P1& p1;
-        const T& s;
-    };
+    inline void memFree(void* p)
+    {
+        if (p == nullptr)
+            return;
+        stats_count(STATS_MEMORY, frees, 1);
+        MemoryHeader *h = (MemoryHeader*)p - 1;
+        if (h->owner == nullptr)
+            free((void*)h);
+        else
+            h->owner->deallocate((void*)h, sizeof(MemoryHeader) + h->bytes);
+    }
 
-    template <typename P1, typename T>
-    VecScaDiv<P1, T> operator/(const VecExpression<P1, T>& v1, const T& v2)
+    //the block stays with the resource that allocated it
+    inline void* memRealloc(void* p, std::size_t bytes)
     {
-        return VecScaDiv<P1, T>(
-            *static_cast<const P1*>(&v1),
-            v2
-            );
+        if (p == nullptr)
+            return memAlloc(bytes);
+
+        MemoryHeader *h = (MemoryHeader*)p - 1;
+        MemoryResource *r = h->owner;
+        MemoryHeader *n;
+        if (r == nullptr)
+            n = (MemoryHeader*)realloc((void*)h, sizeof(MemoryHeader) + bytes);
+        else
+        {
+            n = (MemoryHeader*)r->allocate(sizeof(MemoryHeader) + bytes);
+            if (n == nullptr)
+                return nullptr;
+            memcpy((void*)(n + 1), p, h->bytes < bytes? h->bytes: bytes);
+            r->deallocate((void*)h, sizeof(MemoryHeader) + h->bytes);
+        }
+        if (n == nullptr)
+            return nullptr;
+        n->owner = r;
+        n->bytes = bytes;
+        stats_count(STATS_MEMORY, reallocs, 1);
+        stats_count(STATS_MEMORY, bytes, bytes);
+        return (void*)(n + 1);
     }
 
-    template <typename P1, typename T>
-    class VecScaDivI : public VecExpression<VecScaDivI<P1, T>, T>
+    //sets the resource used by the current thread until the scope ends
+    class MemoryScope
     {
     public:
-        VecScaDivI(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T operator[] (std::size_t i) const { return s / p1[i]; }
-        T operator() (std::size_t i) const { return s / p1[i]; }
-        std::size_t dim() const { return p1.dim(); }
-
+        MemoryScope(MemoryResource& r): previous(currentMemoryResource()) { currentMemoryResource() = &r; }
+        MemoryScope(const MemoryScope&) = delete;
+        MemoryScope& operator=(const MemoryScope&) = delete;
+        ~MemoryScope() { currentMemoryResource() = previous; }
     private:
-        const P1& p1;
-        const T& s;
+        MemoryResource *previous;
     };
 
-    template <typename P1, typename T>
-    VecScaDivI<P1, T> operator/(const T& v2, const VecExpression<P1, T>& v1)
-    {
-        return VecScaDivI<P1, T>(
-            *static_cast<const P1*>(&v1),
-            v2
-            );
-    }
-
-    template <typename P1, typename T>
-    class VecMinus : public VecExpression<VecMinus<P1, T>, T>
+    //bump allocator over big chunks. Freeing only gives back the last block allocated,
+    //everything else is released at once by release() or the destructor.
+    //Not thread safe, meant to be used by one thread (e.g. one request).
+    class MonotonicArena : public MemoryResource
     {
     public:
-        VecMinus(const P1& p1_): p1(p1_){ }
-        T operator[] (std::size_t i) const { return -p1[i]; }
-        T operator() (std::size_t i) const { return -p1[i]; }
-        std::size_t dim() const { return p1.dim(); }
+        MonotonicArena(std::size_t chunk_bytes = ARENA_CHUNK_BYTES): 
+        chunk(chunk_bytes), head(nullptr), ptr(nullptr), end(nullptr) { }
 
-    private:
-        const P1& p1;
-    };
+        MonotonicArena(const MonotonicArena&) = delete;
+        MonotonicArena& operator=(const MonotonicArena&) = delete;
 
-    template <typename P1, typename T>
-    VecMinus<P1, T> operator-(const VecExpression<P1, T>& v1)
-    {
-        return VecMinus<P1, T>(
-            *static_cast<const P1*>(&v1)
-            );
-    }
+        ~MonotonicArena() { release(); }
 
-    template <typename P1, typename P2, typename T>
-    T operator^(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
-    {
-        if (v1.dim() != v2.dim())
+        void* allocate(std::size_t bytes) override
         {
-            std::cerr << "Trying to dot product with vecs of different lengths: " << v1.dim() << " x " << v2.dim() << std::endl;
-            exit(-1);
+            bytes = round(bytes);
+            if (ptr == nullptr || bytes > (std::size_t)(end - ptr))
+                grow(bytes);
+            void *ret = (void*)ptr;
+            ptr += bytes;
+            return ret;
         }
-        T ret = T();
-        for (std::size_t i = 0; i < v1.dim(); ++i)
-            ret = ret + v1[i] * v2[i];
-        return ret;
-    }
 
-    template <typename E, typename T>
-    std::ostream& operator<<(std::ostream& out, const VecExpression<E, T>& v)
-    {
-        for (std::size_t i = 0; i < v.dim() - 1; ++i)
-            out << v[i] << SEPARATOR;
-        std::size_t i = v.dim() - 1;
-        out << v[i];
-        return out;
-    }
+        void deallocate(void* p, std::size_t bytes) override
+        {
+            if ((char*)p + round(bytes) == ptr)
+                ptr = (char*)p;
+        }
 
-    using Vec2f = Vec<2, float>;
-    using Vec2d = Vec<2, double>;
-    using Vec2i = Vec<2, int>;
+        //every block allocated from the arena is invalid after this
+        void release()
+        {
+            while (head != nullptr)
+            {
+                Chunk *next = head->next;
+                free((void*)head);
+                head = next;
+            }
+            ptr = end = nullptr;
+        }
 
-    using Vec3f = Vec<3, float>;
-    using Vec3d = Vec<3, double>;
-    using Vec3i = Vec<3, int>;
-}
+    private:
+        struct alignas(16) Chunk
+        {
+            Chunk *next;
+        };
 
-//ARRAY
-namespace stuff
-{
-    #ifdef ARRAY_DEBUG
-    static std::size_t ARRAY_DEBUG_COUNT = 0;
-    #endif
+        static std::size_t round(std::size_t bytes) { return (bytes + 15) & ~(std::size_t)15; }
 
-    template <typename E, typename T>
-    class ArrayExpression
-    {
-    public:
-        std::size_t len() const { return static_cast<const E&>(*this).len(); }
-        T operator[](std::size_t i) const { return static_cast<const E&>(*this)[i]; }
+        void grow(std::size_t bytes)
+        {
+            std::size_t size = sizeof(Chunk) + (bytes > chunk? bytes: chunk);
+            Chunk *c = (Chunk*)malloc(size);
+            if (c == nullptr)
+                throw std::bad_alloc();
+            c->next = head;
+            head = c;
+            ptr = (char*)(c + 1);
+            end = (char*)c + size;
+        }
+
+        std::size_t chunk;
+        Chunk *head;
+        char *ptr, *end;
     };
 
-    template <typename T>
-    class Array : public ArrayExpression<Array<T>, T>
+    //free lists of power of two size classes, from POOL_MIN_BYTES to POOL_MAX_BYTES. Blocks of
+    //recurring sizes are reused without going back to malloc, bigger ones use malloc directly.
+    //Not thread safe, meant to be used by one thread.
+    class PoolResource : public MemoryResource
     {
     public:
-        Array(): data(nullptr), sz_cached(ARRAY_NEW_SIZE_FACTOR), elems(0)
+        PoolResource(): arena()
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "CLEAN CONSTRUCT\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = (T*)calloc(ARRAY_NEW_SIZE_FACTOR, sizeof(T));
+            for (std::size_t k = 0; k < CLASSES; ++k)
+                free_list[k] = nullptr;
         }
-        
-        Array(std::size_t n): sz_cached(n), elems(n)
+
+        PoolResource(const PoolResource&) = delete;
+        PoolResource& operator=(const PoolResource&) = delete;
+
+        void* allocate(std::size_t bytes) override
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "SIZE CONSTRUCT\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            std::cout << "SIZEOF(T): " << sizeof(T) << " DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT << std::endl;
-            #endif
-            data = (T*)calloc(n, sizeof(T));
+            if (bytes > POOL_MAX_BYTES)
+                return malloc(bytes);
+            std::size_t k = sizeClass(bytes);
+            if (free_list[k] != nullptr)
+            {
+                Node *n = free_list[k];
+                free_list[k] = n->next;
+                return (void*)n;
+            }
+            return arena.allocate((std::size_t)POOL_MIN_BYTES << k);
         }
 
-        Array(std::size_t n, const std::function<T(std::size_t)> &func): sz_cached(n), elems(n)
+        void deallocate(void* p, std::size_t bytes) override
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "FUNCTION CONSTRUCT\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = (T*)calloc(n, sizeof(T));
-            for (std::size_t i = 0; i < n; ++i)
-                data[i] = func(i);
+            if (bytes > POOL_MAX_BYTES)
+            {
+                free(p);
+                return;
+            }
+            std::size_t k = sizeClass(bytes);
+            Node *n = (Node*)p;
+            n->next = free_list[k];
+            free_list[k] = n;
         }
 
-        Array(const Array<T>& o): sz_cached(o.sz_cached), elems(o.elems)
+    private:
+        struct Node
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "COPY CONSTRUCT\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = (T*)calloc(sz_cached, sizeof(T));
-            for (std::size_t i = 0; i < elems; ++i)
-                data[i] = o.data[i];
-        }
+            Node *next;
+        };
 
-        Array(Array<T>&& o): sz_cached(o.sz_cached), elems(o.elems)
+        static std::size_t sizeClass(std::size_t bytes)
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "MOVE CONSTRUCT\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = o.data;
-            o.data = nullptr;
+            std::size_t k = 0;
+            while (((std::size_t)POOL_MIN_BYTES << k) < bytes)
+                ++k;
+            return k;
         }
 
-        template <typename E>
-        Array(const ArrayExpression<E, T>& expr)
+        static const std::size_t CLASSES = 32;
+        MonotonicArena arena;
+        Node *free_list[CLASSES];
+    };
+
+    inline void streamCopy(void* dst, const void* src, std::size_t bytes)
+    {
+        #if defined(__SSE2__)
+        char *d = (char*)dst;
+        const char *s = (const char*)src;
+        std::size_t head = (16 - ((std::uintptr_t)d & 15)) & 15;
+        if (head > bytes)
+            head = bytes;
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        bytes -= head;
+
+        for (; bytes >= 64; bytes -= 64, d += 64, s += 64)
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "EXPR COPY CONSTRUCT\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            sz_cached = expr.len();
-            elems = expr.len();
-            data = (T*)calloc(expr.len(), sizeof(T));
-            for (std::size_t i = 0; i < expr.len(); ++i)
-                data[i] = expr[i];
+            __m128i v0 = _mm_loadu_si128((const __m128i*)s);
+            __m128i v1 = _mm_loadu_si128((const __m128i*)(s + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i*)(s + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i*)(s + 48));
+            _mm_stream_si128((__m128i*)d, v0);
+            _mm_stream_si128((__m128i*)(d + 16), v1);
+            _mm_stream_si128((__m128i*)(d + 32), v2);
+            _mm_stream_si128((__m128i*)(d + 48), v3);
         }
+        memcpy(d, s, bytes);
+        _mm_sfence();
+        #else
+        memcpy(dst, src, bytes);
+        #endif
+    }
+
+    template <typename T>
+    void copyElems(T* dst, const T* src, std::size_t n, std::true_type)
+    {
+        if (n * sizeof(T) >= STREAM_COPY_MIN_BYTES)
+            streamCopy((void*)dst, (const void*)src, n * sizeof(T));
+        else if (n)
+            memcpy((void*)dst, (const void*)src, n * sizeof(T));
+    }
+
+    template <typename T>
+    void copyElems(T* dst, const T* src, std::size_t n, std::false_type)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            dst[i] = src[i];
+    }
+
+    template <typename T>
+    void copyElems(T* dst, const T* src, std::size_t n)
+    {
+        copyElems(dst, src, n, std::is_trivially_copyable<T>());
+    }
+
+    //copies into memory that holds no objects yet, copy constructing the ones that aren't trivially copyable
+    template <typename T>
+    void constructElems(T* dst, const T* src, std::size_t n, std::true_type)
+    {
+        copyElems(dst, src, n, std::true_type());
+    }
+
+    template <typename T>
+    void constructElems(T* dst, const T* src, std::size_t n, std::false_type)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            new (dst + i) T(src[i]);
+    }
+
+    template <typename T>
+    void constructElems(T* dst, const T* src, std::size_t n)
+    {
+        constructElems(dst, src, n, std::is_trivially_copyable<T>());
+    }
+
+    //moves n objects to memory that holds none yet and ends them at src. Objects that may point
+    //into themselves (std::string) can't just be memcpy'd or realloc'd
+    template <typename T>
+    void relocateElems(T* dst, T* src, std::size_t n, std::true_type)
+    {
+        copyElems(dst, src, n, std::true_type());
+    }
 
-        Array<T>& operator=(const Array<T>& o)
+    template <typename T>
+    void relocateElems(T* dst, T* src, std::size_t n, std::false_type)
+    {
+        for (std::size_t i = 0; i < n; ++i)
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "COPY ASSING\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            elems = o.elems;
-            sz_cached = o.sz_cached;
-            if(data != nullptr)
-                free(data);
-            data = (T*)calloc(sz_cached, sizeof(T));
-            for (std::size_t i = 0; i < elems; ++i)
-                data[i] = o[i];
-            return *this;
+            new (dst + i) T(std::move(src[i]));
+            src[i].~T();
         }
+    }
+
+    template <typename T>
+    void relocateElems(T* dst, T* src, std::size_t n)
+    {
+        relocateElems(dst, src, n, std::is_trivially_copyable<T>());
+    }
+
+    //ends n objects, the memory stays
+    template <typename T>
+    void destroyElems(T* p, std::size_t n)
+    {
+        if (!std::is_trivially_destructible<T>::value)
+            for (std::size_t i = 0; i < n; ++i)
+                p[i].~T();
+    }
 
-        Array<T>& operator=(Array<T>&& o)
+    //fixed storage inside Array and Matrix for up to N elements, so small containers never
+    //touch the heap. Empty for N = 0
+    template <typename T, std::size_t N>
+    class InlineBuffer
+    {
+    public:
+        InlineBuffer()
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "MOVE ASSING\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            elems = o.elems;
-            sz_cached = o.sz_cached;
-            if (data != nullptr)
-                free(data);
-            data = o.data;
-            o.data = nullptr;
-            return *this;
+            if (!std::is_trivially_copyable<T>::value)
+                memset((void*)raw, 0, sizeof(raw));
         }
+        T* inlineData() { return reinterpret_cast<T*>(raw); }
+        const T* inlineData() const { return reinterpret_cast<const T*>(raw); }
+    private:
+        alignas(T) unsigned char raw[N * sizeof(T)];
+    };
 
-        template <typename E>
-        Array<T>& operator=(const ArrayExpression<E, T>& expr)
+    template <typename T>
+    class InlineBuffer<T, 0>
+    {
+    public:
+        T* inlineData() { return nullptr; }
+        const T* inlineData() const { return nullptr; }
+    };
+
+    template <typename T, std::size_t N = 0>
+    class Array;
+
+    template <typename T, std::size_t N = 0>
+    class Matrix;
+
+    //memory for n elements that are all going to be assigned right away. Types that
+    //aren't trivially copyable still get zeroed memory, assigning over garbage isn't safe for them
+    template <typename T>
+    T* allocElems(std::size_t n)
+    {
+        if (std::is_trivially_copyable<T>::value)
+            return (T*)memAlloc(n * sizeof(T));
+        return (T*)memCalloc(n, sizeof(T));
+    }
+}
+
+//PARALLEL
+//one work stealing pool shared by every parallel kernel (expression assignment, gemm,
+//factorizations, reductions), so nested or concurrent kernels never oversubscribe the cores.
+//Ranges are split in halves until they are at most grain long: a thread keeps the halves it
+//doesn't run yet on its own deque and idle threads steal them from the other end.
+//A thread waiting for its range runs queued work instead of blocking, so parallelFor can be
+//called from inside a parallelFor body.
+namespace stuff
+{
+    class ThreadPool
+    {
+    public:
+        //threads counts the calling thread too, 0 means one per hardware thread
+        explicit ThreadPool(std::size_t threads = 0): 
+        queues(nullptr), workers(nullptr), count(0), queued(0), stop(false)
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "EXPR ASSING\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            elems = expr.len();
-            sz_cached = elems;
-            if (data != nullptr)
-                free(data);
-            data = (T*)calloc(elems, sizeof(T));
-            for (std::size_t i = 0; i < elems; ++i)
-                data[i] = expr[i];
-            return *this;
+            start(threads);
         }
 
-        ~Array()
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool() { shutdown(); }
+
+        std::size_t size() const { return count; }
+
+        //joins the workers and starts again with the given number of threads.
+        //Nothing may be running on the pool meanwhile
+        void resize(std::size_t threads)
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "ARRAY DESTRUCTOR\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            if (data != nullptr)
-                free(data);
+            shutdown();
+            start(threads);
         }
 
-        std::size_t len() const { return elems; }
-        //removed %elems and array_assert(elems > 0)
-        const T& operator[](std::size_t i) const{ return data[i]; }
-        T& operator[](std::size_t i) { return data[i]; }
-        Array<T>& insert(const T& obj)
+        //calls f(b, e) on pieces [b, e) of [begin, end) at most grain long, returns when all are done
+        template <typename F>
+        void parallelFor(std::size_t begin, std::size_t end, std::size_t grain, const F& f)
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "INSERT COPY\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            if (elems == sz_cached)
+            if (grain == 0)
+                grain = 1;
+            if (end <= begin)
+                return;
+            if (end - begin <= grain || count < 2)
             {
-                #ifdef ARRAY_DEBUG
-                std::cout << "REALLOC\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-                #endif
+                f(begin, end);
+                return;
+            }
 
-                data = (T*)realloc((void*)data, sizeof(T) * (sz_cached + ARRAY_NEW_SIZE_FACTOR));
-                array_assert(data != NULL);
-                sz_cached += ARRAY_NEW_SIZE_FACTOR;
+            Job job;
+            job.call = &invoke<F>;
+            job.fn = (const void*)&f;
+            job.grain = grain;
+            job.pending.store(end - begin, std::memory_order_relaxed);
+
+            std::size_t q = queueIndex();
+            run(Task{&job, begin, end}, q);
+            while (job.pending.load(std::memory_order_acquire) != 0)
+            {
+                Task t;
+                if (take(q, t))
+                    run(t, q);
+                else
+                    std::this_thread::yield();
             }
-            data[elems] = obj;
-            ++elems;
-            return *this;
         }
-        
-        Array<T>& insert(T&& obj)
+
+    private:
+        struct Job
         {
-            #ifdef ARRAY_DEBUG
-            std::cout << "INSERT MOVE\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-            #endif
-            if (elems == sz_cached)
-            {
-                #ifdef ARRAY_DEBUG
-                std::cout << "REALLOC\t" << "DEBUG ARRAY COUNT: " << ARRAY_DEBUG_COUNT++ << std::endl;
-                #endif
+            void (*call)(const void*, std::size_t, std::size_t);
+            const void *fn;
+            std::size_t grain;
+            //elements not processed yet
+            std::atomic<std::size_t> pending;
+        };
+
+        struct Task
+        {
+            Job *job;
+            std::size_t begin, end;
+        };
 
-                data = (T*)realloc((void*)data, sizeof(T) * (sz_cached + ARRAY_NEW_SIZE_FACTOR));
-                array_assert(data != NULL);
-                sz_cached += ARRAY_NEW_SIZE_FACTOR;
-            }
-            data[elems] = std::move(obj);
-            ++elems;
-            return *this;
-        }
+        struct Queue
+        {
+            std::mutex lock;
+            std::deque<Task> tasks;
+        };
 
-        const T& pop()
+        struct Slot
         {
-            return data[elems-- - 1];
+            const ThreadPool *pool;
+            std::size_t index;
+        };
+
+        template <typename F>
+        static void invoke(const void* fn, std::size_t b, std::size_t e) { (*(const F*)fn)(b, e); }
+
+        static Slot& threadSlot()
+        {
+            static thread_local Slot slot = {nullptr, 0};
+            return slot;
         }
 
-        Array<T>& forEach(const std::function<T(std::size_t, T)> &func)
+        //workers use their own queue, every other thread shares the last one
+        std::size_t queueIndex() const
         {
-            for (std::size_t i = 0; i < elems; ++i)
-                data[i] = func(i, data[i]);
-            return *this;
+            const Slot& slot = threadSlot();
+            return slot.pool == this? slot.index: count - 1;
         }
 
-    private:
-        T *data;
-        std::size_t sz_cached;
-        std::size_t elems;
-    };
+        void start(std::size_t threads);
+        void shutdown();
+        void work(std::size_t index);
 
-    template <typename P1, typename P2, typename T>
-    class ArraySum : public ArrayExpression<ArraySum<P1, P2, T>, T>
-    {
-    public:
-        ArraySum(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        void push(std::size_t q, const Task& t)
         {
-            if (p1.len() != p2.len())
             {
-                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
+                std::lock_guard<std::mutex> guard(queues[q].lock);
+                queues[q].tasks.push_back(t);
+            }
+            queued.fetch_add(1, std::memory_order_release);
+            //taking the lock makes sure a worker checking queued right now is already waiting
+            {
+                std::lock_guard<std::mutex> guard(sleep_lock);
             }
+            wake.notify_one();
         }
-        T operator[](std::size_t i) const { return p1[i] + p2[i]; }
-        std::size_t len() const { return p1.len(); }
-    private:
-        const P1& p1;
-        const P2& p2;
-    };
 
-    template <typename P1, typename P2, typename T>
-    ArraySum<P1, P2, T> operator+(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
-    {
-        return ArraySum<P1, P2, T>(
-            *static_cast<const P1*>(&v1),
-            *static_cast<const P2*>(&v2)
-        );
-    }
+        //newest task of queue q, or the oldest one of any other queue
+        bool take(std::size_t q, Task& t)
+        {
+            if (queued.load(std::memory_order_acquire) == 0)
+                return false;
+            for (std::size_t k = 0; k < count; ++k)
+            {
+                Queue& from = queues[(q + k) % count];
+                std::lock_guard<std::mutex> guard(from.lock);
+                if (from.tasks.empty())
+                    continue;
+                if (k == 0)
+                {
+                    t = from.tasks.back();
+                    from.tasks.pop_back();
+                }
+                else
+                {
+                    t = from.tasks.front();
+                    from.tasks.pop_front();
+                }
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+            return false;
+        }
 
-    template <typename P1, typename P2, typename T>
-    class ArraySub : public ArrayExpression<ArraySub<P1, P2, T>, T>
-    {
-    public:
-        ArraySub(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        void run(Task t, std::size_t q)
         {
-            if (p1.len() != p2.len())
+            Job *job = t.job;
+            while (t.end - t.begin > job->grain)
             {
-                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
+                std::size_t mid = t.begin + (t.end - t.begin) / 2;
+                push(q, Task{job, mid, t.end});
+                t.end = mid;
             }
+            job->call(job->fn, t.begin, t.end);
+            //job lives on the waiting thread's stack, it can't be touched after this
+            job->pending.fetch_sub(t.end - t.begin, std::memory_order_acq_rel);
         }
-        T operator[](std::size_t i) const { return p1[i] - p2[i]; }
-        std::size_t len() const { return p1.len(); }
-    private:
-        const P1& p1;
-        const P2& p2;
+
+        Queue *queues;
+        std::thread *workers;
+        std::size_t count;
+        std::atomic<std::size_t> queued;
+        bool stop;
+        std::mutex sleep_lock;
+        std::condition_variable wake;
     };
 
-    template <typename P1, typename P2, typename T>
-    ArraySub<P1, P2, T> operator-(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
+    //pool used by the current thread, set by a ThreadPoolScope. Workers use their own pool
+    inline ThreadPool*& currentThreadPool()
     {
-        return ArraySub<P1, P2, T>(
-            *static_cast<const P1*>(&v1),
-            *static_cast<const P2*>(&v2)
-        );
+        static thread_local ThreadPool *current = nullptr;
+        return current;
     }
 
-    template <typename P1, typename P2, typename T>
-    class ArrayMul : public ArrayExpression<ArrayMul<P1, P2, T>, T>
+    //pool used when there is no ThreadPoolScope, created on first use with one thread per core
+    inline ThreadPool& defaultThreadPool()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    //number of threads of the default pool, 1 runs every kernel on the calling thread
+    inline void setThreadCount(std::size_t threads) { defaultThreadPool().resize(threads); }
+
+    inline void ThreadPool::start(std::size_t threads)
+    {
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        count = threads == 0? 1: threads;
+        stop = false;
+        queued.store(0, std::memory_order_relaxed);
+        queues = new Queue[count];
+        workers = new std::thread[count - 1];
+        for (std::size_t i = 0; i + 1 < count; ++i)
+            workers[i] = std::thread(&ThreadPool::work, this, i);
+    }
+
+    inline void ThreadPool::shutdown()
     {
-    public:
-        ArrayMul(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
         {
-            if (p1.len() != p2.len())
+            std::lock_guard<std::mutex> guard(sleep_lock);
+            stop = true;
+        }
+        wake.notify_all();
+        for (std::size_t i = 0; i + 1 < count; ++i)
+            workers[i].join();
+        delete[] workers;
+        delete[] queues;
+        workers = nullptr;
+        queues = nullptr;
+        count = 0;
+    }
+
+    inline void ThreadPool::work(std::size_t index)
+    {
+        threadSlot() = Slot{this, index};
+        currentThreadPool() = this;
+        for (;;)
+        {
+            Task t;
+            if (take(index, t))
             {
-                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
+                run(t, index);
+                continue;
             }
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            wake.wait(guard, [this]() { return stop || queued.load(std::memory_order_acquire) != 0; });
+            if (stop)
+                return;
         }
-        T operator[](std::size_t i) const { return p1[i] * p2[i]; }
-        std::size_t len() const { return p1.len(); }
+    }
+
+    //runs the kernels of this thread on another pool while alive
+    class ThreadPoolScope
+    {
+    public:
+        ThreadPoolScope(ThreadPool& p): previous(currentThreadPool()) { currentThreadPool() = &p; }
+        ThreadPoolScope(const ThreadPoolScope&) = delete;
+        ThreadPoolScope& operator=(const ThreadPoolScope&) = delete;
+        ~ThreadPoolScope() { currentThreadPool() = previous; }
     private:
-        const P1& p1;
-        const P2& p2;
+        ThreadPool *previous;
     };
 
-    template <typename P1, typename P2, typename T>
-    ArrayMul<P1, P2, T> operator*(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
+    //f(b, e) over pieces of [begin, end) on the current pool. Ranges that fit in one grain
+    //run right here, without touching (or creating) any pool
+    template <typename F>
+    void parallelFor(std::size_t begin, std::size_t end, std::size_t grain, const F& f)
     {
-        return ArrayMul<P1, P2, T>(
-            *static_cast<const P1*>(&v1),
-            *static_cast<const P2*>(&v2)
-        );
-    }
-
-    template <typename P1, typename P2, typename T>
-    class ArrayDiv : public ArrayExpression<ArrayDiv<P1, P2, T>, T>
-    {
-    public:
-        ArrayDiv(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        if (end <= begin)
+            return;
+        if (end - begin <= grain)
         {
-            if (p1.len() != p2.len())
-            {
-                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
-            }
+            f(begin, end);
+            return;
         }
-        T operator[](std::size_t i) const { return p1[i] / p2[i]; }
-        std::size_t len() const { return p1.len(); }
-    private:
-        const P1& p1;
-        const P2& p2;
-    };
+        ThreadPool *pool = currentThreadPool();
+        (pool != nullptr? *pool: defaultThreadPool()).parallelFor(begin, end, grain, f);
+    }
 
-    template <typename P1, typename P2, typename T>
-    ArrayDiv<P1, P2, T> operator/(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
+    //items per piece so each piece does about PARALLEL_GRAIN units of work
+    inline std::size_t parallelGrain(std::size_t work_per_item)
     {
-        return ArrayDiv<P1, P2, T>(
-            *static_cast<const P1*>(&v1),
-            *static_cast<const P2*>(&v2)
-        );
+        if (work_per_item >= PARALLEL_GRAIN)
+            return 1;
+        return PARALLEL_GRAIN / (work_per_item == 0? 1: work_per_item);
     }
 
-    template <typename P1, typename T>
-    class ArraySca : public ArrayExpression<ArraySca<P1, T>, T>
+    //threads of the pool that parallelFor runs on from this thread
+    inline std::size_t currentThreadCount()
     {
-    public:
-        ArraySca(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T operator[](std::size_t i) const { return s * p1[i]; }
-        std::size_t len() const { return p1.len(); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
+        ThreadPool *pool = currentThreadPool();
+        return (pool != nullptr? *pool: defaultThreadPool()).size();
+    }
 
-    template <typename P1, typename T>
-    ArraySca<P1, T> operator*(const T& s, const ArrayExpression<P1, T>& v1)
+    //execution policies of forEach and the function constructors: seq calls the function in order on
+    //the calling thread, par spreads the calls over the thread pool and par_unseq also lets the
+    //compiler vectorize them, so calls must not depend on each other
+    struct SequencedPolicy { static constexpr bool parallel = false, unsequenced = false; };
+    struct ParallelPolicy { static constexpr bool parallel = true, unsequenced = false; };
+    struct ParallelUnsequencedPolicy { static constexpr bool parallel = true, unsequenced = true; };
+
+    constexpr SequencedPolicy seq{};
+    constexpr ParallelPolicy par{};
+    constexpr ParallelUnsequencedPolicy par_unseq{};
+
+    #if defined(__clang__)
+    #define UNSEQ_LOOP _Pragma("clang loop vectorize(assume_safety)")
+    #elif defined(__GNUC__)
+    #define UNSEQ_LOOP _Pragma("GCC ivdep")
+    #else
+    #define UNSEQ_LOOP
+    #endif
+
+    template <typename F>
+    void policyLoop(std::false_type, std::size_t begin, std::size_t end, const F& f)
     {
-        return ArraySca<P1, T>(
-            *static_cast<const P1*>(&v1), 
-            s
-        );
+        for (std::size_t i = begin; i < end; ++i)
+            f(i);
     }
 
-    template <typename P1, typename T>
-    ArraySca<P1, T> operator*(const ArrayExpression<P1, T>& v1, const T& s)
+    template <typename F>
+    void policyLoop(std::true_type, std::size_t begin, std::size_t end, const F& f)
     {
-        return ArraySca<P1, T>(
-            *static_cast<const P1*>(&v1), 
-            s
-        );
+        UNSEQ_LOOP
+        for (std::size_t i = begin; i < end; ++i)
+            f(i);
     }
 
-    template <typename P1, typename T>
-    class ArrayScaD : public ArrayExpression<ArrayScaD<P1, T>, T>
+    //f(i) for i in [begin, end) as the policy says, grain as in parallelFor
+    template <typename P, typename F>
+    void policyFor(P, std::size_t begin, std::size_t end, std::size_t grain, const F& f)
     {
-    public:
-        ArrayScaD(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T operator[](std::size_t i) const { return p1[i] / s; }
-        std::size_t len() const { return p1.len(); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
+        typedef std::integral_constant<bool, P::unsequenced> unseq;
+        if (!P::parallel)
+        {
+            policyLoop(unseq(), begin, end, f);
+            return;
+        }
+        parallelFor(begin, end, grain, [&f](std::size_t b, std::size_t e) { policyLoop(unseq(), b, e, f); });
+    }
 
-    template <typename P1, typename T>
-    ArrayScaD<P1, T> operator/(const ArrayExpression<P1, T>& v1, const T& s)
+    //f(i, j) over a rows x cols grid, whole rows go to each thread and the loop over j is the one
+    //that may be vectorized
+    template <typename P, typename F>
+    void policyFor(P policy, std::size_t rows, std::size_t cols, const F& f)
     {
-        return ArrayScaD<P1, T>(
-            *static_cast<const P1*>(&v1), 
-            s
-        );
+        typedef std::integral_constant<bool, P::unsequenced> unseq;
+        policyFor(policy, 0, rows, parallelGrain(cols), [&f, cols](std::size_t i)
+        {
+            policyLoop(unseq(), 0, cols, [&f, i](std::size_t j) { f(i, j); });
+        });
     }
+}
 
-    template <typename P1, typename T>
-    class ArrayScaI : public ArrayExpression<ArrayScaI<P1, T>, T>
+//SIMD
+//thin wrappers over the vector registers of the target, SimdOps<T>::width lanes at a time.
+//Types without a specialization get ScalarOps (a single lane), so kernels written with them work
+//everywhere. simdFor runs a kernel with the vector registers and finishes the tail one by one
+namespace stuff
+{
+    template <typename T>
+    struct ScalarOps
     {
-    public:
-        ArrayScaI(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T operator[](std::size_t i) const { return s / p1[i]; }
-        std::size_t len() const { return p1.len(); }
-    private:
-        const P1& p1;
-        const T& s;
+        typedef T reg;
+        static constexpr std::size_t width = 1;
+        static reg load(const T* p) { return *p; }
+        static void store(T* p, reg a) { *p = a; }
+        static reg set(T x) { return x; }
+        static reg add(reg a, reg b) { return a + b; }
+        static reg sub(reg a, reg b) { return a - b; }
+        static reg mul(reg a, reg b) { return a * b; }
+        static reg div(reg a, reg b) { return a / b; }
+        static reg neg(reg a) { return -a; }
+        static reg sqrt(reg a) { return std::sqrt(a); }
+        //a < b? a: b and a > b? a: b lane by lane, b when either is NaN
+        static reg min(reg a, reg b) { return a < b? a: b; }
+        static reg max(reg a, reg b) { return a > b? a: b; }
+        static reg abs(reg a) { return std::fabs(a); }
+        //sum of the lanes
+        static T hsum(reg a) { return a; }
+        //lanes from n on set to zero
+        static reg keep(reg a, std::size_t n) { return n > 0? a: T(); }
+        //lanes from n on set to x
+        static reg pad(reg a, std::size_t n, T x) { return n > 0? a: x; }
     };
 
-    template <typename P1, typename T>
-    ArrayScaI<P1, T> operator/(const T& s, const ArrayExpression<P1, T>& v1)
-    {
-        return ArrayScaI<P1, T>(
-            *static_cast<const P1*>(&v1), 
-            s
-        );
-    }
+    template <typename T>
+    struct SimdOps : public ScalarOps<T> { };
 
-    template <typename P1, typename T>
-    class ArrayNeg : public ArrayExpression<ArrayNeg<P1, T>, T>
+    #if defined(__SSE2__)
+    template <>
+    struct SimdOps<double>
     {
-    public:
-        ArrayNeg(const P1& p1_): p1(p1_) { }
-        T operator[](std::size_t i) const { return -p1[i]; }
-        std::size_t len() const { return p1.len(); }
-    private:
-        const P1& p1;
+        typedef __m128d reg;
+        static constexpr std::size_t width = 2;
+        static reg load(const double* p) { return _mm_loadu_pd(p); }
+        static void store(double* p, reg a) { _mm_storeu_pd(p, a); }
+        static reg set(double x) { return _mm_set1_pd(x); }
+        static reg add(reg a, reg b) { return _mm_add_pd(a, b); }
+        static reg sub(reg a, reg b) { return _mm_sub_pd(a, b); }
+        static reg mul(reg a, reg b) { return _mm_mul_pd(a, b); }
+        static reg div(reg a, reg b) { return _mm_div_pd(a, b); }
+        static reg neg(reg a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+        static reg sqrt(reg a) { return _mm_sqrt_pd(a); }
+        static reg min(reg a, reg b) { return _mm_min_pd(a, b); }
+        static reg max(reg a, reg b) { return _mm_max_pd(a, b); }
+        static reg abs(reg a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+        static double hsum(reg a) { return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a))); }
+        static reg keep(reg a, std::size_t n)
+        {
+            return n >= 2? a: n == 1? _mm_move_sd(_mm_setzero_pd(), a): _mm_setzero_pd();
+        }
+        static reg pad(reg a, std::size_t n, double x)
+        {
+            return n >= 2? a: n == 1? _mm_move_sd(_mm_set1_pd(x), a): _mm_set1_pd(x);
+        }
     };
 
-    template <typename P1, typename T>
-    ArrayNeg<P1, T> operator-(const ArrayExpression<P1, T>& v1)
-    {
-        return ArrayNeg<P1, T>(
-            *static_cast<const P1*>(&v1)
-        );
-    }
-
-    template <typename P1, typename P2, typename T>
-    T operator^(const ArrayExpression<P1, T>& p1, const ArrayExpression<P2, T>& p2)
+    template <>
+    struct SimdOps<float>
     {
-        if (p1.len() != p2.len())
+        typedef __m128 reg;
+        static constexpr std::size_t width = 4;
+        static reg load(const float* p) { return _mm_loadu_ps(p); }
+        static void store(float* p, reg a) { _mm_storeu_ps(p, a); }
+        static reg set(float x) { return _mm_set1_ps(x); }
+        static reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+        static reg sub(reg a, reg b) { return _mm_sub_ps(a, b); }
+        static reg mul(reg a, reg b) { return _mm_mul_ps(a, b); }
+        static reg div(reg a, reg b) { return _mm_div_ps(a, b); }
+        static reg neg(reg a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+        static reg sqrt(reg a) { return _mm_sqrt_ps(a); }
+        static reg min(reg a, reg b) { return _mm_min_ps(a, b); }
+        static reg max(reg a, reg b) { return _mm_max_ps(a, b); }
+        static reg abs(reg a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+        static float hsum(reg a)
         {
-            std::cerr << "Trying to dot product with arrays of different lengths: " << p1.len() << " x " << p2.len() << std::endl;
-            exit(-1);
+            reg s = _mm_add_ps(a, _mm_movehl_ps(a, a));
+            return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
         }
+        static reg keep(reg a, std::size_t n)
+        {
+            if (n >= 4)
+                return a;
+            if (n == 3)
+                return _mm_and_ps(a, _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)));
+            if (n == 2)
+                return _mm_castpd_ps(_mm_move_sd(_mm_setzero_pd(), _mm_castps_pd(a)));
+            return n == 1? _mm_move_ss(_mm_setzero_ps(), a): _mm_setzero_ps();
+        }
+        static reg pad(reg a, std::size_t n, float x)
+        {
+            if (n >= 4)
+                return a;
+            reg b = _mm_set1_ps(x);
+            if (n == 3)
+            {
+                reg m = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+                return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+            }
+            if (n == 2)
+                return _mm_castpd_ps(_mm_move_sd(_mm_castps_pd(b), _mm_castps_pd(a)));
+            return n == 1? _mm_move_ss(b, a): b;
+        }
+    };
+    #endif
 
-        T ret = T();
-        for (std::size_t i = 0; i < p1.len(); ++i)
-            ret = ret + p1[i] * p2[i];
-        return ret;
-    }
-
-    template <typename E, typename T>
-    std::ostream& operator<<(std::ostream& out, const ArrayExpression<E, T>& v)
+    //k(ops, i) handles elements [i, i + decltype(ops)::width)
+    template <typename T, typename K>
+    void simdFor(std::size_t n, const K& k)
     {
-        if (v.len() == 0)
-            return out;
-        
-        for (std::size_t i = 0; i < v.len() - 1; ++i)
-            out << v[i] << SEPARATOR;
-
-        std::size_t i = v.len() - 1;
-        out << v[i];
-        return out;
+        std::size_t i = 0;
+        for (; i + SimdOps<T>::width <= n; i += SimdOps<T>::width)
+            k(SimdOps<T>(), i);
+        for (; i < n; ++i)
+            k(ScalarOps<T>(), i);
     }
 }
 
-//MATRIX
-//in principle the matrix should not change its size by inserting rows and cols, just 
-//by a expansion
-//but i do have an urge to implement a resizing matrix, such as
-//my::Array<my::Array<T>>
-//one day, maybe
-
+//VEC
+//Vec<2..4, float> and Vec<2..4, double> are padded to whole vector registers and aligned to them (a
+//Vec3f is one register, a Vec3d two with SSE2), the padding lanes are always zero. Expressions made
+//only of them are packed: lanes<O>(i) gives elements [i, i + O::width) and assignments and dot
+//products run a register at a time. Any other expression goes element by element through operator[]
 namespace stuff
 {
-
-    #ifdef MATRIX_DEBUG
-    static std::size_t MATRIX_DEBUG_COUNT = 0;
-    #endif
+    template <std::size_t dims, typename T>
+    struct VecLanes
+    {
+        typedef SimdOps<T> O;
+        static constexpr bool packed = O::width > 1 && dims >= 2 && dims <= 4;
+        static constexpr std::size_t padded = packed? (dims + O::width - 1) / O::width * O::width: dims;
+        static constexpr std::size_t align = packed? alignof(typename O::reg): alignof(T);
+    };
 
     template <typename E, typename T>
-    class MatrixExpression
+    class VecExpression
     {
     public:
-        //T operator[] (std::size_t i) const { return static_cast<const E&>(*this)[i]; }
-        T operator() (std::size_t row, std::size_t col) const { return static_cast<const E&>(*this)(row, col); }
-        std::size_t rows() const { return static_cast<const E&>(*this).rows(); }
-        std::size_t cols() const { return static_cast<const E&>(*this).cols(); }
+        static constexpr bool packed = false;
+        constexpr T operator[](std::size_t i) const { return static_cast<const E&>(*this)[i]; }
+        constexpr T operator()(std::size_t i) const { return static_cast<const E&>(*this)(i); }
+        constexpr std::size_t dim() const { return static_cast<const E&>(*this).dim(); }
     };
 
-    template <typename T>
-    class Matrix : public MatrixExpression<Matrix<T>, T>
+    template <std::size_t dims, typename T>
+    class Vec : public VecExpression<Vec<dims, T>, T>
     {
     public:
-        Matrix(): m_rows(0), m_cols(0), data(nullptr)
-        {
-            #ifdef MATRIX_DEBUG
-            std::cout << "CLEAN CONSTRUCT\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-        }
+        static_assert(dims * sizeof(T) < MAX_VEC_DIMS, "You're trying to use a my::Vec with "
+                                                        "a resulting size greater than 2^10. "
+                                                        "If you really need a my::Vec this big "
+                                                        "consider changing MAX_VEC_DIMS, but "
+                                                        "by doing that, you should know your risks. "
+                                                        "Consider using my::Array instead.");
+
+        static constexpr bool packed = VecLanes<dims, T>::packed;
 
-        Matrix(std::size_t rows_, std::size_t cols_): m_rows(rows_), m_cols(cols_)
+        constexpr Vec(): data()
         {
-            #ifdef MATRIX_DEBUG
-            std::cout << "ROWS AND COLS CONSTRUCT\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = (T*)calloc(m_rows * m_cols, sizeof(T));
+            for (std::size_t i = 0; i < padded; ++i)
+                data[i] = T();
         }
 
-        Matrix(std::size_t rows_, std::size_t cols_, const std::function<T(std::size_t, std::size_t)> &func): 
-        m_rows(rows_), m_cols(cols_)
+        template <typename... args>
+        constexpr Vec(T item0, args... rest): data()
         {
-            #ifdef MATRIX_DEBUG
-            std::cout << "FUNC CONSTRUCT\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = (T*)calloc(m_rows * m_cols, sizeof(T));
-            for (std::size_t i = 0; i < m_rows; ++i)
-                for (std::size_t j = 0; j < m_cols; ++j)
-                    (*this)(i, j) = func(i, j);
+            T new_data[] = {item0, rest...};
+            static_assert(sizeof(new_data) / sizeof(T) == dims, "Number of arguments doesn't match with number of dimension for vector");
+            for (std::size_t i = 0; i < dims; ++i)
+                data[i] = new_data[i];
+            for (std::size_t i = dims; i < padded; ++i)
+                data[i] = T();
         }
 
-        Matrix(const Matrix<T>& o): m_rows(o.m_rows), m_cols(o.m_cols)
+        constexpr Vec(const Vec<dims, T> &o): data()
         {
-            #ifdef MATRIX_DEBUG
-            std::cout << "COPY CONSTRUCT\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = (T*)calloc(m_rows * m_cols, sizeof(T));
-            for (std::size_t i = 0; i < m_rows * m_cols; ++i)
+            stats_count(STATS_VEC, copies, 1);
+
+            for (std::size_t i = 0; i < padded; ++i)
                 data[i] = o.data[i];
         }
 
-        Matrix(Matrix<T>&& o): m_rows(o.m_rows), m_cols(o.m_cols)
+        constexpr Vec(Vec<dims, T> &&o): data()
         {
-            #ifdef MATRIX_DEBUG
-            std::cout << "MOVE CONSTRUCT\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = o.data;
-            o.m_rows = o.m_cols = 0;
-            o.data = nullptr;
-        }
+            stats_count(STATS_VEC, moves, 1);
 
-        template <typename E>
-        Matrix(const MatrixExpression<E, T>& expr): m_rows(expr.rows()), m_cols(expr.cols())
+            for (std::size_t i = 0; i < padded; ++i)
+                data[i] = o.data[i];
+        }
+        
+        template <typename K>
+        constexpr Vec(const VecExpression<K, T>& expr): data()
         {
-            #ifdef MATRIX_DEBUG
-            std::cout << "EXPR COPY CONSTRUCT\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            data = (T*)calloc(m_rows * m_cols, sizeof(T));
-            matrix_assert(data != NULL);
-            for (std::size_t i = 0; i < m_rows; ++i)
-                for (std::size_t j = 0; j < m_cols; ++j)
-                    (*this)(i, j) = expr(i, j);
+            stats_count(STATS_VEC, materializations, 1);
+            vec_assert(dims == expr.dim());
+            if (constantEvaluated())
+                assign(static_cast<const K&>(expr), std::false_type());
+            else
+                assign(static_cast<const K&>(expr), std::integral_constant<bool, packed && K::packed>());
         }
 
-        Matrix<T>& operator=(const Matrix<T>& o)
+        ~Vec() = default;
+
+        constexpr Vec<dims, T>& operator=(const Vec<dims, T>& o)
         {
-            #ifdef MATRIX_DEBUG
-            std::cout << "COPY ASSIGN\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            if (data != nullptr)
-                free(data);
-            m_rows = o.m_rows;
-            m_cols = o.m_cols;
-            data = (T*)calloc(m_rows * m_cols, sizeof(T));
-            for (std::size_t i = 0; i < m_rows * m_cols; ++i)
+            stats_count(STATS_VEC, copies, 1);
+
+            for (std::size_t i = 0; i < padded; ++i)
                 data[i] = o.data[i];
-            
             return *this;
         }
 
-        Matrix<T>& operator=(Matrix<T>&& o)
+        constexpr Vec<dims, T>& operator=(Vec<dims, T>&& o)
         {
-            #ifdef MATRIX_DEBUG
-            std::cout << "MOVE ASSIGN\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            m_rows = o.m_rows;
-            m_cols = o.m_cols;
-            data = o.data;
-            o.m_rows = o.m_cols = 0;
-            o.data = nullptr;
+            stats_count(STATS_VEC, moves, 1);
+
+            for (std::size_t i = 0; i < padded; ++i)
+                data[i] = o.data[i];
             return *this;
         }
 
-        template <typename E>
-        Matrix<T>& operator=(const MatrixExpression<E, T>& expr)
+        template <typename K>
+        constexpr Vec<dims, T>& operator=(const VecExpression<K, T>& expr)
         {
-            #ifdef MATRIX_DEBUG
-            std::cout << "EXPR COPY CONSTRUCT\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            m_rows = expr.rows();
-            m_cols = expr.cols();
-
-            if (data != nullptr)
-                free(data);
-
-            data = (T*)calloc(m_rows * m_cols, sizeof(T));
-            matrix_assert(data != NULL);
-            for (std::size_t i = 0; i < m_rows; ++i)
-                for (std::size_t j = 0; j < m_cols; ++j)
-                    (*this)(i, j) = expr(i, j);
+            stats_count(STATS_VEC, materializations, 1);
+            
+            vec_assert(dims == expr.dim());
+            if (constantEvaluated())
+                assign(static_cast<const K&>(expr), std::false_type());
+            else
+                assign(static_cast<const K&>(expr), std::integral_constant<bool, packed && K::packed>());
             return *this;
         }
 
-        ~Matrix()
-        {
-            #ifdef MATRIX_DEBUG
-            std::cout << "MATRIX DESTRUCT\t" << "MATRIX DEBUG COUNT: " << MATRIX_DEBUG_COUNT++ << std::endl;
-            #endif
-            if (data != nullptr)
-                free(data);
-        }
+        //removed %dims
+        constexpr const T& operator[] (std::size_t i) const { return data[i]; }
+        constexpr const T& operator() (std::size_t i) const { return data[i]; }
 
-        T& operator()(std::size_t row, std::size_t col) { return data[row * m_cols + col]; }
-        const T& operator()(std::size_t row, std::size_t col) const { return data[row * m_cols + col]; }
+        constexpr T& operator[] (std::size_t i) { return data[i]; }
+        constexpr T& operator() (std::size_t i) { return data[i]; }
 
-        std::size_t rows() const { return m_rows; }
-        std::size_t cols() const { return m_cols; }
+        constexpr std::size_t dim() const { return dims; }
 
-        Matrix<T>& insertRow()
-        {
-            if (!m_cols)
-                return *this;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::load(data + i); }
 
-            data = (T*)realloc((void*)data, sizeof(T) * (m_rows + 1) * m_cols);
-            matrix_assert(data != NULL);
-            ++m_rows;
+        template <typename F, typename P = SequencedPolicy>
+        Vec<dims, T>& forEach(const F& func, P policy = P())
+        {
+            T *d = data;
+            policyFor(policy, 0, dims, PARALLEL_GRAIN, [d, &func](std::size_t i) { d[i] = func(i); });
             return *this;
         }
 
-        Matrix<T>& insertCol()
+    private:
+        static constexpr std::size_t padded = VecLanes<dims, T>::padded;
+
+        template <typename K>
+        constexpr void assign(const K& expr, std::false_type)
         {
-            if (!m_rows)
-                return *this;
-            
-            expand(m_rows, m_cols + 1);
-            return *this;
+            for (std::size_t i = 0; i < dims; ++i)
+                data[i] = expr[i];
         }
 
-        Matrix<T>& insertRow(const T* row_data)
+        //a register at a time, the last one masked since a division leaves garbage in the padding
+        template <typename K>
+        void assign(const K& expr, std::true_type)
         {
-            insertRow();
-            for (std::size_t j = 0; j < m_cols; ++j)
-                (*this)(m_rows - 1, j) = row_data[j];
-            
-            return *this;
+            typedef SimdOps<T> O;
+            std::size_t i = 0;
+            for (; i + O::width < padded; i += O::width)
+                O::store(data + i, expr.template lanes<O>(i));
+            O::store(data + i, O::keep(expr.template lanes<O>(i), dims - i));
         }
 
-        Matrix<T>& insertRow(const Array<T>& row_data)
-        {
-            if (m_cols == 0)
-            {
-                m_cols = row_data.len();
-                data = (T*)calloc(m_cols, sizeof(T));
-                matrix_assert(data != NULL);
-            }
-
-            matrix_assert(row_data.len() == m_cols);
-            insertRow();
-            for (std::size_t j = 0; j < m_cols; ++j)
-                (*this)(m_rows - 1, j) = row_data[j];
-            
-            return *this;
-        }
-
-        template <std::size_t dim>
-        Matrix<T>& insertRow(const Vec<dim, T>& row_data)
-        {
-            if (m_cols == 0)
-            {
-                m_cols = dim;
-                data = (T*)calloc(m_cols, sizeof(T));
-                matrix_assert(data != NULL);
-            }
-
-
-            matrix_assert(dim == m_cols);
-            insertRow();
-            for (std::size_t j = 0; j < m_cols; ++j)
-                (*this)(m_rows - 1, j) = row_data[j];
-            
-            return *this;
-        }
-
-        Matrix<T>& insertCol(const T* col_data)
-        {
-            insertCol();
-            for (std::size_t i = 0; i < m_rows; ++i)
-                (*this)(i, m_cols - 1) = col_data[i];
-            
-            return *this;
-        }
-
-        Matrix<T>& insertCol(const Array<T>& col_data)
-        {
-            if (m_rows == 0)
-            {
-                m_rows = col_data.len();
-                data = (T*)calloc(m_rows, sizeof(T));
-                matrix_assert(data != NULL);
-            }
-
-
-            matrix_assert(col_data.len() == m_rows);
-            insertCol();
-            for (std::size_t i = 0; i < m_rows; ++i)
-                (*this)(i, m_cols - 1) = col_data[i];
-            
-            return *this;
-        }
-
-        template <std::size_t dim>
-        Matrix<T>& insertCol(const Vec<dim, T>& col_data)
-        {
-            if (m_rows == 0)
-            {
-                m_rows = dim;
-                data = (T*)calloc(m_rows, sizeof(T));
-                matrix_assert(data != NULL);
-            }
-
-
-            matrix_assert(dim == m_rows);
-            insertCol();
-            for (std::size_t i = 0; i < m_rows; ++i)
-                (*this)(i, m_cols - 1) = col_data[i];
-            
-            return *this;
-        }
-
-        Matrix<T>& expand(std::size_t new_row, std::size_t new_col)
-        {
-            T *new_data = (T*)calloc(new_row * new_col, sizeof(T));
-            matrix_assert(new_data != NULL);
-
-            std::size_t min_row = new_row < m_rows? new_row: m_rows;
-            std::size_t min_col = new_col < m_cols? new_col: m_cols;
-            for (std::size_t i = 0; i < min_row; ++i)
-                for (std::size_t j = 0; j < min_col; ++j)
-                    new_data[i * new_col + j] = (*this)(i, j);
-
-            m_rows = new_row;
-            m_cols = new_col;
-
-            if (data != nullptr)
-                free(data);
-            
-            data = new_data;
-            new_data = nullptr;
-            return *this;
-        }
-
-        Matrix<T>& forEach(const std::function<T(std::size_t, std::size_t, T)> &func)
-        {
-            for (std::size_t i = 0; i < m_rows; ++i)
-                for (std::size_t j = 0; j < m_cols; ++j)
-                    (*this)(i, j) = func(i, j, (*this)(i, j));
-            return *this;
-        }
-
-        T determinant()
-        {
-            matrix_assert(0 && "TODO: Implement.");
-        }
-
-    private:
-        std::size_t m_rows, m_cols;
-        T *data;
-        //std::size_t rows_cached, cols_cached
+        alignas(VecLanes<dims, T>::align) T data[padded];
     };
 
     template <typename P1, typename P2, typename T>
-    class MatrixSum : public MatrixExpression<MatrixSum<P1, P2, T>, T>
+    class VecSum : public VecExpression<VecSum<P1, P2, T>, T>
     {
     public:
-        MatrixSum(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        constexpr VecSum(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
         {
-            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            if (p1.dim() != p2.dim())
             {
-                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
-                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
                 exit(-1);
             }
         }
+        constexpr T operator[] (std::size_t i) const { return p1[i] + p2[i]; }
+        constexpr T operator() (std::size_t i) const { return p1[i] + p2[i]; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::add(p1.template lanes<O>(i), p2.template lanes<O>(i)); }
 
-        T operator()(std::size_t row, std::size_t col) const
-        {
-            return p1(row, col) + 
-                   p2(row, col);
-        }
-
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
     private:
         const P1& p1;
         const P2& p2;
     };
 
     template <typename P1, typename P2, typename T>
-    MatrixSum<P1, P2, T> operator+(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    constexpr VecSum<P1, P2, T> operator+(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
     {
-        return MatrixSum<P1, P2, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const P2*>(&m2)
-        );
+        return VecSum<P1, P2, T>(
+            *static_cast<const P1*>(&v1),
+            *static_cast<const P2*>(&v2)
+            );
     }
 
     template <typename P1, typename P2, typename T>
-    class MatrixSub : public MatrixExpression<MatrixSub<P1, P2, T>, T>
+    class VecSub : public VecExpression<VecSub<P1, P2, T>, T>
     {
     public:
-        MatrixSub(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        constexpr VecSub(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
         {
-            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            if (p1.dim() != p2.dim())
             {
-                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
-                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
                 exit(-1);
             }
         }
+        constexpr T operator[] (std::size_t i) const { return p1[i] - p2[i]; }
+        constexpr T operator() (std::size_t i) const { return p1[i] - p2[i]; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::sub(p1.template lanes<O>(i), p2.template lanes<O>(i)); }
 
-        T operator()(std::size_t row, std::size_t col) const
-        {
-            return p1(row, col) - 
-                   p2(row, col);
-        }
-
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
     private:
         const P1& p1;
         const P2& p2;
     };
 
     template <typename P1, typename P2, typename T>
-    MatrixSub<P1, P2, T> operator-(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    constexpr VecSub<P1, P2, T> operator-(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
     {
-        return MatrixSub<P1, P2, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const P2*>(&m2)
-        );
+        return VecSub<P1, P2, T>(
+            *static_cast<const P1*>(&v1),
+            *static_cast<const P2*>(&v2)
+            );
     }
 
     template <typename P1, typename P2, typename T>
-    class MatrixMultK : public MatrixExpression<MatrixMultK<P1, P2, T>, T>
+    class VecMul : public VecExpression<VecMul<P1, P2, T>, T>
     {
     public:
-        MatrixMultK(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        constexpr VecMul(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
         {
-            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            if (p1.dim() != p2.dim())
             {
-                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
-                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
                 exit(-1);
             }
         }
+        constexpr T operator[] (std::size_t i) const { return p1[i] * p2[i]; }
+        constexpr T operator() (std::size_t i) const { return p1[i] * p2[i]; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::mul(p1.template lanes<O>(i), p2.template lanes<O>(i)); }
 
-        T operator()(std::size_t row, std::size_t col) const
-        {
-            return p1(row, col) * 
-                   p2(row, col);
-        }
-
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
     private:
         const P1& p1;
         const P2& p2;
     };
 
     template <typename P1, typename P2, typename T>
-    MatrixMultK<P1, P2, T> operator&(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    constexpr VecMul<P1, P2, T> operator*(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
     {
-        return MatrixMultK<P1, P2, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const P2*>(&m2)
-        );
+        return VecMul<P1, P2, T>(
+            *static_cast<const P1*>(&v1),
+            *static_cast<const P2*>(&v2)
+            );
     }
 
     template <typename P1, typename P2, typename T>
-    class MatrixDiv : public MatrixExpression<MatrixDiv<P1, P2, T>, T>
+    class VecDiv : public VecExpression<VecDiv<P1, P2, T>, T>
     {
     public:
-        MatrixDiv(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        constexpr VecDiv(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
         {
-            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            if (p1.dim() != p2.dim())
             {
-                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
-                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
                 exit(-1);
             }
-        }
-
-        T operator()(std::size_t row, std::size_t col) const
-        {
-            return p1(row, col) / 
-                   p2(row, col);
-        }
+        }        
+        constexpr T operator[] (std::size_t i) const { return p1[i] / p2[i]; }
+        constexpr T operator() (std::size_t i) const { return p1[i] / p2[i]; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        //the padding of the divisor is zero, 1 there keeps 0 / 0 from raising FE_INVALID
+        typename O::reg lanes(std::size_t i) const { return O::div(p1.template lanes<O>(i), O::pad(p2.template lanes<O>(i), p2.dim() - i, T(1))); }
 
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
     private:
         const P1& p1;
         const P2& p2;
     };
 
     template <typename P1, typename P2, typename T>
-    MatrixDiv<P1, P2, T> operator/(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    constexpr VecDiv<P1, P2, T> operator/(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
     {
-        return MatrixDiv<P1, P2, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const P2*>(&m2)
-        );
+        return VecDiv<P1, P2, T>(
+            *static_cast<const P1*>(&v1),
+            *static_cast<const P2*>(&v2)
+            );
     }
 
-    template <typename P1, typename P2, typename T>
-    class MatrixMult : public MatrixExpression<MatrixMult<P1, P2, T>, T>
+    template <typename P1, typename T>
+    class VecScaM : public VecExpression<VecScaM<P1, T>, T>
     {
     public:
-        MatrixMult(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
-        {
-            if (p1.cols() != p2.rows())
-            {
-                std::cerr << "Cols of Matrix A(" << p1.cols() <<  ") doesn't match rows of Matrix B(" << p2.rows() << ")" << std::endl;
-                exit(-1);
-            }
-        }
-
-        T operator()(std::size_t row, std::size_t col) const 
-        {
-            T ret = T();
-            for (std::size_t i = 0; i < p1.cols(); ++i)
-                ret = ret + p1(row, i) * p2(i, col);
-            return ret;
-        }
-
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p2.cols(); }
+        constexpr VecScaM(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T operator[] (std::size_t i) const { return p1[i] * s; }
+        constexpr T operator() (std::size_t i) const { return p1[i] * s; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::mul(p1.template lanes<O>(i), O::set(s)); }
+
+        constexpr const P1& operand() const { return p1; }
+        constexpr const T& scalar() const { return s; }
     private:
         const P1& p1;
-        const P2& p2;
+        //by value, folded scalars are temporaries
+        const T s;
     };
 
-    template <typename P1, typename P2, typename T>
-    MatrixMult<P1, P2, T> operator*(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    template <typename P1, typename T>
+    constexpr VecScaM<P1, T> operator*(const VecExpression<P1, T>& v1, const T& v2)
     {
-        return MatrixMult<P1, P2, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const P2*>(&m2)
-        );
+        return VecScaM<P1, T>(
+            *static_cast<const P1*>(&v1),
+            v2
+            );
     }
 
-    template <typename P1, typename P2, typename T>
-    class MatrixTensor : public MatrixExpression<MatrixTensor<P1, P2, T>, T>
+    template <typename P1, typename T>
+    constexpr VecScaM<P1, T> operator*(const T& v2, const VecExpression<P1, T>& v1)
     {
-    public:
-        MatrixTensor(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
-
-        T operator()(std::size_t row, std::size_t col) const
-        {
-            size_t iA = row / p2.rows();
-            size_t jA = col / p2.cols();
-
-            size_t iB = row % p2.rows();
-            size_t jB = col % p2.cols();
+        return VecScaM<P1, T>(
+            *static_cast<const P1*>(&v1),
+            v2
+            );
+    }
 
-            return p1(iA, jA) * p2(iB, jB);
-        }
+    template <typename P1, typename T>
+    class VecScaDiv : public VecExpression<VecScaDiv<P1, T>, T>
+    {
+    public:
+        constexpr VecScaDiv(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T operator[] (std::size_t i) const { return p1[i] / s; }
+        constexpr T operator() (std::size_t i) const { return p1[i] / s; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::div(p1.template lanes<O>(i), O::set(s)); }
+
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    constexpr VecScaDiv<P1, T> operator/(const VecExpression<P1, T>& v1, const T& v2)
+    {
+        return VecScaDiv<P1, T>(
+            *static_cast<const P1*>(&v1),
+            v2
+            );
+    }
+
+    template <typename P1, typename T>
+    class VecScaDivI : public VecExpression<VecScaDivI<P1, T>, T>
+    {
+    public:
+        constexpr VecScaDivI(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T operator[] (std::size_t i) const { return s / p1[i]; }
+        constexpr T operator() (std::size_t i) const { return s / p1[i]; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::div(O::set(s), O::pad(p1.template lanes<O>(i), p1.dim() - i, T(1))); }
+
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    constexpr VecScaDivI<P1, T> operator/(const T& v2, const VecExpression<P1, T>& v1)
+    {
+        return VecScaDivI<P1, T>(
+            *static_cast<const P1*>(&v1),
+            v2
+            );
+    }
+
+    template <typename P1, typename T>
+    class VecMinus : public VecExpression<VecMinus<P1, T>, T>
+    {
+    public:
+        constexpr VecMinus(const P1& p1_): p1(p1_){ }
+        constexpr T operator[] (std::size_t i) const { return -p1[i]; }
+        constexpr T operator() (std::size_t i) const { return -p1[i]; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::neg(p1.template lanes<O>(i)); }
+
+        constexpr const P1& operand() const { return p1; }
+    private:
+        const P1& p1;
+    };
+
+    template <typename P1, typename T>
+    constexpr VecMinus<P1, T> operator-(const VecExpression<P1, T>& v1)
+    {
+        return VecMinus<P1, T>(
+            *static_cast<const P1*>(&v1)
+            );
+    }
+
+    //v1 * s1 + v2 * s2, as (v1 + v2) * s when both scalars are the same
+    template <typename P1, typename P2, typename T>
+    class VecSumS : public VecExpression<VecSumS<P1, P2, T>, T>
+    {
+    public:
+        constexpr VecSumS(const P1& p1_, const T& s1_, const P2& p2_, const T& s2_): p1(p1_), p2(p2_), s1(s1_), s2(s2_), common(s1_ == s2_)
+        {
+            if (p1.dim() != p2.dim())
+            {
+                std::cerr << "Vecs with different dimensions: " << p1.dim() << " x " << p2.dim() << std::endl;
+                exit(-1);
+            }
+        }
+        constexpr T operator[] (std::size_t i) const { return common? (p1[i] + p2[i]) * s1: p1[i] * s1 + p2[i] * s2; }
+        constexpr T operator() (std::size_t i) const { return (*this)[i]; }
+        constexpr std::size_t dim() const { return p1.dim(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const
+        {
+            typename O::reg a = p1.template lanes<O>(i), b = p2.template lanes<O>(i);
+            return common? O::mul(O::add(a, b), O::set(s1)): O::add(O::mul(a, O::set(s1)), O::mul(b, O::set(s2)));
+        }
 
-        std::size_t rows() const { return p1.rows() * p2.rows(); }
-        std::size_t cols() const { return p1.cols() * p2.cols(); }
     private:
         const P1& p1;
         const P2& p2;
+        const T s1, s2;
+        const bool common;
     };
 
+    //simplification rules, picked over the generic operators because they are more specialized
+
+    //-(-v) = v
+    template <typename P1, typename T>
+    constexpr const P1& operator-(const VecMinus<P1, T>& v1)
+    {
+        return v1.operand();
+    }
+
+    //s2 * (v * s1) = v * (s1 s2)
+    template <typename P1, typename T>
+    constexpr VecScaM<P1, T> operator*(const VecScaM<P1, T>& v1, const T& s)
+    {
+        return VecScaM<P1, T>(v1.operand(), v1.scalar() * s);
+    }
+
+    template <typename P1, typename T>
+    constexpr VecScaM<P1, T> operator*(const T& s, const VecScaM<P1, T>& v1)
+    {
+        return VecScaM<P1, T>(v1.operand(), s * v1.scalar());
+    }
+
+    //-(v * s) = v * (-s)
+    template <typename P1, typename T>
+    constexpr VecScaM<P1, T> operator-(const VecScaM<P1, T>& v1)
+    {
+        return VecScaM<P1, T>(v1.operand(), -v1.scalar());
+    }
+
+    //(-v) * s = v * (-s)
+    template <typename P1, typename T>
+    constexpr VecScaM<P1, T> operator*(const VecMinus<P1, T>& v1, const T& s)
+    {
+        return VecScaM<P1, T>(v1.operand(), -s);
+    }
+
+    template <typename P1, typename T>
+    constexpr VecScaM<P1, T> operator*(const T& s, const VecMinus<P1, T>& v1)
+    {
+        return VecScaM<P1, T>(v1.operand(), -s);
+    }
+
+    //v1 * s1 + v2 * s2 in one node, a single multiply when s1 == s2
     template <typename P1, typename P2, typename T>
-    MatrixTensor<P1, P2, T> operator%(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    constexpr VecSumS<P1, P2, T> operator+(const VecScaM<P1, T>& v1, const VecScaM<P2, T>& v2)
+    {
+        return VecSumS<P1, P2, T>(v1.operand(), v1.scalar(), v2.operand(), v2.scalar());
+    }
+
+    template <typename P1, typename P2, typename T>
+    constexpr T operator^(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
+    {
+        if (v1.dim() != v2.dim())
+        {
+            std::cerr << "Trying to dot product with vecs of different lengths: " << v1.dim() << " x " << v2.dim() << std::endl;
+            exit(-1);
+        }
+        return dot(v1, v2);
+    }
+
+    template <typename E, typename T>
+    std::ostream& operator<<(std::ostream& out, const VecExpression<E, T>& v)
+    {
+        for (std::size_t i = 0; i < v.dim() - 1; ++i)
+            out << v[i] << SEPARATOR;
+        std::size_t i = v.dim() - 1;
+        out << v[i];
+        return out;
+    }
+
+    using Vec2f = Vec<2, float>;
+    using Vec2d = Vec<2, double>;
+    using Vec2i = Vec<2, int>;
+
+    using Vec3f = Vec<3, float>;
+    using Vec3d = Vec<3, double>;
+    using Vec3i = Vec<3, int>;
+}
+
+//ARRAY
+namespace stuff
+{
+    //like the Vec ones, packed expressions give elements [i, i + O::width) with lanes<O>(i). The
+    //others only go one element at a time, with O = ScalarOps<T>
+    template <typename E, typename T>
+    class ArrayExpression
+    {
+    public:
+        static constexpr bool packed = false;
+        std::size_t len() const { return static_cast<const E&>(*this).len(); }
+        T operator[](std::size_t i) const { return static_cast<const E&>(*this)[i]; }
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return static_cast<const E&>(*this)[i]; }
+    };
+
+    template <typename T, std::size_t N>
+    class Array : public ArrayExpression<Array<T, N>, T>, private InlineBuffer<T, N>
+    {
+    public:
+        Array(): data(this->inlineData()), sz_cached(N), elems(0)
+        {
+        }
+        
+        //zeroed memory is T() for the trivially copyable types, the others are constructed
+        Array(std::size_t n): sz_cached(n), elems(n)
+        {
+            data = acquire(sz_cached, true);
+            if (!std::is_trivially_copyable<T>::value)
+                for (std::size_t i = 0; i < n; ++i)
+                    new (data + i) T();
+        }
+
+        template <typename F, typename P = SequencedPolicy>
+        Array(std::size_t n, const F& func, P policy = P()): sz_cached(n), elems(n)
+        {
+            data = acquire(sz_cached, false);
+            T *d = data;
+            policyFor(policy, 0, n, PARALLEL_GRAIN, [d, &func](std::size_t i) { new (d + i) T(func(i)); });
+        }
+
+        Array(const Array<T, N>& o): sz_cached(o.elems), elems(o.elems)
+        {
+            stats_count(STATS_ARRAY, copies, 1);
+            data = acquire(sz_cached, false);
+            constructElems(data, o.data, elems);
+        }
+
+        Array(Array<T, N>&& o): sz_cached(o.sz_cached), elems(o.elems)
+        {
+            stats_count(STATS_ARRAY, moves, 1);
+            take(o);
+        }
+
+        template <typename E>
+        Array(const ArrayExpression<E, T>& expr)
+        {
+            stats_count(STATS_ARRAY, materializations, 1);
+            profile_kernel("array assign");
+            sz_cached = expr.len();
+            elems = expr.len();
+            data = acquire(sz_cached, false);
+            T *dst = data;
+            parallelFor(0, elems, PARALLEL_GRAIN, [dst, &expr](std::size_t b, std::size_t e)
+            {
+                for (std::size_t i = b; i < e; ++i)
+                    new (dst + i) T(expr[i]);
+            });
+        }
+
+        Array<T, N>& operator=(const Array<T, N>& o)
+        {
+            stats_count(STATS_ARRAY, copies, 1);
+            if (this == &o)
+                return *this;
+            destroyElems(data, elems);
+            elems = 0;
+            if (data == nullptr || sz_cached < o.elems)
+            {
+                release();
+                sz_cached = o.elems;
+                data = acquire(sz_cached, false);
+            }
+            constructElems(data, o.data, o.elems);
+            elems = o.elems;
+            return *this;
+        }
+
+        Array<T, N>& operator=(Array<T, N>&& o)
+        {
+            stats_count(STATS_ARRAY, moves, 1);
+            if (this == &o)
+                return *this;
+            release();
+            elems = o.elems;
+            sz_cached = o.sz_cached;
+            take(o);
+            return *this;
+        }
+
+        template <typename E>
+        Array<T, N>& operator=(const ArrayExpression<E, T>& expr)
+        {
+            stats_count(STATS_ARRAY, materializations, 1);
+            profile_kernel("array assign");
+            //evaluated into a new buffer, expr may be reading from this array
+            std::size_t n = expr.len();
+            if (n <= N)
+            {
+                InlineBuffer<T, N> tmp;
+                for (std::size_t i = 0; i < n; ++i)
+                    new (tmp.inlineData() + i) T(expr[i]);
+                release();
+                data = this->inlineData();
+                relocateElems(data, tmp.inlineData(), n);
+                sz_cached = N;
+            }
+            else
+            {
+                T *new_data = allocElems<T>(n);
+                stats_count(STATS_ARRAY, allocs, 1);
+                stats_count(STATS_ARRAY, bytes, n * sizeof(T));
+                parallelFor(0, n, PARALLEL_GRAIN, [new_data, &expr](std::size_t b, std::size_t e)
+                {
+                    for (std::size_t i = b; i < e; ++i)
+                        new (new_data + i) T(expr[i]);
+                });
+                release();
+                data = new_data;
+                sz_cached = n;
+            }
+            elems = n;
+            return *this;
+        }
+
+        ~Array()
+        {
+            release();
+        }
+
+        std::size_t len() const { return elems; }
+        std::size_t capacity() const { return sz_cached; }
+        //removed %elems and array_assert(elems > 0)
+        const T& operator[](std::size_t i) const{ return data[i]; }
+        T& operator[](std::size_t i) { return data[i]; }
+        static constexpr bool packed = SimdOps<T>::width > 1;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::load(data + i); }
+        Array<T, N>& insert(const T& obj)
+        {
+            return emplace(obj);
+        }
+        
+        Array<T, N>& insert(T&& obj)
+        {
+            return emplace(std::move(obj));
+        }
+
+        //constructs the new last element from args, in place
+        template <typename... Args>
+        Array<T, N>& emplace(Args&&... args)
+        {
+            if (elems == sz_cached)
+            {
+                //args may be referencing an element that is about to move
+                T tmp(std::forward<Args>(args)...);
+                grow(nextCapacity(elems + 1));
+                new (data + elems) T(std::move(tmp));
+            }
+            else
+                new (data + elems) T(std::forward<Args>(args)...);
+            ++elems;
+            return *this;
+        }
+
+        //copies n elements from src to the end, src may point into this array
+        Array<T, N>& append(const T* src, std::size_t n)
+        {
+            if (elems + n > sz_cached)
+            {
+                std::less<const T*> before;
+                bool inside = data != nullptr && !before(src, data) && before(src, data + elems);
+                std::size_t offset = inside? src - data: 0;
+                grow(nextCapacity(elems + n));
+                if (inside)
+                    src = data + offset;
+            }
+            constructElems(data + elems, src, n);
+            elems += n;
+            return *this;
+        }
+
+        template <std::size_t M>
+        Array<T, N>& append(const Array<T, M>& o)
+        {
+            return o.len() == 0? *this: append(&o[0], o.len());
+        }
+
+        //evaluates expr straight into the new elements at the end. expr may read from this array
+        template <typename E>
+        Array<T, N>& extend(const ArrayExpression<E, T>& expr)
+        {
+            profile_kernel("array extend");
+            std::size_t n = expr.len();
+            if (elems + n > sz_cached)
+                grow(nextCapacity(elems + n));
+            T *dst = data + elems;
+            parallelFor(0, n, PARALLEL_GRAIN, [dst, &expr](std::size_t b, std::size_t e)
+            {
+                for (std::size_t i = b; i < e; ++i)
+                    new (dst + i) T(expr[i]);
+            });
+            elems += n;
+            return *this;
+        }
+
+        //room for n elements without growing again, never shrinks
+        Array<T, N>& reserve(std::size_t n)
+        {
+            if (n > sz_cached)
+                grow(n);
+            return *this;
+        }
+
+        //n elements, the new ones set to value
+        Array<T, N>& resize(std::size_t n, const T& value = T())
+        {
+            if (n > sz_cached)
+                grow(n);
+            for (std::size_t i = elems; i < n; ++i)
+                new (data + i) T(value);
+            for (std::size_t i = n; i < elems; ++i)
+                data[i].~T();
+            elems = n;
+            return *this;
+        }
+
+        //gives back the unused capacity, moving into the inline buffer when the elements fit
+        Array<T, N>& shrink_to_fit()
+        {
+            if (isInline() || elems == sz_cached)
+                return *this;
+            if (elems <= N)
+            {
+                T *old = data;
+                data = this->inlineData();
+                relocateElems(data, old, elems);
+                sz_cached = N;
+                stats_count(STATS_ARRAY, frees, 1);
+                memFree(old);
+            }
+            else
+                reallocate(elems);
+            return *this;
+        }
+
+        //removes the last element and returns it
+        T pop()
+        {
+            T ret(std::move(data[elems - 1]));
+            data[--elems].~T();
+            return ret;
+        }
+
+        template <typename F, typename P = SequencedPolicy>
+        Array<T, N>& forEach(const F& func, P policy = P())
+        {
+            T *d = data;
+            policyFor(policy, 0, elems, PARALLEL_GRAIN, [d, &func](std::size_t i) { d[i] = func(i, d[i]); });
+            return *this;
+        }
+
+    private:
+        bool isInline() const { return N > 0 && data == this->inlineData(); }
+
+        //storage for `cap` elements, the inline buffer if they fit. `cap` is updated to the real capacity
+        T* acquire(std::size_t& cap, bool zero)
+        {
+            if (N > 0 && cap <= N)
+            {
+                cap = N;
+                if (zero)
+                    memset((void*)this->inlineData(), 0, N * sizeof(T));
+                return this->inlineData();
+            }
+            T *ret = zero? (T*)memCalloc(cap, sizeof(T)): allocElems<T>(cap);
+            array_assert(ret != NULL || cap == 0);
+            stats_count(STATS_ARRAY, allocs, 1);
+            stats_count(STATS_ARRAY, bytes, cap * sizeof(T));
+            return ret;
+        }
+
+        //ends the elements and frees the buffer, elems is left for the caller to set
+        void release()
+        {
+            if (data != nullptr)
+                destroyElems(data, elems);
+            if (!isInline() && data != nullptr)
+            {
+                stats_count(STATS_ARRAY, frees, 1);
+                memFree(data);
+            }
+            data = nullptr;
+        }
+
+        //moves o's elements here (elems and sz_cached already copied) and leaves o empty
+        void take(Array<T, N>& o)
+        {
+            if (o.isInline())
+            {
+                data = this->inlineData();
+                relocateElems(data, o.data, elems);
+            }
+            else
+                data = o.data;
+            o.data = o.inlineData();
+            o.elems = 0;
+            o.sz_cached = N;
+        }
+
+        //geometric growth, ARRAY_GROWTH_FACTOR times the capacity but at least ARRAY_NEW_SIZE_FACTOR more
+        //elements, so n insertions copy O(n) elements in total
+        std::size_t nextCapacity(std::size_t needed) const
+        {
+            std::size_t cap = (std::size_t)(sz_cached * ARRAY_GROWTH_FACTOR);
+            if (cap < sz_cached + ARRAY_NEW_SIZE_FACTOR)
+                cap = sz_cached + ARRAY_NEW_SIZE_FACTOR;
+            return cap < needed? needed: cap;
+        }
+
+        void grow(std::size_t cap)
+        {
+            if (isInline() || data == nullptr)
+            {
+                T *new_data = allocElems<T>(cap);
+                array_assert(new_data != NULL);
+                stats_count(STATS_ARRAY, allocs, 1);
+                relocateElems(new_data, data, elems);
+                data = new_data;
+                sz_cached = cap;
+            }
+            else
+                reallocate(cap);
+            stats_count(STATS_ARRAY, bytes, cap * sizeof(T));
+        }
+
+        //moves the heap buffer to one of cap elements, with realloc only when the elements allow it
+        void reallocate(std::size_t cap)
+        {
+            if (std::is_trivially_copyable<T>::value)
+            {
+                data = (T*)memRealloc((void*)data, sizeof(T) * cap);
+                array_assert(data != NULL);
+                stats_count(STATS_ARRAY, reallocs, 1);
+            }
+            else
+            {
+                T *new_data = allocElems<T>(cap);
+                array_assert(new_data != NULL);
+                stats_count(STATS_ARRAY, allocs, 1);
+                relocateElems(new_data, data, elems);
+                stats_count(STATS_ARRAY, frees, 1);
+                memFree(data);
+                data = new_data;
+            }
+            sz_cached = cap;
+        }
+
+        T *data;
+        std::size_t sz_cached;
+        std::size_t elems;
+    };
+
+    template <typename P1, typename P2, typename T>
+    class ArraySum : public ArrayExpression<ArraySum<P1, P2, T>, T>
+    {
+    public:
+        ArraySum(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (p1.len() != p2.len())
+            {
+                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
+            }
+        }
+        T operator[](std::size_t i) const { return p1[i] + p2[i]; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::add(p1.template lanes<O>(i), p2.template lanes<O>(i)); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    ArraySum<P1, P2, T> operator+(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
+    {
+        return ArraySum<P1, P2, T>(
+            *static_cast<const P1*>(&v1),
+            *static_cast<const P2*>(&v2)
+        );
+    }
+
+    template <typename P1, typename P2, typename T>
+    class ArraySub : public ArrayExpression<ArraySub<P1, P2, T>, T>
+    {
+    public:
+        ArraySub(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (p1.len() != p2.len())
+            {
+                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
+            }
+        }
+        T operator[](std::size_t i) const { return p1[i] - p2[i]; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::sub(p1.template lanes<O>(i), p2.template lanes<O>(i)); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    ArraySub<P1, P2, T> operator-(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
+    {
+        return ArraySub<P1, P2, T>(
+            *static_cast<const P1*>(&v1),
+            *static_cast<const P2*>(&v2)
+        );
+    }
+
+    template <typename P1, typename P2, typename T>
+    class ArrayMul : public ArrayExpression<ArrayMul<P1, P2, T>, T>
+    {
+    public:
+        ArrayMul(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (p1.len() != p2.len())
+            {
+                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
+            }
+        }
+        T operator[](std::size_t i) const { return p1[i] * p2[i]; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::mul(p1.template lanes<O>(i), p2.template lanes<O>(i)); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    ArrayMul<P1, P2, T> operator*(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
+    {
+        return ArrayMul<P1, P2, T>(
+            *static_cast<const P1*>(&v1),
+            *static_cast<const P2*>(&v2)
+        );
+    }
+
+    template <typename P1, typename P2, typename T>
+    class ArrayDiv : public ArrayExpression<ArrayDiv<P1, P2, T>, T>
+    {
+    public:
+        ArrayDiv(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (p1.len() != p2.len())
+            {
+                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
+            }
+        }
+        T operator[](std::size_t i) const { return p1[i] / p2[i]; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::div(p1.template lanes<O>(i), p2.template lanes<O>(i)); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    ArrayDiv<P1, P2, T> operator/(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
+    {
+        return ArrayDiv<P1, P2, T>(
+            *static_cast<const P1*>(&v1),
+            *static_cast<const P2*>(&v2)
+        );
+    }
+
+    template <typename P1, typename T>
+    class ArraySca : public ArrayExpression<ArraySca<P1, T>, T>
+    {
+    public:
+        ArraySca(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        T operator[](std::size_t i) const { return s * p1[i]; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::mul(O::set(s), p1.template lanes<O>(i)); }
+        const P1& operand() const { return p1; }
+        const T& scalar() const { return s; }
+    private:
+        const P1& p1;
+        //by value, folded scalars are temporaries
+        const T s;
+    };
+
+    template <typename P1, typename T>
+    ArraySca<P1, T> operator*(const T& s, const ArrayExpression<P1, T>& v1)
+    {
+        return ArraySca<P1, T>(
+            *static_cast<const P1*>(&v1), 
+            s
+        );
+    }
+
+    template <typename P1, typename T>
+    ArraySca<P1, T> operator*(const ArrayExpression<P1, T>& v1, const T& s)
+    {
+        return ArraySca<P1, T>(
+            *static_cast<const P1*>(&v1), 
+            s
+        );
+    }
+
+    template <typename P1, typename T>
+    class ArrayScaD : public ArrayExpression<ArrayScaD<P1, T>, T>
+    {
+    public:
+        ArrayScaD(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        T operator[](std::size_t i) const { return p1[i] / s; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::div(p1.template lanes<O>(i), O::set(s)); }
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    ArrayScaD<P1, T> operator/(const ArrayExpression<P1, T>& v1, const T& s)
+    {
+        return ArrayScaD<P1, T>(
+            *static_cast<const P1*>(&v1), 
+            s
+        );
+    }
+
+    template <typename P1, typename T>
+    class ArrayScaI : public ArrayExpression<ArrayScaI<P1, T>, T>
+    {
+    public:
+        ArrayScaI(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        T operator[](std::size_t i) const { return s / p1[i]; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::div(O::set(s), p1.template lanes<O>(i)); }
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    ArrayScaI<P1, T> operator/(const T& s, const ArrayExpression<P1, T>& v1)
+    {
+        return ArrayScaI<P1, T>(
+            *static_cast<const P1*>(&v1), 
+            s
+        );
+    }
+
+    template <typename P1, typename T>
+    class ArrayNeg : public ArrayExpression<ArrayNeg<P1, T>, T>
+    {
+    public:
+        ArrayNeg(const P1& p1_): p1(p1_) { }
+        T operator[](std::size_t i) const { return -p1[i]; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::neg(p1.template lanes<O>(i)); }
+        const P1& operand() const { return p1; }
+    private:
+        const P1& p1;
+    };
+
+    template <typename P1, typename T>
+    ArrayNeg<P1, T> operator-(const ArrayExpression<P1, T>& v1)
+    {
+        return ArrayNeg<P1, T>(
+            *static_cast<const P1*>(&v1)
+        );
+    }
+
+    //s1 * a + s2 * b, as s * (a + b) when both scalars are the same
+    template <typename P1, typename P2, typename T>
+    class ArraySumS : public ArrayExpression<ArraySumS<P1, P2, T>, T>
+    {
+    public:
+        ArraySumS(const P1& p1_, const T& s1_, const P2& p2_, const T& s2_): p1(p1_), p2(p2_), s1(s1_), s2(s2_), common(s1_ == s2_)
+        {
+            if (p1.len() != p2.len())
+            {
+                std::cerr << "Arrays with different size: " << p1.len() << " x " << p2.len() << std::endl;
+            }
+        }
+        T operator[](std::size_t i) const { return common? s1 * (p1[i] + p2[i]): s1 * p1[i] + s2 * p2[i]; }
+        std::size_t len() const { return p1.len(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const
+        {
+            typename O::reg a = p1.template lanes<O>(i), b = p2.template lanes<O>(i);
+            return common? O::mul(O::set(s1), O::add(a, b)): O::add(O::mul(O::set(s1), a), O::mul(O::set(s2), b));
+        }
+    private:
+        const P1& p1;
+        const P2& p2;
+        const T s1, s2;
+        const bool common;
+    };
+
+    //simplification rules, same as the Vec ones
+
+    //-(-a) = a
+    template <typename P1, typename T>
+    const P1& operator-(const ArrayNeg<P1, T>& v1)
+    {
+        return v1.operand();
+    }
+
+    //s2 * (s1 * a) = (s2 s1) * a
+    template <typename P1, typename T>
+    ArraySca<P1, T> operator*(const T& s, const ArraySca<P1, T>& v1)
+    {
+        return ArraySca<P1, T>(v1.operand(), s * v1.scalar());
+    }
+
+    template <typename P1, typename T>
+    ArraySca<P1, T> operator*(const ArraySca<P1, T>& v1, const T& s)
+    {
+        return ArraySca<P1, T>(v1.operand(), v1.scalar() * s);
+    }
+
+    //-(s * a) = (-s) * a
+    template <typename P1, typename T>
+    ArraySca<P1, T> operator-(const ArraySca<P1, T>& v1)
+    {
+        return ArraySca<P1, T>(v1.operand(), -v1.scalar());
+    }
+
+    //s * (-a) = (-s) * a
+    template <typename P1, typename T>
+    ArraySca<P1, T> operator*(const T& s, const ArrayNeg<P1, T>& v1)
+    {
+        return ArraySca<P1, T>(v1.operand(), -s);
+    }
+
+    template <typename P1, typename T>
+    ArraySca<P1, T> operator*(const ArrayNeg<P1, T>& v1, const T& s)
+    {
+        return ArraySca<P1, T>(v1.operand(), -s);
+    }
+
+    //s1 * a + s2 * b in one node, a single multiply when s1 == s2
+    template <typename P1, typename P2, typename T>
+    ArraySumS<P1, P2, T> operator+(const ArraySca<P1, T>& v1, const ArraySca<P2, T>& v2)
+    {
+        return ArraySumS<P1, P2, T>(v1.operand(), v1.scalar(), v2.operand(), v2.scalar());
+    }
+
+    template <typename P1, typename P2, typename T>
+    T operator^(const ArrayExpression<P1, T>& p1, const ArrayExpression<P2, T>& p2)
+    {
+        if (p1.len() != p2.len())
+        {
+            std::cerr << "Trying to dot product with arrays of different lengths: " << p1.len() << " x " << p2.len() << std::endl;
+            exit(-1);
+        }
+        return dot(p1, p2);
+    }
+
+    template <typename E, typename T>
+    std::ostream& operator<<(std::ostream& out, const ArrayExpression<E, T>& v)
+    {
+        if (v.len() == 0)
+            return out;
+        
+        for (std::size_t i = 0; i < v.len() - 1; ++i)
+            out << v[i] << SEPARATOR;
+
+        std::size_t i = v.len() - 1;
+        out << v[i];
+        return out;
+    }
+}
+
+//CONCURRENT ARRAY
+//append only array many threads can insert into at once. An insertion reserves its indices with one
+//atomic add, elements live in segments that never move: segment k holds CONCURRENT_FIRST_SEGMENT << k
+//elements, so the array grows geometrically without copying. The insertion that reserves the first
+//index of a segment allocates it, the others wait for it to show up.
+//Elements are only safe to read once the threads writing them are done (e.g. after parallelFor
+//returns), toArray() copies them into one contiguous Array
+namespace stuff
+{
+    static_assert((CONCURRENT_FIRST_SEGMENT & (CONCURRENT_FIRST_SEGMENT - 1)) == 0, "CONCURRENT_FIRST_SEGMENT must be a power of 2");
+
+    //index of the highest set bit, x > 0
+    constexpr std::size_t constHighestBit(std::size_t x) { return x > 1? 1 + constHighestBit(x >> 1): 0; }
+    inline std::size_t highestBit(std::size_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll((unsigned long long)x);
+#else
+        return constHighestBit(x);
+#endif
+    }
+
+    template <typename T>
+    class ConcurrentArray : public ArrayExpression<ConcurrentArray<T>, T>
+    {
+    public:
+        ConcurrentArray(): reserved(0)
+        {
+            for (std::size_t k = 0; k < SEGMENTS; ++k)
+                segments[k].store(nullptr, std::memory_order_relaxed);
+        }
+
+        ConcurrentArray(const ConcurrentArray<T>&) = delete;
+        ConcurrentArray<T>& operator=(const ConcurrentArray<T>&) = delete;
+
+        //not thread safe
+        ConcurrentArray(ConcurrentArray<T>&& o): reserved(o.reserved.load(std::memory_order_relaxed))
+        {
+            stats_count(STATS_ARRAY, moves, 1);
+            for (std::size_t k = 0; k < SEGMENTS; ++k)
+            {
+                segments[k].store(o.segments[k].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                o.segments[k].store(nullptr, std::memory_order_relaxed);
+            }
+            o.reserved.store(0, std::memory_order_relaxed);
+        }
+
+        ~ConcurrentArray()
+        {
+            destroyAll();
+            for (std::size_t k = 0; k < SEGMENTS; ++k)
+            {
+                T *seg = segments[k].load(std::memory_order_relaxed);
+                if (seg != nullptr)
+                {
+                    stats_count(STATS_ARRAY, frees, 1);
+                    memFree(seg);
+                }
+            }
+        }
+
+        //indices reserved so far, elements still being written by other threads included
+        std::size_t len() const { return reserved.load(std::memory_order_relaxed); }
+        std::size_t capacity() const
+        {
+            std::size_t k = 0;
+            while (k < SEGMENTS && segments[k].load(std::memory_order_relaxed) != nullptr)
+                ++k;
+            return segmentStart(k);
+        }
+
+        const T& operator[](std::size_t i) const
+        {
+            std::size_t k = segmentOf(i);
+            return segments[k].load(std::memory_order_acquire)[i - segmentStart(k)];
+        }
+
+        T& operator[](std::size_t i)
+        {
+            std::size_t k = segmentOf(i);
+            return segments[k].load(std::memory_order_acquire)[i - segmentStart(k)];
+        }
+
+        //the following are thread safe, each one returns the index of its (first) element
+        std::size_t insert(const T& obj)
+        {
+            return emplace(obj);
+        }
+
+        template <typename... Args>
+        std::size_t emplace(Args&&... args)
+        {
+            std::size_t i = reserved.fetch_add(1, std::memory_order_relaxed);
+            std::size_t k = segmentOf(i);
+            std::size_t start = segmentStart(k);
+            T *seg = i == start? publish(k): wait(k);
+            new (seg + i - start) T(std::forward<Args>(args)...);
+            return i;
+        }
+
+        //reserves n indices with a single atomic add, the cheap way to insert many elements per thread
+        std::size_t append(const T* src, std::size_t n)
+        {
+            std::size_t first = reserved.fetch_add(n, std::memory_order_relaxed);
+            std::size_t i = first, end = first + n;
+            while (i < end)
+            {
+                std::size_t k = segmentOf(i);
+                std::size_t start = segmentStart(k);
+                std::size_t stop = segmentStart(k + 1) < end? segmentStart(k + 1): end;
+                T *seg = i == start? publish(k): wait(k);
+                constructElems(seg + i - start, src + i - first, stop - i);
+                i = stop;
+            }
+            return first;
+        }
+
+        template <std::size_t M>
+        std::size_t append(const Array<T, M>& o)
+        {
+            return o.len() == 0? len(): append(&o[0], o.len());
+        }
+
+        //allocates the segments for n elements up front, so inserting them never waits for memory
+        ConcurrentArray<T>& reserve(std::size_t n)
+        {
+            for (std::size_t k = 0; k < SEGMENTS && segmentStart(k) < n; ++k)
+                publish(k);
+            return *this;
+        }
+
+        //not thread safe, keeps the segments
+        ConcurrentArray<T>& clear()
+        {
+            destroyAll();
+            reserved.store(0, std::memory_order_relaxed);
+            return *this;
+        }
+
+        //contiguous copy of the elements, once every insertion is done
+        Array<T> toArray() const
+        {
+            std::size_t n = len();
+            Array<T> ret;
+            ret.reserve(n);
+            for (std::size_t k = 0; segmentStart(k) < n; ++k)
+            {
+                std::size_t start = segmentStart(k);
+                std::size_t stop = segmentStart(k + 1) < n? segmentStart(k + 1): n;
+                ret.append(segments[k].load(std::memory_order_acquire), stop - start);
+            }
+            return ret;
+        }
+
+    private:
+        //enough segments to hold any std::size_t index
+        static constexpr std::size_t SEGMENTS = sizeof(std::size_t) * 8 - constHighestBit(CONCURRENT_FIRST_SEGMENT);
+
+        static std::size_t segmentOf(std::size_t i) { return highestBit(i / CONCURRENT_FIRST_SEGMENT + 1); }
+        static std::size_t segmentStart(std::size_t k) { return CONCURRENT_FIRST_SEGMENT * ((std::size_t(1) << k) - 1); }
+
+        //allocates segment k unless reserve() already did
+        T* publish(std::size_t k)
+        {
+            T *seg = segments[k].load(std::memory_order_acquire);
+            if (seg != nullptr)
+                return seg;
+            std::size_t n = CONCURRENT_FIRST_SEGMENT << k;
+            T *fresh = allocElems<T>(n);
+            array_assert(fresh != NULL);
+            if (segments[k].compare_exchange_strong(seg, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                stats_count(STATS_ARRAY, allocs, 1);
+                stats_count(STATS_ARRAY, bytes, n * sizeof(T));
+                return fresh;
+            }
+            memFree(fresh);
+            return seg;
+        }
+
+        //ends the len() elements, segment by segment
+        void destroyAll()
+        {
+            std::size_t n = len();
+            for (std::size_t k = 0; segmentStart(k) < n; ++k)
+            {
+                std::size_t stop = segmentStart(k + 1) < n? segmentStart(k + 1): n;
+                destroyElems(segments[k].load(std::memory_order_relaxed), stop - segmentStart(k));
+            }
+        }
+
+        //segment k is being allocated by the insertion that reserved its first index
+        T* wait(std::size_t k)
+        {
+            T *seg;
+            while ((seg = segments[k].load(std::memory_order_acquire)) == nullptr)
+                std::this_thread::yield();
+            return seg;
+        }
+
+        std::atomic<std::size_t> reserved;
+        std::atomic<T*> segments[SEGMENTS];
+    };
+}
+
+//MATRIX
+//in principle the matrix should not change its size by inserting rows and cols, just 
+//by a expansion
+//but i do have an urge to implement a resizing matrix, such as
+//my::Array<my::Array<T>>
+//one day, maybe
+
+namespace stuff
+{
+
+    //element wise expressions of packed matrices are packed too, lanes<O>(row, col) gives elements
+    //(row, col) to (row, col + O::width - 1). The others go one element at a time with O = ScalarOps<T>
+    template <typename E, typename T>
+    class MatrixExpression
+    {
+    public:
+        static constexpr bool packed = false;
+        //T operator[] (std::size_t i) const { return static_cast<const E&>(*this)[i]; }
+        T operator() (std::size_t row, std::size_t col) const { return static_cast<const E&>(*this)(row, col); }
+        std::size_t rows() const { return static_cast<const E&>(*this).rows(); }
+        std::size_t cols() const { return static_cast<const E&>(*this).cols(); }
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const { return static_cast<const E&>(*this)(row, col); }
+    };
+
+    template <typename P1, typename P2, typename T>
+    class MatrixMult;
+
+    template <typename P1, typename P2, typename T>
+    class MatrixMultT;
+
+    template <typename E, typename P1, typename T>
+    class MatrixShift;
+
+    template <typename T, std::size_t NA, std::size_t NB, std::size_t NC>
+    Matrix<T, NC>& gemm(const Matrix<T, NA>& a, const Matrix<T, NB>& b, Matrix<T, NC>& c);
+
+    //interface for factorizations that follow a matrix as it grows or shrinks,
+    //see the FACTORIZATION section for the implementations
+    template <typename T, std::size_t N = 0>
+    class MatrixFactor
+    {
+    public:
+        virtual ~MatrixFactor() = default;
+        //called after the whole matrix changed (attach, expand)
+        virtual void onReset(const Matrix<T, N>& m) = 0;
+        //called after a row/column was appended at the end
+        virtual void onInsertRow(const Matrix<T, N>& m) = 0;
+        virtual void onInsertCol(const Matrix<T, N>& m) = 0;
+        //called after row/column `idx` was removed, `row` holds the removed row
+        virtual void onRemoveRow(const Matrix<T, N>& m, std::size_t idx, const T* row) = 0;
+        virtual void onRemoveCol(const Matrix<T, N>& m, std::size_t idx) = 0;
+    };
+
+    template <typename T, std::size_t N>
+    class Matrix : public MatrixExpression<Matrix<T, N>, T>, private InlineBuffer<T, N>
+    {
+    public:
+        Matrix(): m_rows(0), m_cols(0), data(nullptr), factor(nullptr)
+        {
+        }
+
+        Matrix(std::size_t rows_, std::size_t cols_): m_rows(rows_), m_cols(cols_), factor(nullptr)
+        {
+            data = acquire(m_rows * m_cols, true);
+        }
+
+        template <typename F, typename P = SequencedPolicy>
+        Matrix(std::size_t rows_, std::size_t cols_, const F& func, P policy = P()): 
+        m_rows(rows_), m_cols(cols_), factor(nullptr)
+        {
+            data = acquire(m_rows * m_cols, false);
+            T *d = data;
+            std::size_t c = m_cols;
+            policyFor(policy, m_rows, m_cols, [d, c, &func](std::size_t i, std::size_t j) { d[i * c + j] = func(i, j); });
+        }
+
+        Matrix(const Matrix<T, N>& o): m_rows(o.m_rows), m_cols(o.m_cols), factor(nullptr)
+        {
+            stats_count(STATS_MATRIX, copies, 1);
+            data = acquire(m_rows * m_cols, false);
+            copyElems(data, o.data, m_rows * m_cols);
+        }
+
+        //attached factorizations stay with their matrix, o keeps its own
+        Matrix(Matrix<T, N>&& o): m_rows(o.m_rows), m_cols(o.m_cols), factor(nullptr)
+        {
+            stats_count(STATS_MATRIX, moves, 1);
+            take(o);
+        }
+
+        template <typename E>
+        Matrix(const MatrixExpression<E, T>& expr): m_rows(expr.rows()), m_cols(expr.cols()), factor(nullptr)
+        {
+            stats_count(STATS_MATRIX, materializations, 1);
+            profile_kernel("matrix assign");
+            data = acquire(m_rows * m_cols, false);
+            T *dst = data;
+            std::size_t cols_ = m_cols;
+            parallelFor(0, m_rows, parallelGrain(cols_), [dst, cols_, &expr](std::size_t b, std::size_t e)
+            {
+                for (std::size_t i = b; i < e; ++i)
+                    for (std::size_t j = 0; j < cols_; ++j)
+                        dst[i * cols_ + j] = expr(i, j);
+            });
+        }
+
+        //products of two matrices go through the blocked gemm kernel
+        template <std::size_t NA, std::size_t NB>
+        Matrix(const MatrixMult<Matrix<T, NA>, Matrix<T, NB>, T>& expr): m_rows(0), m_cols(0), data(nullptr), factor(nullptr)
+        {
+            stats_count(STATS_MATRIX, materializations, 1);
+            gemm(expr.lhs(), expr.rhs(), *this);
+        }
+
+        //transposed products too, (!a) * (!b) ends up here as !(b * a)
+        template <std::size_t NA, std::size_t NB>
+        Matrix(const MatrixMultT<Matrix<T, NA>, Matrix<T, NB>, T>& expr): m_rows(0), m_cols(0), data(nullptr), factor(nullptr)
+        {
+            stats_count(STATS_MATRIX, materializations, 1);
+            Matrix<T> product;
+            gemm(expr.lhs(), expr.rhs(), product);
+            m_rows = product.cols();
+            m_cols = product.rows();
+            data = acquire(m_rows * m_cols, false);
+            transposeInto(product, data);
+        }
+
+        //a + s, a - s and a + d only change the diagonal of a
+        template <typename E, typename P1>
+        Matrix(const MatrixShift<E, P1, T>& expr): Matrix(expr.operand())
+        {
+            shiftDiagonal(static_cast<const E&>(expr));
+        }
+
+        Matrix<T, N>& operator=(const Matrix<T, N>& o)
+        {
+            stats_count(STATS_MATRIX, copies, 1);
+            if (this == &o)
+                return *this;
+            if (data == nullptr || m_rows * m_cols != o.m_rows * o.m_cols)
+            {
+                release();
+                data = acquire(o.m_rows * o.m_cols, false);
+            }
+            m_rows = o.m_rows;
+            m_cols = o.m_cols;
+            copyElems(data, o.data, m_rows * m_cols);
+            
+            if (factor != nullptr)
+                factor->onReset(*this);
+            return *this;
+        }
+
+        Matrix<T, N>& operator=(Matrix<T, N>&& o)
+        {
+            stats_count(STATS_MATRIX, moves, 1);
+            if (this == &o)
+                return *this;
+            release();
+            m_rows = o.m_rows;
+            m_cols = o.m_cols;
+            take(o);
+            if (factor != nullptr)
+                factor->onReset(*this);
+            return *this;
+        }
+
+        template <typename E>
+        Matrix<T, N>& operator=(const MatrixExpression<E, T>& expr)
+        {
+            stats_count(STATS_MATRIX, materializations, 1);
+            profile_kernel("matrix assign");
+            //evaluated into a new buffer, expr may be reading from this matrix
+            std::size_t rows_ = expr.rows(), cols_ = expr.cols();
+            rebuild(rows_ * cols_, false, [&expr, rows_, cols_](T* new_data)
+            {
+                parallelFor(0, rows_, parallelGrain(cols_), [new_data, cols_, &expr](std::size_t b, std::size_t e)
+                {
+                    for (std::size_t i = b; i < e; ++i)
+                        for (std::size_t j = 0; j < cols_; ++j)
+                            new_data[i * cols_ + j] = expr(i, j);
+                });
+            });
+            m_rows = rows_;
+            m_cols = cols_;
+            if (factor != nullptr)
+                factor->onReset(*this);
+            return *this;
+        }
+
+        //the product is evaluated into a new buffer, so a = a * b is fine
+        template <std::size_t NA, std::size_t NB>
+        Matrix<T, N>& operator=(const MatrixMult<Matrix<T, NA>, Matrix<T, NB>, T>& expr)
+        {
+            Matrix<T, N> ret(expr);
+            swap(ret);
+            if (factor != nullptr)
+                factor->onReset(*this);
+            return *this;
+        }
+
+        template <std::size_t NA, std::size_t NB>
+        Matrix<T, N>& operator=(const MatrixMultT<Matrix<T, NA>, Matrix<T, NB>, T>& expr)
+        {
+            Matrix<T, N> ret(expr);
+            swap(ret);
+            if (factor != nullptr)
+                factor->onReset(*this);
+            return *this;
+        }
+
+        //a = a + s is done in place, anything else is assigned first and shifted after
+        template <typename E, typename P1>
+        Matrix<T, N>& operator=(const MatrixShift<E, P1, T>& expr)
+        {
+            if ((const void*)&expr.operand() != (const void*)this)
+            {
+                MatrixFactor<T, N> *f = factor;
+                factor = nullptr;
+                *this = expr.operand();
+                factor = f;
+            }
+            shiftDiagonal(static_cast<const E&>(expr));
+            if (factor != nullptr)
+                factor->onReset(*this);
+            return *this;
+        }
+
+        ~Matrix()
+        {
+            release();
+        }
+
+        T& operator()(std::size_t row, std::size_t col) { return data[row * m_cols + col]; }
+        const T& operator()(std::size_t row, std::size_t col) const { return data[row * m_cols + col]; }
+        static constexpr bool packed = SimdOps<T>::width > 1;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const { return O::load(data + row * m_cols + col); }
+
+        std::size_t rows() const { return m_rows; }
+        std::size_t cols() const { return m_cols; }
+
+        //exchanges the contents of both matrices, attached factorizations stay where they are
+        void swap(Matrix<T, N>& o)
+        {
+            if (!isInline() && !o.isInline())
+            {
+                std::size_t t = m_rows; m_rows = o.m_rows; o.m_rows = t;
+                t = m_cols; m_cols = o.m_cols; o.m_cols = t;
+                T *d = data; data = o.data; o.data = d;
+                return;
+            }
+            MatrixFactor<T, N> *f = factor, *o_f = o.factor;
+            Matrix<T, N> tmp(std::move(o));
+            o = std::move(*this);
+            *this = std::move(tmp);
+            factor = f;
+            o.factor = o_f;
+        }
+
+        Matrix<T, N>& insertRow()
+        {
+            if (!m_cols)
+                return *this;
+
+            growRows();
+            if (factor != nullptr)
+                factor->onInsertRow(*this);
+            return *this;
+        }
+
+        Matrix<T, N>& insertCol()
+        {
+            if (!m_rows)
+                return *this;
+            
+            resize(m_rows, m_cols + 1);
+            if (factor != nullptr)
+                factor->onInsertCol(*this);
+            return *this;
+        }
+
+        Matrix<T, N>& insertRow(const T* row_data)
+        {
+            if (!m_cols)
+                return *this;
+
+            growRows();
+            for (std::size_t j = 0; j < m_cols; ++j)
+                (*this)(m_rows - 1, j) = row_data[j];
+            
+            if (factor != nullptr)
+                factor->onInsertRow(*this);
+            return *this;
+        }
+
+        template <std::size_t M>
+        Matrix<T, N>& insertRow(const Array<T, M>& row_data)
+        {
+            if (m_cols == 0)
+                resize(m_rows, row_data.len());
+
+            matrix_assert(row_data.len() == m_cols);
+            growRows();
+            for (std::size_t j = 0; j < m_cols; ++j)
+                (*this)(m_rows - 1, j) = row_data[j];
+            
+            if (factor != nullptr)
+                factor->onInsertRow(*this);
+            return *this;
+        }
+
+        template <std::size_t dim>
+        Matrix<T, N>& insertRow(const Vec<dim, T>& row_data)
+        {
+            if (m_cols == 0)
+                resize(m_rows, dim);
+
+            matrix_assert(dim == m_cols);
+            growRows();
+            for (std::size_t j = 0; j < m_cols; ++j)
+                (*this)(m_rows - 1, j) = row_data[j];
+            
+            if (factor != nullptr)
+                factor->onInsertRow(*this);
+            return *this;
+        }
+
+        Matrix<T, N>& insertCol(const T* col_data)
+        {
+            if (!m_rows)
+                return *this;
+
+            resize(m_rows, m_cols + 1);
+            for (std::size_t i = 0; i < m_rows; ++i)
+                (*this)(i, m_cols - 1) = col_data[i];
+            
+            if (factor != nullptr)
+                factor->onInsertCol(*this);
+            return *this;
+        }
+
+        template <std::size_t M>
+        Matrix<T, N>& insertCol(const Array<T, M>& col_data)
+        {
+            if (m_rows == 0)
+                resize(col_data.len(), m_cols);
+
+            matrix_assert(col_data.len() == m_rows);
+            resize(m_rows, m_cols + 1);
+            for (std::size_t i = 0; i < m_rows; ++i)
+                (*this)(i, m_cols - 1) = col_data[i];
+            
+            if (factor != nullptr)
+                factor->onInsertCol(*this);
+            return *this;
+        }
+
+        template <std::size_t dim>
+        Matrix<T, N>& insertCol(const Vec<dim, T>& col_data)
+        {
+            if (m_rows == 0)
+                resize(dim, m_cols);
+
+            matrix_assert(dim == m_rows);
+            resize(m_rows, m_cols + 1);
+            for (std::size_t i = 0; i < m_rows; ++i)
+                (*this)(i, m_cols - 1) = col_data[i];
+            
+            if (factor != nullptr)
+                factor->onInsertCol(*this);
+            return *this;
+        }
+
+        Matrix<T, N>& removeRow(std::size_t row)
+        {
+            matrix_assert(row < m_rows);
+            T *removed = nullptr;
+            if (factor != nullptr)
+            {
+                removed = (T*)memAlloc(sizeof(T) * m_cols);
+                matrix_assert(removed != NULL);
+                memcpy((void*)removed, (void*)(data + row * m_cols), sizeof(T) * m_cols);
+            }
+
+            memmove((void*)(data + row * m_cols), (void*)(data + (row + 1) * m_cols), 
+                    sizeof(T) * (m_rows - row - 1) * m_cols);
+            --m_rows;
+
+            if (factor != nullptr)
+            {
+                factor->onRemoveRow(*this, row, removed);
+                memFree(removed);
+            }
+            return *this;
+        }
+
+        Matrix<T, N>& removeCol(std::size_t col)
+        {
+            matrix_assert(col < m_cols);
+            std::size_t new_cols = m_cols - 1;
+            for (std::size_t i = 0; i < m_rows; ++i)
+            {
+                //rows only move to the left, so source and destination may overlap
+                memmove((void*)(data + i * new_cols), (void*)(data + i * m_cols), sizeof(T) * col);
+                memmove((void*)(data + i * new_cols + col), (void*)(data + i * m_cols + col + 1), 
+                        sizeof(T) * (m_cols - col - 1));
+            }
+            m_cols = new_cols;
+
+            if (factor != nullptr)
+                factor->onRemoveCol(*this, col);
+            return *this;
+        }
+
+        Matrix<T, N>& expand(std::size_t new_row, std::size_t new_col)
+        {
+            resize(new_row, new_col);
+            if (factor != nullptr)
+                factor->onReset(*this);
+            return *this;
+        }
+
+        //keeps `f` up to date with every insertion/removal done through this matrix,
+        //only one factorization can be attached at a time
+        Matrix<T, N>& attach(MatrixFactor<T, N>& f)
+        {
+            factor = &f;
+            factor->onReset(*this);
+            return *this;
+        }
+
+        Matrix<T, N>& detach()
+        {
+            factor = nullptr;
+            return *this;
+        }
+
+        template <typename F, typename P = SequencedPolicy>
+        Matrix<T, N>& forEach(const F& func, P policy = P())
+        {
+            T *d = data;
+            std::size_t c = m_cols;
+            policyFor(policy, m_rows, m_cols, [d, c, &func](std::size_t i, std::size_t j) { d[i * c + j] = func(i, j, d[i * c + j]); });
+            return *this;
+        }
+
+        T determinant()
+        {
+            matrix_assert(0 && "TODO: Implement.");
+        }
+
+    private:
+        bool isInline() const { return N > 0 && data == this->inlineData(); }
+
+        //adds expr.shift(i) to element (i, i)
+        template <typename E>
+        void shiftDiagonal(const E& expr)
+        {
+            std::size_t n = m_rows < m_cols? m_rows: m_cols;
+            for (std::size_t i = 0; i < n; ++i)
+                data[i * m_cols + i] = data[i * m_cols + i] + expr.shift(i);
+        }
+
+        //storage for n elements, the inline buffer if they fit
+        T* acquire(std::size_t n, bool zero)
+        {
+            if (N > 0 && n <= N)
+            {
+                if (zero)
+                    for (std::size_t i = 0; i < n; ++i)
+                        this->inlineData()[i] = T();
+                return this->inlineData();
+            }
+            T *ret = zero? (T*)memCalloc(n, sizeof(T)): allocElems<T>(n);
+            matrix_assert(ret != NULL || n == 0);
+            stats_count(STATS_MATRIX, allocs, 1);
+            stats_count(STATS_MATRIX, bytes, n * sizeof(T));
+            return ret;
+        }
+
+        void release()
+        {
+            if (!isInline() && data != nullptr)
+            {
+                stats_count(STATS_MATRIX, frees, 1);
+                memFree(data);
+            }
+            data = nullptr;
+        }
+
+        //moves o's elements here (sizes already copied) and leaves o empty
+        void take(Matrix<T, N>& o)
+        {
+            if (o.isInline())
+            {
+                data = this->inlineData();
+                copyElems(data, o.data, m_rows * m_cols);
+            }
+            else
+                data = o.data;
+            o.m_rows = o.m_cols = 0;
+            o.data = nullptr;
+        }
+
+        //replaces the buffer by a new one of n elements written by fill, which may still read the old one
+        template <typename F>
+        void rebuild(std::size_t n, bool zero, const F& fill)
+        {
+            if (N > 0 && n <= N)
+            {
+                InlineBuffer<T, N> tmp;
+                if (zero)
+                    for (std::size_t i = 0; i < n; ++i)
+                        tmp.inlineData()[i] = T();
+                fill(tmp.inlineData());
+                release();
+                data = this->inlineData();
+                copyElems(data, tmp.inlineData(), n);
+                return;
+            }
+            T *new_data = zero? (T*)memCalloc(n, sizeof(T)): allocElems<T>(n);
+            matrix_assert(new_data != NULL || n == 0);
+            stats_count(STATS_MATRIX, allocs, 1);
+            stats_count(STATS_MATRIX, bytes, n * sizeof(T));
+            fill(new_data);
+            release();
+            data = new_data;
+        }
+
+        void growRows()
+        {
+            std::size_t n = (m_rows + 1) * m_cols;
+            if (isInline() && n <= N)
+                ;
+            else if (isInline() || data == nullptr)
+            {
+                T *new_data = acquire(n, false);
+                copyElems(new_data, data, m_rows * m_cols);
+                data = new_data;
+            }
+            else
+            {
+                data = (T*)memRealloc((void*)data, sizeof(T) * n);
+                matrix_assert(data != NULL);
+                stats_count(STATS_MATRIX, reallocs, 1);
+                stats_count(STATS_MATRIX, bytes, n * sizeof(T));
+            }
+            memset((void*)(data + m_rows * m_cols), 0, sizeof(T) * m_cols);
+            ++m_rows;
+        }
+
+        void resize(std::size_t new_row, std::size_t new_col)
+        {
+            std::size_t min_row = new_row < m_rows? new_row: m_rows;
+            std::size_t min_col = new_col < m_cols? new_col: m_cols;
+            const T *old_data = data;
+            std::size_t old_cols = m_cols;
+            rebuild(new_row * new_col, true, [=](T* new_data)
+            {
+                for (std::size_t i = 0; i < min_row; ++i)
+                    copyElems(new_data + i * new_col, old_data + i * old_cols, min_col);
+            });
+
+            m_rows = new_row;
+            m_cols = new_col;
+        }
+
+        std::size_t m_rows, m_cols;
+        T *data;
+        MatrixFactor<T, N> *factor;
+        //std::size_t rows_cached, cols_cached
+    };
+
+    template <typename P1, typename P2, typename T>
+    class MatrixSum : public MatrixExpression<MatrixSum<P1, P2, T>, T>
+    {
+    public:
+        MatrixSum(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            {
+                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
+                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                exit(-1);
+            }
+        }
+
+        T operator()(std::size_t row, std::size_t col) const
+        {
+            return p1(row, col) + 
+                   p2(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const
+        {
+            return O::add(p1.template lanes<O>(row, col), p2.template lanes<O>(row, col));
+        }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    MatrixSum<P1, P2, T> operator+(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    {
+        return MatrixSum<P1, P2, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const P2*>(&m2)
+        );
+    }
+
+    template <typename P1, typename P2, typename T>
+    class MatrixSub : public MatrixExpression<MatrixSub<P1, P2, T>, T>
+    {
+    public:
+        MatrixSub(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            {
+                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
+                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                exit(-1);
+            }
+        }
+
+        T operator()(std::size_t row, std::size_t col) const
+        {
+            return p1(row, col) - 
+                   p2(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const
+        {
+            return O::sub(p1.template lanes<O>(row, col), p2.template lanes<O>(row, col));
+        }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    MatrixSub<P1, P2, T> operator-(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    {
+        return MatrixSub<P1, P2, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const P2*>(&m2)
+        );
+    }
+
+    template <typename P1, typename P2, typename T>
+    class MatrixMultK : public MatrixExpression<MatrixMultK<P1, P2, T>, T>
+    {
+    public:
+        MatrixMultK(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            {
+                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
+                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                exit(-1);
+            }
+        }
+
+        T operator()(std::size_t row, std::size_t col) const
+        {
+            return p1(row, col) * 
+                   p2(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const
+        {
+            return O::mul(p1.template lanes<O>(row, col), p2.template lanes<O>(row, col));
+        }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    MatrixMultK<P1, P2, T> operator&(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    {
+        return MatrixMultK<P1, P2, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const P2*>(&m2)
+        );
+    }
+
+    template <typename P1, typename P2, typename T>
+    class MatrixDiv : public MatrixExpression<MatrixDiv<P1, P2, T>, T>
+    {
+    public:
+        MatrixDiv(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            {
+                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
+                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                exit(-1);
+            }
+        }
+
+        T operator()(std::size_t row, std::size_t col) const
+        {
+            return p1(row, col) / 
+                   p2(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const
+        {
+            return O::div(p1.template lanes<O>(row, col), p2.template lanes<O>(row, col));
+        }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    MatrixDiv<P1, P2, T> operator/(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    {
+        return MatrixDiv<P1, P2, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const P2*>(&m2)
+        );
+    }
+
+    template <typename P1, typename P2, typename T>
+    class MatrixMult : public MatrixExpression<MatrixMult<P1, P2, T>, T>
+    {
+    public:
+        MatrixMult(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (p1.cols() != p2.rows())
+            {
+                std::cerr << "Cols of Matrix A(" << p1.cols() <<  ") doesn't match rows of Matrix B(" << p2.rows() << ")" << std::endl;
+                exit(-1);
+            }
+        }
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            T ret = T();
+            for (std::size_t i = 0; i < p1.cols(); ++i)
+                ret = ret + p1(row, i) * p2(i, col);
+            return ret;
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p2.cols(); }
+
+        const P1& lhs() const { return p1; }
+        const P2& rhs() const { return p2; }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    MatrixMult<P1, P2, T> operator*(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    {
+        return MatrixMult<P1, P2, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const P2*>(&m2)
+        );
+    }
+
+    //c += a * b on row major buffers, a is n x p, b is p x m and c is n x m.
+    //Cache blocked i-k-j loops, the innermost one runs over contiguous rows of b and c
+    template <typename T>
+    void gemmBlocked(const T* a, const T* b, T* c, std::size_t n, std::size_t m, std::size_t p)
+    {
+        if (n == 0 || m == 0 || p == 0)
+            return;
+
+        //every block of rows of c is written by one thread only
+        std::size_t row_blocks = (n + MATRIX_GEMM_BLOCK - 1) / MATRIX_GEMM_BLOCK;
+        parallelFor(0, row_blocks, parallelGrain(MATRIX_GEMM_BLOCK * m * p), [a, b, c, n, m, p](std::size_t first, std::size_t last)
+        {
+            for (std::size_t ii = first * MATRIX_GEMM_BLOCK; ii < n && ii < last * MATRIX_GEMM_BLOCK; ii += MATRIX_GEMM_BLOCK)
+            {
+                std::size_t i_end = ii + MATRIX_GEMM_BLOCK < n? ii + MATRIX_GEMM_BLOCK: n;
+                for (std::size_t kk = 0; kk < p; kk += MATRIX_GEMM_BLOCK)
+                {
+                    std::size_t k_end = kk + MATRIX_GEMM_BLOCK < p? kk + MATRIX_GEMM_BLOCK: p;
+                    for (std::size_t jj = 0; jj < m; jj += MATRIX_GEMM_BLOCK)
+                    {
+                        std::size_t j_end = jj + MATRIX_GEMM_BLOCK < m? jj + MATRIX_GEMM_BLOCK: m;
+                        for (std::size_t i = ii; i < i_end; ++i)
+                        {
+                            T *c_row = c + i * m;
+                            std::size_t k = kk;
+                            //four rows of b per pass over c_row, same summation order as one at a time
+                            for (; k + 4 <= k_end; k += 4)
+                            {
+                                const T a0 = a[i * p + k], a1 = a[i * p + k + 1], a2 = a[i * p + k + 2], a3 = a[i * p + k + 3];
+                                const T *b0 = b + k * m, *b1 = b0 + m, *b2 = b1 + m, *b3 = b2 + m;
+                                for (std::size_t j = jj; j < j_end; ++j)
+                                    c_row[j] = c_row[j] + a0 * b0[j] + a1 * b1[j] + a2 * b2[j] + a3 * b3[j];
+                            }
+                            for (; k < k_end; ++k)
+                            {
+                                const T a_ik = a[i * p + k];
+                                const T *b_row = b + k * m;
+                                for (std::size_t j = jj; j < j_end; ++j)
+                                    c_row[j] = c_row[j] + a_ik * b_row[j];
+                            }
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    //c = a * b, reusing c's buffer when it already has the right size
+    template <typename T, std::size_t NA, std::size_t NB, std::size_t NC>
+    Matrix<T, NC>& gemm(const Matrix<T, NA>& a, const Matrix<T, NB>& b, Matrix<T, NC>& c)
+    {
+        profile_kernel("gemm");
+        if (a.cols() != b.rows())
+        {
+            std::cerr << "Cols of Matrix A(" << a.cols() <<  ") doesn't match rows of Matrix B(" << b.rows() << ")" << std::endl;
+            exit(-1);
+        }
+        matrix_assert((const void*)&c != (const void*)&a && (const void*)&c != (const void*)&b);
+
+        std::size_t n = a.rows(), m = b.cols(), p = a.cols();
+        if (c.rows() != n || c.cols() != m)
+            c = Matrix<T, NC>(n, m);
+        else
+            c.forEach([](std::size_t, std::size_t, T) { return T(); });
+
+        if (n == 0 || m == 0 || p == 0)
+            return c;
+        gemmBlocked(&a(0, 0), &b(0, 0), &c(0, 0), n, m, p);
+        return c;
+    }
+
+    template <typename P1, typename P2, typename T>
+    class MatrixTensor : public MatrixExpression<MatrixTensor<P1, P2, T>, T>
+    {
+    public:
+        MatrixTensor(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
+
+        T operator()(std::size_t row, std::size_t col) const
+        {
+            size_t iA = row / p2.rows();
+            size_t jA = col / p2.cols();
+
+            size_t iB = row % p2.rows();
+            size_t jB = col % p2.cols();
+
+            return p1(iA, jA) * p2(iB, jB);
+        }
+
+        std::size_t rows() const { return p1.rows() * p2.rows(); }
+        std::size_t cols() const { return p1.cols() * p2.cols(); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    MatrixTensor<P1, P2, T> operator%(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
+    {
+        return MatrixTensor<P1, P2, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const P2*>(&m2)
+        );
+    }
+
+    template <typename P1, typename T>
+    class MatrixMultS : public MatrixExpression<MatrixMultS<P1, T>, T>
+    {
+    public:
+        MatrixMultS(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return p1(row, col) * s;
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const { return O::mul(p1.template lanes<O>(row, col), O::set(s)); }
+
+        const P1& operand() const { return p1; }
+        const T& scalar() const { return s; }
+    private:
+        const P1& p1;
+        //by value, folded scalars are temporaries
+        const T s;
+    };
+
+    template <typename P1, typename T>
+    MatrixMultS<P1, T> operator*(const MatrixExpression<P1, T>& m1, const T& s)
+    {
+        return MatrixMultS<P1, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const T*>(&s)
+        );
+    }
+
+    template <typename P1, typename T>
+    MatrixMultS<P1, T> operator*(const T& s, const MatrixExpression<P1, T>& m1)
+    {
+        return MatrixMultS<P1, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const T*>(&s)
+        );
+    }
+
+    template <typename P1, typename T>
+    class MatrixDivS : public MatrixExpression<MatrixDivS<P1, T>, T>
+    {
+    public:
+        MatrixDivS(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return p1(row, col) / s;
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const { return O::div(p1.template lanes<O>(row, col), O::set(s)); }
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    MatrixDivS<P1, T> operator/(const MatrixExpression<P1, T>& m1, const T& s)
+    {
+        return MatrixDivS<P1, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const T*>(&s)
+        );
+    }
+
+    template <typename P1, typename T>
+    class MatrixDivSI : public MatrixExpression<MatrixDivSI<P1, T>, T>
+    {
+    public:
+        MatrixDivSI(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return s / p1(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const { return O::div(O::set(s), p1.template lanes<O>(row, col)); }
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    MatrixDivSI<P1, T> operator/(const T& s, const MatrixExpression<P1, T>& m1)
+    {
+        return MatrixDivSI<P1, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const T*>(&s)
+        );
+    }
+
+    template <typename P1, typename T>
+    class MatrixT : public MatrixExpression<MatrixT<P1, T>, T>
+    {
+    public:
+        MatrixT(const P1& p1_): p1(p1_){}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return p1(col, row);
+        }
+
+        std::size_t rows() const { return p1.cols(); }
+        std::size_t cols() const { return p1.rows(); }
+
+        const P1& operand() const { return p1; }
+    private:
+        const P1& p1;
+    };
+
+    template <typename P1, typename T>
+    MatrixT<P1, T> operator!(const MatrixExpression<P1, T>& m1)
+    {
+        return MatrixT<P1, T>(
+            *static_cast<const P1*>(&m1)
+        );
+    }
+
+    template <typename P1, typename T>
+    class MatrixNeg : public MatrixExpression<MatrixNeg<P1, T>, T>
+    {
+    public:
+        MatrixNeg(const P1& p1_): p1(p1_){}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return -p1(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const { return O::neg(p1.template lanes<O>(row, col)); }
+
+        const P1& operand() const { return p1; }
+    private:
+        const P1& p1;
+    };
+
+    template <typename P1, typename T>
+    MatrixNeg<P1, T> operator-(const MatrixExpression<P1, T>& m1)
+    {
+        return MatrixNeg<P1, T>(
+            *static_cast<const P1*>(&m1)
+        );
+    }
+
+    //!(p1 * p2), so a transposed product of two matrices still runs through gemm
+    template <typename P1, typename P2, typename T>
+    class MatrixMultT : public MatrixExpression<MatrixMultT<P1, P2, T>, T>
+    {
+    public:
+        MatrixMultT(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_)
+        {
+            if (p1.cols() != p2.rows())
+            {
+                std::cerr << "Cols of Matrix A(" << p1.cols() <<  ") doesn't match rows of Matrix B(" << p2.rows() << ")" << std::endl;
+                exit(-1);
+            }
+        }
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            T ret = T();
+            for (std::size_t i = 0; i < p1.cols(); ++i)
+                ret = ret + p1(col, i) * p2(i, row);
+            return ret;
+        }
+
+        std::size_t rows() const { return p2.cols(); }
+        std::size_t cols() const { return p1.rows(); }
+
+        const P1& lhs() const { return p1; }
+        const P2& rhs() const { return p2; }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    //dst = !m, tile by tile so both sides stay in cache
+    template <typename T, std::size_t N>
+    void transposeInto(const Matrix<T, N>& m, T* dst)
+    {
+        std::size_t rows = m.rows(), cols = m.cols();
+        if (rows == 0 || cols == 0)
+            return;
+        const T *src = &m(0, 0);
+        std::size_t col_blocks = (cols + MATRIX_GEMM_BLOCK - 1) / MATRIX_GEMM_BLOCK;
+        parallelFor(0, col_blocks, parallelGrain(MATRIX_GEMM_BLOCK * rows), [src, dst, rows, cols](std::size_t first, std::size_t last)
+        {
+            for (std::size_t jj = first * MATRIX_GEMM_BLOCK; jj < cols && jj < last * MATRIX_GEMM_BLOCK; jj += MATRIX_GEMM_BLOCK)
+            {
+                std::size_t j_end = jj + MATRIX_GEMM_BLOCK < cols? jj + MATRIX_GEMM_BLOCK: cols;
+                for (std::size_t ii = 0; ii < rows; ii += MATRIX_GEMM_BLOCK)
+                {
+                    std::size_t i_end = ii + MATRIX_GEMM_BLOCK < rows? ii + MATRIX_GEMM_BLOCK: rows;
+                    for (std::size_t j = jj; j < j_end; ++j)
+                        for (std::size_t i = ii; i < i_end; ++i)
+                            dst[j * rows + i] = src[i * cols + j];
+                }
+            }
+        });
+    }
+
+    //a * s1 + b * s2, as (a + b) * s when both scalars are the same
+    template <typename P1, typename P2, typename T>
+    class MatrixSumS : public MatrixExpression<MatrixSumS<P1, P2, T>, T>
+    {
+    public:
+        MatrixSumS(const P1& p1_, const T& s1_, const P2& p2_, const T& s2_): p1(p1_), p2(p2_), s1(s1_), s2(s2_), common(s1_ == s2_)
+        {
+            if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+            {
+                std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
+                " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+                exit(-1);
+            }
+        }
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return common? (p1(row, col) + p2(row, col)) * s1: p1(row, col) * s1 + p2(row, col) * s2;
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed && P2::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const
+        {
+            typename O::reg a = p1.template lanes<O>(row, col), b = p2.template lanes<O>(row, col);
+            return common? O::mul(O::add(a, b), O::set(s1)): O::add(O::mul(a, O::set(s1)), O::mul(b, O::set(s2)));
+        }
+    private:
+        const P1& p1;
+        const P2& p2;
+        const T s1, s2;
+        const bool common;
+    };
+
+    //simplification rules. Each one is an overload more specialized than the generic operator, so
+    //these trees are rewritten while the expression is built and never evaluated as written.
+    //Folding scalars may round differently in the last bit
+
+    //!!a = a
+    template <typename P1, typename T>
+    const P1& operator!(const MatrixT<P1, T>& m1)
+    {
+        return m1.operand();
+    }
+
+    //-(-a) = a
+    template <typename P1, typename T>
+    const P1& operator-(const MatrixNeg<P1, T>& m1)
+    {
+        return m1.operand();
+    }
+
+    //(a * s1) * s2 = a * (s1 s2)
+    template <typename P1, typename T>
+    MatrixMultS<P1, T> operator*(const MatrixMultS<P1, T>& m1, const T& s)
+    {
+        return MatrixMultS<P1, T>(m1.operand(), m1.scalar() * s);
+    }
+
+    template <typename P1, typename T>
+    MatrixMultS<P1, T> operator*(const T& s, const MatrixMultS<P1, T>& m1)
+    {
+        return MatrixMultS<P1, T>(m1.operand(), s * m1.scalar());
+    }
+
+    //-(a * s) = a * (-s)
+    template <typename P1, typename T>
+    MatrixMultS<P1, T> operator-(const MatrixMultS<P1, T>& m1)
+    {
+        return MatrixMultS<P1, T>(m1.operand(), -m1.scalar());
+    }
+
+    //(-a) * s = a * (-s)
+    template <typename P1, typename T>
+    MatrixMultS<P1, T> operator*(const MatrixNeg<P1, T>& m1, const T& s)
+    {
+        return MatrixMultS<P1, T>(m1.operand(), -s);
+    }
+
+    template <typename P1, typename T>
+    MatrixMultS<P1, T> operator*(const T& s, const MatrixNeg<P1, T>& m1)
+    {
+        return MatrixMultS<P1, T>(m1.operand(), -s);
+    }
+
+    //(-a) * (-b) = a * b
+    template <typename P1, typename P2, typename T>
+    MatrixMult<P1, P2, T> operator*(const MatrixNeg<P1, T>& m1, const MatrixNeg<P2, T>& m2)
+    {
+        return MatrixMult<P1, P2, T>(m1.operand(), m2.operand());
+    }
+
+    //(!a) * (!b) = !(b * a)
+    template <typename P1, typename P2, typename T>
+    MatrixMultT<P2, P1, T> operator*(const MatrixT<P1, T>& m1, const MatrixT<P2, T>& m2)
+    {
+        return MatrixMultT<P2, P1, T>(m2.operand(), m1.operand());
+    }
+
+    //!!(a * b) = a * b
+    template <typename P1, typename P2, typename T>
+    MatrixMult<P1, P2, T> operator!(const MatrixMultT<P1, P2, T>& m1)
+    {
+        return MatrixMult<P1, P2, T>(m1.lhs(), m1.rhs());
+    }
+
+    //a * s1 + b * s2 in one node, a single multiply when s1 == s2
+    template <typename P1, typename P2, typename T>
+    MatrixSumS<P1, P2, T> operator+(const MatrixMultS<P1, T>& m1, const MatrixMultS<P2, T>& m2)
+    {
+        return MatrixSumS<P1, P2, T>(m1.operand(), m1.scalar(), m2.operand(), m2.scalar());
+    }
+
+    //p1 with E::shift(i) added to element (i, i), the rest of p1 is passed through untouched.
+    //A Matrix built from one copies p1 and only walks the diagonal
+    template <typename E, typename P1, typename T>
+    class MatrixShift : public MatrixExpression<E, T>
+    {
+    public:
+        MatrixShift(const P1& p1_): p1(p1_) {}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return row == col? p1(row, col) + static_cast<const E*>(this)->shift(row): p1(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+
+        const P1& operand() const { return p1; }
+    private:
+        const P1& p1;
+    };
+
+    template <typename P1, typename T>
+    class MatrixAddI : public MatrixShift<MatrixAddI<P1, T>, P1, T>
+    {
+    public:
+        MatrixAddI(const P1& p1_, const T& s_): MatrixShift<MatrixAddI<P1, T>, P1, T>(p1_), s(s_) {}
+
+        T shift(std::size_t) const { return s; }
+    private:
+        const T s;
+    };
+
+    template <typename P1, typename T>
+    MatrixAddI<P1, T> operator+(const MatrixExpression<P1, T>& m1, const T& s)
+    {
+        return MatrixAddI<P1, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const T*>(&s)
+        );
+    }
+
+    template <typename P1, typename T>
+    MatrixAddI<P1, T> operator+(const T& s, const MatrixExpression<P1, T>& m1)
+    {
+        return MatrixAddI<P1, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const T*>(&s)
+        );
+    }
+
+    template <typename P1, typename T>
+    class MatrixSubI : public MatrixShift<MatrixSubI<P1, T>, P1, T>
+    {
+    public:
+        MatrixSubI(const P1& p1_, const T& s_): MatrixShift<MatrixSubI<P1, T>, P1, T>(p1_), s(s_) {}
+
+        T shift(std::size_t) const { return -s; }
+    private:
+        const T s;
+    };
+
+    template <typename P1, typename T>
+    MatrixSubI<P1, T> operator-(const MatrixExpression<P1, T>& m1, const T& s)
+    {
+        return MatrixSubI<P1, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const T*>(&s)
+        );
+    }
+
+    template <typename P1, typename T>
+    class MatrixSubII : public MatrixExpression<MatrixSubII<P1, T>, T>
+    {
+    public:
+        MatrixSubII(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return row == col? s - p1(row, col): -p1(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+
+        const P1& operand() const { return p1; }
+    private:
+        const P1& p1;
+        const T s;
+    };
+
+    template <typename P1, typename T>
+    MatrixSubII<P1, T> operator-(const T& s, const MatrixExpression<P1, T>& m1)
+    {
+        return MatrixSubII<P1, T>(
+            *static_cast<const P1*>(&m1),
+            *static_cast<const T*>(&s)
+        );
+    }
+
+    //structured matrices, zero off the main diagonal. E::diag(i) is element (i, i).
+    //Products and sums with them pick the cheaper node at compile time: identities vanish,
+    //zeros absorb, diagonals scale rows or columns in O(n^2) and shift the diagonal in O(n)
+    template <typename E, typename T>
+    class StructuredExpression : public MatrixExpression<E, T>
+    {
+    public:
+        T diag(std::size_t i) const { return static_cast<const E*>(this)->diag(i); }
+
+        //solves D x = b, O(n)
+        Array<T> solve(const Array<T>& b) const
+        {
+            matrix_assert(this->rows() == this->cols() && b.len() == this->rows());
+            std::size_t n = b.len();
+            Array<T> x(n);
+            for (std::size_t i = 0; i < n; ++i)
+                x[i] = b[i] / diag(i);
+            return x;
+        }
+
+        //solves D X = B for all columns of B at once, x can't be b
+        Matrix<T>& solve(const Matrix<T>& b, Matrix<T>& x) const
+        {
+            matrix_assert(this->rows() == this->cols() && b.rows() == this->rows() && &b != &x);
+            std::size_t n = b.rows(), m = b.cols();
+            if (x.rows() != n || x.cols() != m)
+                x = Matrix<T>(n, m);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                T d = diag(i);
+                for (std::size_t j = 0; j < m; ++j)
+                    x(i, j) = b(i, j) / d;
+            }
+            return x;
+        }
+    };
+
+    template <typename T>
+    class Identity : public StructuredExpression<Identity<T>, T>
+    {
+    public:
+        Identity(std::size_t n_): n(n_) {}
+
+        T operator()(std::size_t row, std::size_t col) const { return row == col? T(1): T(); }
+        T diag(std::size_t) const { return T(1); }
+
+        std::size_t rows() const { return n; }
+        std::size_t cols() const { return n; }
+    private:
+        std::size_t n;
+    };
+
+    template <typename T>
+    class ScaledIdentity : public StructuredExpression<ScaledIdentity<T>, T>
+    {
+    public:
+        ScaledIdentity(std::size_t n_, const T& s_): n(n_), s(s_) {}
+
+        T operator()(std::size_t row, std::size_t col) const { return row == col? s: T(); }
+        T diag(std::size_t) const { return s; }
+
+        std::size_t rows() const { return n; }
+        std::size_t cols() const { return n; }
+
+        const T& scalar() const { return s; }
+    private:
+        std::size_t n;
+        T s;
+    };
+
+    template <typename T>
+    class Diagonal : public StructuredExpression<Diagonal<T>, T>
+    {
+    public:
+        Diagonal(Array<T> d_): d(std::move(d_)) {}
+
+        T operator()(std::size_t row, std::size_t col) const { return row == col? d[row]: T(); }
+        T diag(std::size_t i) const { return d[i]; }
+
+        std::size_t rows() const { return d.len(); }
+        std::size_t cols() const { return d.len(); }
+
+        const Array<T>& diagonal() const { return d; }
+    private:
+        Array<T> d;
+    };
+
+    template <typename T>
+    class Zero : public StructuredExpression<Zero<T>, T>
+    {
+    public:
+        Zero(std::size_t rows_, std::size_t cols_): m_rows(rows_), m_cols(cols_) {}
+
+        T operator()(std::size_t, std::size_t) const { return T(); }
+        T diag(std::size_t) const { return T(); }
+
+        std::size_t rows() const { return m_rows; }
+        std::size_t cols() const { return m_cols; }
+    private:
+        std::size_t m_rows, m_cols;
+    };
+
+    //p1 * d, scales the columns of p1
+    template <typename P1, typename T>
+    class MatrixMultD : public MatrixExpression<MatrixMultD<P1, T>, T>
+    {
+    public:
+        MatrixMultD(const P1& p1_, const Array<T>& d_): p1(p1_), d(d_) {}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return p1(row, col) * d[col];
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed && Array<T>::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const { return O::mul(p1.template lanes<O>(row, col), d.template lanes<O>(col)); }
+    private:
+        const P1& p1;
+        const Array<T>& d;
+    };
+
+    //d * p1, scales the rows of p1
+    template <typename P1, typename T>
+    class MatrixMultDI : public MatrixExpression<MatrixMultDI<P1, T>, T>
+    {
+    public:
+        MatrixMultDI(const P1& p1_, const Array<T>& d_): p1(p1_), d(d_) {}
+
+        T operator()(std::size_t row, std::size_t col) const 
+        {
+            return d[row] * p1(row, col);
+        }
+
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+        static constexpr bool packed = P1::packed;
+        template <typename O>
+        typename O::reg lanes(std::size_t row, std::size_t col) const { return O::mul(O::set(d[row]), p1.template lanes<O>(row, col)); }
+    private:
+        const P1& p1;
+        const Array<T>& d;
+    };
+
+    template <typename P1, typename T>
+    class MatrixAddD : public MatrixShift<MatrixAddD<P1, T>, P1, T>
+    {
+    public:
+        MatrixAddD(const P1& p1_, const Array<T>& d_): MatrixShift<MatrixAddD<P1, T>, P1, T>(p1_), d(d_) {}
+
+        T shift(std::size_t i) const { return d[i]; }
+    private:
+        const Array<T>& d;
+    };
+
+    template <typename P1, typename T>
+    class MatrixSubD : public MatrixShift<MatrixSubD<P1, T>, P1, T>
+    {
+    public:
+        MatrixSubD(const P1& p1_, const Array<T>& d_): MatrixShift<MatrixSubD<P1, T>, P1, T>(p1_), d(d_) {}
+
+        T shift(std::size_t i) const { return -d[i]; }
+    private:
+        const Array<T>& d;
+    };
+
+    template <typename P1, typename P2>
+    void structuredSameDims(const P1& p1, const P2& p2)
+    {
+        if (!(p1.rows() == p2.rows() && p1.cols() == p2.cols()))
+        {
+            std::cerr << "Trying to operate matrices with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
+            " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+            exit(-1);
+        }
+    }
+
+    template <typename P1, typename P2>
+    void structuredMultDims(const P1& p1, const P2& p2)
+    {
+        if (p1.cols() != p2.rows())
+        {
+            std::cerr << "Cols of Matrix A(" << p1.cols() <<  ") doesn't match rows of Matrix B(" << p2.rows() << ")" << std::endl;
+            exit(-1);
+        }
+    }
+
+    //rules, one overload per structured type. The operators below go through these so a
+    //structured operand always wins over the generic MatrixExpression overloads
+
+    //s * p
+    template <typename P2, typename T>
+    const P2& structuredMult(const Identity<T>& s, const P2& p) { structuredMultDims(s, p); return p; }
+
+    template <typename P2, typename T>
+    MatrixMultS<P2, T> structuredMult(const ScaledIdentity<T>& s, const P2& p) { structuredMultDims(s, p); return MatrixMultS<P2, T>(p, s.scalar()); }
+
+    template <typename P2, typename T>
+    MatrixMultDI<P2, T> structuredMult(const Diagonal<T>& s, const P2& p) { structuredMultDims(s, p); return MatrixMultDI<P2, T>(p, s.diagonal()); }
+
+    template <typename P2, typename T>
+    Zero<T> structuredMult(const Zero<T>& s, const P2& p) { structuredMultDims(s, p); return Zero<T>(s.rows(), p.cols()); }
+
+    //p * s
+    template <typename P1, typename T>
+    const P1& structuredMultI(const P1& p, const Identity<T>& s) { structuredMultDims(p, s); return p; }
+
+    template <typename P1, typename T>
+    MatrixMultS<P1, T> structuredMultI(const P1& p, const ScaledIdentity<T>& s) { structuredMultDims(p, s); return MatrixMultS<P1, T>(p, s.scalar()); }
+
+    template <typename P1, typename T>
+    MatrixMultD<P1, T> structuredMultI(const P1& p, const Diagonal<T>& s) { structuredMultDims(p, s); return MatrixMultD<P1, T>(p, s.diagonal()); }
+
+    template <typename P1, typename T>
+    Zero<T> structuredMultI(const P1& p, const Zero<T>& s) { structuredMultDims(p, s); return Zero<T>(p.rows(), s.cols()); }
+
+    //s + p
+    template <typename P2, typename T>
+    MatrixAddI<P2, T> structuredSum(const Identity<T>& s, const P2& p) { structuredSameDims(s, p); return MatrixAddI<P2, T>(p, T(1)); }
+
+    template <typename P2, typename T>
+    MatrixAddI<P2, T> structuredSum(const ScaledIdentity<T>& s, const P2& p) { structuredSameDims(s, p); return MatrixAddI<P2, T>(p, s.scalar()); }
+
+    template <typename P2, typename T>
+    MatrixAddD<P2, T> structuredSum(const Diagonal<T>& s, const P2& p) { structuredSameDims(s, p); return MatrixAddD<P2, T>(p, s.diagonal()); }
+
+    template <typename P2, typename T>
+    const P2& structuredSum(const Zero<T>& s, const P2& p) { structuredSameDims(s, p); return p; }
+
+    //p - s
+    template <typename P1, typename T>
+    MatrixSubI<P1, T> structuredSub(const P1& p, const Identity<T>& s) { structuredSameDims(p, s); return MatrixSubI<P1, T>(p, T(1)); }
+
+    template <typename P1, typename T>
+    MatrixSubI<P1, T> structuredSub(const P1& p, const ScaledIdentity<T>& s) { structuredSameDims(p, s); return MatrixSubI<P1, T>(p, s.scalar()); }
+
+    template <typename P1, typename T>
+    MatrixSubD<P1, T> structuredSub(const P1& p, const Diagonal<T>& s) { structuredSameDims(p, s); return MatrixSubD<P1, T>(p, s.diagonal()); }
+
+    template <typename P1, typename T>
+    const P1& structuredSub(const P1& p, const Zero<T>& s) { structuredSameDims(p, s); return p; }
+
+    //s - p
+    template <typename P2, typename T>
+    MatrixSubII<P2, T> structuredSubI(const Identity<T>& s, const P2& p) { structuredSameDims(s, p); return MatrixSubII<P2, T>(p, T(1)); }
+
+    template <typename P2, typename T>
+    MatrixSubII<P2, T> structuredSubI(const ScaledIdentity<T>& s, const P2& p) { structuredSameDims(s, p); return MatrixSubII<P2, T>(p, s.scalar()); }
+
+    template <typename P2, typename T>
+    MatrixSub<Diagonal<T>, P2, T> structuredSubI(const Diagonal<T>& s, const P2& p) { return MatrixSub<Diagonal<T>, P2, T>(s, p); }
+
+    template <typename P2, typename T>
+    MatrixNeg<P2, T> structuredSubI(const Zero<T>& s, const P2& p) { structuredSameDims(s, p); return MatrixNeg<P2, T>(p); }
+
+    template <typename E, typename P2, typename T>
+    auto operator*(const StructuredExpression<E, T>& s, const MatrixExpression<P2, T>& m) -> decltype(structuredMult(static_cast<const E&>(s), static_cast<const P2&>(m)))
+    {
+        return structuredMult(static_cast<const E&>(s), static_cast<const P2&>(m));
+    }
+
+    template <typename P1, typename E, typename T>
+    auto operator*(const MatrixExpression<P1, T>& m, const StructuredExpression<E, T>& s) -> decltype(structuredMultI(static_cast<const P1&>(m), static_cast<const E&>(s)))
+    {
+        return structuredMultI(static_cast<const P1&>(m), static_cast<const E&>(s));
+    }
+
+    template <typename E, typename P2, typename T>
+    auto operator+(const StructuredExpression<E, T>& s, const MatrixExpression<P2, T>& m) -> decltype(structuredSum(static_cast<const E&>(s), static_cast<const P2&>(m)))
+    {
+        return structuredSum(static_cast<const E&>(s), static_cast<const P2&>(m));
+    }
+
+    template <typename P1, typename E, typename T>
+    auto operator+(const MatrixExpression<P1, T>& m, const StructuredExpression<E, T>& s) -> decltype(structuredSum(static_cast<const E&>(s), static_cast<const P1&>(m)))
+    {
+        return structuredSum(static_cast<const E&>(s), static_cast<const P1&>(m));
+    }
+
+    template <typename P1, typename E, typename T>
+    auto operator-(const MatrixExpression<P1, T>& m, const StructuredExpression<E, T>& s) -> decltype(structuredSub(static_cast<const P1&>(m), static_cast<const E&>(s)))
+    {
+        return structuredSub(static_cast<const P1&>(m), static_cast<const E&>(s));
+    }
+
+    template <typename E, typename P2, typename T>
+    auto operator-(const StructuredExpression<E, T>& s, const MatrixExpression<P2, T>& m) -> decltype(structuredSubI(static_cast<const E&>(s), static_cast<const P2&>(m)))
+    {
+        return structuredSubI(static_cast<const E&>(s), static_cast<const P2&>(m));
+    }
+
+    //two structured operands give a structured result, diagonals are combined in O(n)
+    template <typename E1, typename E2, typename T, typename F>
+    Diagonal<T> structuredCombine(const StructuredExpression<E1, T>& s1, const StructuredExpression<E2, T>& s2, const F& f)
+    {
+        structuredSameDims(s1, s2);
+        matrix_assert(s1.rows() == s1.cols());
+        return Diagonal<T>(Array<T>(s1.rows(), [&s1, &s2, &f](std::size_t i) { return f(s1.diag(i), s2.diag(i)); }));
+    }
+
+    template <typename E1, typename E2, typename T>
+    Diagonal<T> operator*(const StructuredExpression<E1, T>& s1, const StructuredExpression<E2, T>& s2)
+    {
+        return structuredCombine(s1, s2, [](const T& a, const T& b) { return a * b; });
+    }
+
+    template <typename E1, typename E2, typename T>
+    Diagonal<T> operator+(const StructuredExpression<E1, T>& s1, const StructuredExpression<E2, T>& s2)
+    {
+        return structuredCombine(s1, s2, [](const T& a, const T& b) { return a + b; });
+    }
+
+    template <typename E1, typename E2, typename T>
+    Diagonal<T> operator-(const StructuredExpression<E1, T>& s1, const StructuredExpression<E2, T>& s2)
+    {
+        return structuredCombine(s1, s2, [](const T& a, const T& b) { return a - b; });
+    }
+
+    //zeros keep their shape, they don't need to be square
+    template <typename E2, typename T>
+    Zero<T> operator*(const Zero<T>& s1, const StructuredExpression<E2, T>& s2) { structuredMultDims(s1, s2); return Zero<T>(s1.rows(), s2.cols()); }
+
+    template <typename E1, typename T>
+    Zero<T> operator*(const StructuredExpression<E1, T>& s1, const Zero<T>& s2) { structuredMultDims(s1, s2); return Zero<T>(s1.rows(), s2.cols()); }
+
+    template <typename T>
+    Zero<T> operator*(const Zero<T>& s1, const Zero<T>& s2) { structuredMultDims(s1, s2); return Zero<T>(s1.rows(), s2.cols()); }
+
+    template <typename T>
+    const Zero<T>& operator+(const Zero<T>& s1, const Zero<T>& s2) { structuredSameDims(s1, s2); return s1; }
+
+    template <typename T>
+    const Zero<T>& operator-(const Zero<T>& s1, const Zero<T>& s2) { structuredSameDims(s1, s2); return s1; }
+
+    template <typename T>
+    ScaledIdentity<T> operator*(const T& s, const Identity<T>& m1) { return ScaledIdentity<T>(m1.rows(), s); }
+
+    template <typename T>
+    ScaledIdentity<T> operator*(const Identity<T>& m1, const T& s) { return ScaledIdentity<T>(m1.rows(), s); }
+
+    template <typename T>
+    ScaledIdentity<T> operator*(const T& s, const ScaledIdentity<T>& m1) { return ScaledIdentity<T>(m1.rows(), s * m1.scalar()); }
+
+    template <typename T>
+    ScaledIdentity<T> operator*(const ScaledIdentity<T>& m1, const T& s) { return ScaledIdentity<T>(m1.rows(), m1.scalar() * s); }
+
+    template <typename T>
+    ScaledIdentity<T> operator-(const Identity<T>& m1) { return ScaledIdentity<T>(m1.rows(), -T(1)); }
+
+    template <typename T>
+    ScaledIdentity<T> operator-(const ScaledIdentity<T>& m1) { return ScaledIdentity<T>(m1.rows(), -m1.scalar()); }
+
+    template <typename T>
+    const Zero<T>& operator-(const Zero<T>& m1) { return m1; }
+
+    template <typename E, typename T>
+    std::ostream& operator<<(std::ostream& out, const MatrixExpression<E, T>& m)
+    {
+        if (m.rows() == 0 || m.cols() == 0)
+            return out;
+        
+        for (std::size_t i = 0; i < m.rows() - 1; ++i)
+        {
+            for (std::size_t j = 0; j < m.cols() - 1; ++j)
+            {
+                out << m(i, j) << SEPARATOR;
+            }
+            std::size_t j = m.cols() - 1;
+            out << m(i, j) << std::endl;
+        }
+
+        std::size_t i = m.rows() - 1;
+        for (std::size_t j = 0; j < m.cols() - 1; ++j)
+        {
+            out << m(i, j) << SEPARATOR;
+        }
+        std::size_t j = m.cols() - 1;
+        out << m(i, j);
+
+        return out;
+    }
+}
+
+
+//FACTORIZATION
+//factorizations that can be attached to a stuff::Matrix and are kept up to date
+//as rows/columns are appended or removed, without refactoring the whole matrix
+namespace stuff
+{
+    //upper triangular R, shared by Cholesky (A = R^T R) and QR (A^T A = R^T R)
+    template <typename T>
+    class TriangularFactor
+    {
+    public:
+        TriangularFactor(): r(), good(true) { }
+
+        std::size_t dim() const { return r.rows(); }
+        bool valid() const { return good; }
+        const Matrix<T>& upper() const { return r; }
+
+        //R^T R <- R^T R + x x^T, using Givens rotations. O(n^2)
+        void update(const T* x_in)
+        {
+            std::size_t n = dim();
+            T *x = (T*)memAlloc(sizeof(T) * n);
+            matrix_assert(x != NULL);
+            memcpy((void*)x, (void*)x_in, sizeof(T) * n);
+
+            for (std::size_t k = 0; k < n; ++k)
+            {
+                if (x[k] == T())
+                    continue;
+                T rho = std::hypot(r(k, k), x[k]);
+                T c = r(k, k) / rho;
+                T s = x[k] / rho;
+                r(k, k) = rho;
+                for (std::size_t i = k + 1; i < n; ++i)
+                {
+                    T t = r(k, i);
+                    r(k, i) = c * t + s * x[i];
+                    x[i] = c * x[i] - s * t;
+                }
+            }
+            memFree(x);
+        }
+
+        //R^T R <- R^T R - x x^T (LINPACK dchdd). O(n^2)
+        //returns false and leaves R untouched if the result wouldn't be positive definite
+        bool downdate(const T* x_in)
+        {
+            std::size_t n = dim();
+            T *p = (T*)memAlloc(sizeof(T) * n);
+            T *c = (T*)memAlloc(sizeof(T) * n);
+            matrix_assert(p != NULL && c != NULL);
+
+            //R^T p = x
+            T norm2 = T();
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                T acc = x_in[i];
+                for (std::size_t k = 0; k < i; ++k)
+                    acc = acc - r(k, i) * p[k];
+                p[i] = r(i, i) == T()? T(): acc / r(i, i);
+                norm2 = norm2 + p[i] * p[i];
+            }
+
+            if (!(norm2 < T(1)))
+            {
+                memFree(p);
+                memFree(c);
+                return false;
+            }
+
+            T alpha = std::sqrt(T(1) - norm2);
+            for (std::size_t i = n; i-- > 0;)
+            {
+                T scale = alpha + std::fabs(p[i]);
+                T a = alpha / scale;
+                T b = p[i] / scale;
+                T norm = std::sqrt(a * a + b * b);
+                c[i] = a / norm;
+                p[i] = b / norm;
+                alpha = scale * norm;
+            }
+
+            for (std::size_t j = 0; j < n; ++j)
+            {
+                T xx = T();
+                for (std::size_t i = j + 1; i-- > 0;)
+                {
+                    T t = c[i] * xx + p[i] * r(i, j);
+                    r(i, j) = c[i] * r(i, j) - p[i] * xx;
+                    xx = t;
+                }
+            }
+            memFree(p);
+            memFree(c);
+            return true;
+        }
+
+        //drops column `k` of R and restores the triangular shape. O(n^2)
+        void eraseCol(std::size_t k)
+        {
+            std::size_t n = dim();
+            matrix_assert(k < n);
+            r.removeCol(k);
+            for (std::size_t j = k; j + 1 < n; ++j)
+            {
+                T a = r(j, j), b = r(j + 1, j);
+                if (b == T())
+                    continue;
+                T rho = std::hypot(a, b);
+                T c = a / rho;
+                T s = b / rho;
+                for (std::size_t l = j; l + 1 < n; ++l)
+                {
+                    T t1 = r(j, l), t2 = r(j + 1, l);
+                    r(j, l) = c * t1 + s * t2;
+                    r(j + 1, l) = c * t2 - s * t1;
+                }
+            }
+            r.removeRow(n - 1);
+        }
+
+        //extends the factored matrix with a bordering column `col` (first n entries)
+        //and diagonal element `d`. O(n^2)
+        //returns false and leaves R untouched if the result wouldn't be positive definite
+        bool border(const T* col, T d)
+        {
+            std::size_t n = dim();
+            T *w = (T*)memAlloc(sizeof(T) * (n + 1));
+            matrix_assert(w != NULL);
+
+            T norm2 = T();
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                T acc = col[i];
+                for (std::size_t k = 0; k < i; ++k)
+                    acc = acc - r(k, i) * w[k];
+                w[i] = r(i, i) == T()? T(): acc / r(i, i);
+                norm2 = norm2 + w[i] * w[i];
+            }
+
+            if (!(d - norm2 > T()))
+            {
+                memFree(w);
+                return false;
+            }
+            w[n] = std::sqrt(d - norm2);
+
+            r.expand(n + 1, n + 1);
+            for (std::size_t i = 0; i <= n; ++i)
+                r(i, n) = w[i];
+            memFree(w);
+            return true;
+        }
+
+        //solves R^T R x = b
+        Array<T> solve(const Array<T>& b) const
+        {
+            matrix_assert(good && b.len() == dim());
+            std::size_t n = dim();
+            Array<T> x(b);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                for (std::size_t k = 0; k < i; ++k)
+                    x[i] = x[i] - r(k, i) * x[k];
+                x[i] = x[i] / r(i, i);
+            }
+            for (std::size_t i = n; i-- > 0;)
+            {
+                for (std::size_t k = i + 1; k < n; ++k)
+                    x[i] = x[i] - r(i, k) * x[k];
+                x[i] = x[i] / r(i, i);
+            }
+            return x;
+        }
+
+    protected:
+        Matrix<T> r;
+        bool good;
+    };
+
+    //Cholesky factorization A = R^T R of a symmetric positive definite matrix.
+    //Bordering (append a row and a column) and deleting row/column k are O(n^2),
+    //update/downdate apply rank one changes A +- x x^T without touching the matrix.
+    //While the matrix isn't square there is no R: valid() is false and dim() is 0
+    template <typename T>
+    class Cholesky : public TriangularFactor<T>, public MatrixFactor<T>
+    {
+    public:
+        Cholesky(): TriangularFactor<T>(), pending(NONE), stale(false), held_good(false), holding(false) { }
+
+        Cholesky(const Matrix<T>& a): Cholesky() { onReset(a); }
+
+        void onReset(const Matrix<T>& a) override
+        {
+            profile_kernel("cholesky");
+            pending = NONE;
+            holding = false;
+            held = Matrix<T>();
+            stale = a.rows() != a.cols();
+            if (stale)
+            {
+                this->r = Matrix<T>();
+                this->good = false;
+                return;
+            }
+
+            //right looking: row k of R is final once the rows above it were
+            //subtracted from the trailing block, which is done in parallel by rows
+            std::size_t n = a.rows();
+            Matrix<T>& w = this->r;
+            w = Matrix<T>(n, n);
+            for (std::size_t i = 0; i < n; ++i)
+                for (std::size_t j = i; j < n; ++j)
+                    w(i, j) = a(i, j);
+            this->good = true;
+            for (std::size_t k = 0; k < n; ++k)
+            {
+                if (!(w(k, k) > T()))
+                {
+                    this->good = false;
+                    return;
+                }
+                w(k, k) = std::sqrt(w(k, k));
+                for (std::size_t j = k + 1; j < n; ++j)
+                    w(k, j) = w(k, j) / w(k, k);
+                parallelFor(k + 1, n, parallelGrain(n - k), [&w, k, n](std::size_t first, std::size_t last)
+                {
+                    for (std::size_t i = first; i < last; ++i)
+                        for (std::size_t j = i; j < n; ++j)
+                            w(i, j) = w(i, j) - w(k, i) * w(k, j);
+                });
+            }
+        }
+
+        void onInsertRow(const Matrix<T>& a) override { extend(a); }
+        void onInsertCol(const Matrix<T>& a) override { extend(a); }
+
+        void onRemoveRow(const Matrix<T>& a, std::size_t idx, const T*) override { shrink(a, idx); }
+        void onRemoveCol(const Matrix<T>& a, std::size_t idx) override { shrink(a, idx); }
+
+    private:
+        static const std::size_t NONE = (std::size_t)-1;
+
+        //R is put aside while the matrix isn't square, and brought back once it is
+        void hold()
+        {
+            if (!holding)
+            {
+                held.swap(this->r);
+                held_good = this->good;
+                holding = true;
+            }
+            this->good = false;
+        }
+
+        void unhold()
+        {
+            if (holding)
+            {
+                this->r.swap(held);
+                this->good = held_good;
+                holding = false;
+            }
+        }
+
+        //a row and a column were appended, once both are there border R
+        void extend(const Matrix<T>& a)
+        {
+            if (a.rows() != a.cols())
+            {
+                hold();
+                return;
+            }
+            unhold();
+            std::size_t n = this->dim();
+            if (stale || !this->good || a.rows() != n + 1)
+            {
+                onReset(a);
+                return;
+            }
+
+            T *col = (T*)memAlloc(sizeof(T) * n);
+            matrix_assert(col != NULL);
+            for (std::size_t i = 0; i < n; ++i)
+                col[i] = a(i, n);
+            if (!this->border(col, a(n, n)))
+                onReset(a);
+            memFree(col);
+        }
+
+        //row and column `idx` are removed, once both are gone drop them from R
+        void shrink(const Matrix<T>& a, std::size_t idx)
+        {
+            if (a.rows() != a.cols())
+            {
+                if (pending == NONE)
+                    pending = idx;
+                else
+                    stale = true;
+                hold();
+                return;
+            }
+
+            unhold();
+            if (stale || !this->good || pending != idx || a.rows() + 1 != this->dim())
+                onReset(a);
+            else
+                this->eraseCol(idx);
+            pending = NONE;
+        }
+
+        std::size_t pending;
+        bool stale;
+        Matrix<T> held;
+        bool held_good;
+        bool holding;
+    };
+
+    //Q-less QR factorization of a m x n matrix A, R is n x n with A^T A = R^T R.
+    //Appending/removing a row and appending/removing a column are O(n^2) (plus the
+    //O(mn) product A^T a for a new column), instead of the O(mn^2) refactorization.
+    template <typename T>
+    class QR : public TriangularFactor<T>, public MatrixFactor<T>
+    {
+    public:
+        QR(): TriangularFactor<T>() { }
+
+        QR(const Matrix<T>& a): QR() { onReset(a); }
+
+        //Householder triangularization of a copy of A
+        void onReset(const Matrix<T>& a) override
+        {
+            profile_kernel("qr");
+            std::size_t m = a.rows(), n = a.cols();
+            Matrix<T> w(a);
+            for (std::size_t k = 0; k < n && k < m; ++k)
+            {
+                T norm2 = T();
+                for (std::size_t i = k; i < m; ++i)
+                    norm2 = norm2 + w(i, k) * w(i, k);
+                if (norm2 == T())
+                    continue;
+
+                T alpha = w(k, k) > T()? -std::sqrt(norm2): std::sqrt(norm2);
+                T vk = w(k, k) - alpha;
+                //v = (vk, w(k+1..m, k)), v^T v = -2 alpha vk
+                T beta = -alpha * vk;
+                w(k, k) = alpha;
+                //the reflection is applied to each remaining column independently
+                parallelFor(k + 1, n, parallelGrain(2 * (m - k)), [&w, k, m, vk, beta](std::size_t first, std::size_t last)
+                {
+                    for (std::size_t j = first; j < last; ++j)
+                    {
+                        T dot = vk * w(k, j);
+                        for (std::size_t i = k + 1; i < m; ++i)
+                            dot = dot + w(i, k) * w(i, j);
+                        T f = dot / beta;
+                        w(k, j) = w(k, j) - f * vk;
+                        for (std::size_t i = k + 1; i < m; ++i)
+                            w(i, j) = w(i, j) - f * w(i, k);
+                    }
+                });
+            }
+
+            this->r = Matrix<T>(n, n);
+            this->good = true;
+            for (std::size_t i = 0; i < n && i < m; ++i)
+                for (std::size_t j = i; j < n; ++j)
+                    this->r(i, j) = w(i, j);
+        }
+
+        void onInsertRow(const Matrix<T>& a) override
+        {
+            if (a.cols() != this->dim())
+            {
+                onReset(a);
+                return;
+            }
+            this->update(&a(a.rows() - 1, 0));
+        }
+
+        //new column a: R^T r = A^T a, rho^2 = a^T a - r^T r
+        void onInsertCol(const Matrix<T>& a) override
+        {
+            std::size_t m = a.rows(), n = this->dim();
+            if (a.cols() != n + 1)
+            {
+                onReset(a);
+                return;
+            }
+
+            T *col = (T*)memCalloc(n, sizeof(T));
+            matrix_assert(col != NULL);
+            T d = T();
+            for (std::size_t i = 0; i < m; ++i)
+            {
+                T ai = a(i, n);
+                d = d + ai * ai;
+                for (std::size_t j = 0; j < n; ++j)
+                    col[j] = col[j] + a(i, j) * ai;
+            }
+            if (!this->border(col, d))
+                onReset(a);
+            memFree(col);
+        }
+
+        void onRemoveRow(const Matrix<T>& a, std::size_t, const T* row) override
+        {
+            if (a.cols() != this->dim() || !this->downdate(row))
+                onReset(a);
+        }
+
+        void onRemoveCol(const Matrix<T>& a, std::size_t idx) override
+        {
+            if (a.cols() + 1 != this->dim())
+            {
+                onReset(a);
+                return;
+            }
+            this->eraseCol(idx);
+        }
+
+        //least squares min ||A x - b|| through the corrected seminormal equations
+        //R^T R x = A^T b, followed by one step of refinement
+        Array<T> solve(const Matrix<T>& a, const Array<T>& b) const
+        {
+            matrix_assert(a.cols() == this->dim() && a.rows() == b.len());
+            Array<T> x = TriangularFactor<T>::solve(transposeMult(a, b));
+
+            Array<T> res(b.len());
+            for (std::size_t i = 0; i < a.rows(); ++i)
+            {
+                T acc = b[i];
+                for (std::size_t j = 0; j < a.cols(); ++j)
+                    acc = acc - a(i, j) * x[j];
+                res[i] = acc;
+            }
+            Array<T> e = TriangularFactor<T>::solve(transposeMult(a, res));
+            for (std::size_t j = 0; j < x.len(); ++j)
+                x[j] = x[j] + e[j];
+            return x;
+        }
+
+    private:
+        static Array<T> transposeMult(const Matrix<T>& a, const Array<T>& b)
+        {
+            Array<T> ret(a.cols());
+            for (std::size_t i = 0; i < a.rows(); ++i)
+                for (std::size_t j = 0; j < a.cols(); ++j)
+                    ret[j] = ret[j] + a(i, j) * b[i];
+            return ret;
+        }
+    };
+
+    //LU factorization with partial pivoting, P A = L U, of a square matrix.
+    //Appending a row and a column extends the factors by bordering in O(n^2),
+    //removals fall back to refactoring once the matrix is square again.
+    //While the matrix isn't square there are no factors: valid() is false and dim() is 0
+    template <typename T>
+    class LU : public MatrixFactor<T>
+    {
+    public:
+        LU(): lu(), perm(0), good(true), held_good(false), holding(false) { }
+
+        LU(const Matrix<T>& a): LU() { onReset(a); }
+
+        std::size_t dim() const { return lu.rows(); }
+        bool valid() const { return good; }
+        //unit lower L below the diagonal, U on and above it
+        const Matrix<T>& factors() const { return lu; }
+        const Array<std::size_t>& permutation() const { return perm; }
+
+        void onReset(const Matrix<T>& a) override
+        {
+            profile_kernel("lu");
+            holding = false;
+            held = Matrix<T>();
+            if (a.rows() != a.cols())
+            {
+                lu = Matrix<T>();
+                perm = Array<std::size_t>(0);
+                good = false;
+                return;
+            }
+
+            std::size_t n = a.rows();
+            lu = a;
+            perm = Array<std::size_t>(n, [](std::size_t i) { return i; });
+            good = true;
+            for (std::size_t k = 0; k < n; ++k)
+            {
+                std::size_t piv = k;
+                for (std::size_t i = k + 1; i < n; ++i)
+                    if (std::fabs(lu(i, k)) > std::fabs(lu(piv, k)))
+                        piv = i;
+                if (lu(piv, k) == T())
+                {
+                    good = false;
+                    return;
+                }
+                if (piv != k)
+                {
+                    for (std::size_t j = 0; j < n; ++j)
+                    {
+                        T t = lu(k, j);
+                        lu(k, j) = lu(piv, j);
+                        lu(piv, j) = t;
+                    }
+                    std::size_t t = perm[k];
+                    perm[k] = perm[piv];
+                    perm[piv] = t;
+                }
+                //rows below the pivot are independent
+                Matrix<T>& w = lu;
+                parallelFor(k + 1, n, parallelGrain(n - k), [&w, k, n](std::size_t first, std::size_t last)
+                {
+                    for (std::size_t i = first; i < last; ++i)
+                    {
+                        w(i, k) = w(i, k) / w(k, k);
+                        for (std::size_t j = k + 1; j < n; ++j)
+                            w(i, j) = w(i, j) - w(i, k) * w(k, j);
+                    }
+                });
+            }
+        }
+
+        void onInsertRow(const Matrix<T>& a) override { extend(a); }
+        void onInsertCol(const Matrix<T>& a) override { extend(a); }
+        void onRemoveRow(const Matrix<T>& a, std::size_t, const T*) override { onReset(a); }
+        void onRemoveCol(const Matrix<T>& a, std::size_t) override { onReset(a); }
+
+        Array<T> solve(const Array<T>& b) const
+        {
+            matrix_assert(good && b.len() == dim());
+            std::size_t n = dim();
+            Array<T> x(n);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                T acc = b[perm[i]];
+                for (std::size_t k = 0; k < i; ++k)
+                    acc = acc - lu(i, k) * x[k];
+                x[i] = acc;
+            }
+            for (std::size_t i = n; i-- > 0;)
+            {
+                for (std::size_t k = i + 1; k < n; ++k)
+                    x[i] = x[i] - lu(i, k) * x[k];
+                x[i] = x[i] / lu(i, i);
+            }
+            return x;
+        }
+
+        //solves A X = B for all columns of B at once, x can't be b
+        Matrix<T>& solve(const Matrix<T>& b, Matrix<T>& x) const
+        {
+            matrix_assert(good && b.rows() == dim() && &b != &x);
+            std::size_t n = dim(), m = b.cols();
+            if (x.rows() != n || x.cols() != m)
+                x = Matrix<T>(n, m);
+            if (m == 0)
+                return x;
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                T *x_i = &x(i, 0);
+                const T *b_i = &b(perm[i], 0);
+                for (std::size_t j = 0; j < m; ++j)
+                    x_i[j] = b_i[j];
+                for (std::size_t k = 0; k < i; ++k)
+                {
+                    const T l_ik = lu(i, k);
+                    const T *x_k = &x(k, 0);
+                    for (std::size_t j = 0; j < m; ++j)
+                        x_i[j] = x_i[j] - l_ik * x_k[j];
+                }
+            }
+            for (std::size_t i = n; i-- > 0;)
+            {
+                T *x_i = &x(i, 0);
+                for (std::size_t k = i + 1; k < n; ++k)
+                {
+                    const T u_ik = lu(i, k);
+                    const T *x_k = &x(k, 0);
+                    for (std::size_t j = 0; j < m; ++j)
+                        x_i[j] = x_i[j] - u_ik * x_k[j];
+                }
+                const T u_ii = lu(i, i);
+                for (std::size_t j = 0; j < m; ++j)
+                    x_i[j] = x_i[j] / u_ii;
+            }
+            return x;
+        }
+
+    private:
+        //A' = [A c; r^T d]: L u = P c, U^T l = r, delta = d - l^T u
+        void extend(const Matrix<T>& a)
+        {
+            //half way through, the factors of A are put aside until the corner arrives
+            if (a.rows() != a.cols())
+            {
+                if (!holding)
+                {
+                    held.swap(lu);
+                    held_perm = std::move(perm);
+                    perm = Array<std::size_t>(0);
+                    held_good = good;
+                    holding = true;
+                }
+                good = false;
+                return;
+            }
+            if (holding)
+            {
+                lu.swap(held);
+                perm = std::move(held_perm);
+                good = held_good;
+                holding = false;
+            }
+            std::size_t n = dim();
+            if (!good || a.rows() != n + 1)
+            {
+                onReset(a);
+                return;
+            }
+
+            lu.expand(n + 1, n + 1);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                T acc = a(perm[i], n);
+                for (std::size_t k = 0; k < i; ++k)
+                    acc = acc - lu(i, k) * lu(k, n);
+                lu(i, n) = acc;
+            }
+            for (std::size_t j = 0; j < n; ++j)
+            {
+                T acc = a(n, j);
+                for (std::size_t k = 0; k < j; ++k)
+                    acc = acc - lu(n, k) * lu(k, j);
+                lu(n, j) = acc / lu(j, j);
+            }
+            T delta = a(n, n), scale = std::fabs(a(n, n)), growth = T();
+            for (std::size_t k = 0; k < n; ++k)
+            {
+                delta = delta - lu(n, k) * lu(k, n);
+                scale = scale + std::fabs(lu(n, k) * lu(k, n));
+                if (std::fabs(lu(n, k)) > growth)
+                    growth = std::fabs(lu(n, k));
+            }
+            lu(n, n) = delta;
+            perm.insert(n);
+
+            //bordering can't pivot: partial pivoting keeps |l| <= 1, so a bigger multiplier means
+            //the new row should have been a pivot, and a corner lost to cancellation may be one
+            //of the old pivots. Both need a pivoted refactorization
+            if (growth > T(1) || std::fabs(delta) <= T(n + 1) * std::numeric_limits<T>::epsilon() * scale)
+                onReset(a);
+        }
+
+        Matrix<T> lu;
+        Array<std::size_t> perm;
+        bool good;
+        //factors of the square matrix before a row or column was appended
+        Matrix<T> held;
+        Array<std::size_t> held_perm;
+        bool held_good;
+        bool holding;
+    };
+}
+
+
+//MATRIX FUNCTIONS
+//powers, exponential and polynomials of square matrices. MatrixWorkspace keeps every
+//intermediate matrix between calls, so using the same workspace in a loop doesn't allocate
+namespace stuff
+{
+    template <typename T>
+    class MatrixWorkspace
+    {
+    public:
+        MatrixWorkspace(): pows(nullptr), n_pows(0) { }
+
+        MatrixWorkspace(const MatrixWorkspace<T>&) = delete;
+        MatrixWorkspace<T>& operator=(const MatrixWorkspace<T>&) = delete;
+
+        ~MatrixWorkspace()
+        {
+            if (pows != nullptr)
+                delete[] pows;
+        }
+
+        //out = a^k by repeated squaring, out can't be a
+        Matrix<T>& pow(const Matrix<T>& a, std::size_t k, Matrix<T>& out)
+        {
+            profile_kernel("pow");
+            checkSquare(a);
+            matrix_assert(&out != &a);
+            std::size_t n = a.rows();
+            fit(base, n);
+            fit(tmp, n);
+            fit(out, n);
+            copy(base, a);
+
+            bool empty = true;
+            while (k)
+            {
+                if (k & 1)
+                {
+                    if (empty)
+                        copy(out, base);
+                    else
+                    {
+                        gemm(out, base, tmp);
+                        out.swap(tmp);
+                    }
+                    empty = false;
+                }
+                k >>= 1;
+                if (k)
+                {
+                    gemm(base, base, tmp);
+                    base.swap(tmp);
+                }
+            }
+
+            if (empty)
+                identity(out, T(1));
+            return out;
+        }
+
+        //out = e^a by scaling and squaring with Pade approximants (Higham, 2005), out can't be a
+        Matrix<T>& expm(const Matrix<T>& a, Matrix<T>& out)
+        {
+            profile_kernel("expm");
+            static const double theta[] = {1.495585217958292e-2, 2.539398330063230e-1, 
+                                           9.504178996162932e-1, 2.097847961257068e0};
+            checkSquare(a);
+            matrix_assert(&out != &a);
+            std::size_t n = a.rows();
+            fit(a2, n);
+            fit(u, n);
+            fit(v, n);
+            fit(tmp, n);
+            fit(out, n);
+
+            T norm = norm1(a);
+            for (std::size_t i = 0; i < 4; ++i)
+            {
+                if (norm <= T(theta[i]))
+                {
+                    padeLow(a, 2 * i + 3);
+                    padeSolve(out);
+                    return out;
+                }
+            }
+
+            std::size_t s = 0;
+            T scale = T(1);
+            while (norm * scale > T(5.371920351148152e0))
+            {
+                scale = scale * T(0.5);
+                ++s;
+            }
+            fit(base, n);
+            copy(base, a);
+            scal(base, scale);
+            pade13(base);
+            padeSolve(out);
+
+            for (std::size_t i = 0; i < s; ++i)
+            {
+                gemm(out, out, tmp);
+                out.swap(tmp);
+            }
+            return out;
+        }
+
+        //out = c[0] I + c[1] a + ... + c[d] a^d with the Paterson-Stockmeyer scheme,
+        //needs about 2 sqrt(d) products instead of d. out can't be a
+        Matrix<T>& polynomial(const Matrix<T>& a, const Array<T>& c, Matrix<T>& out)
+        {
+            profile_kernel("polynomial");
+            checkSquare(a);
+            matrix_assert(&out != &a);
+            std::size_t n = a.rows();
+            fit(out, n);
+            if (c.len() == 0)
+            {
+                identity(out, T());
+                return out;
+            }
+
+            std::size_t d = c.len() - 1;
+            std::size_t s = (std::size_t)std::sqrt((double)d);
+            if (s == 0)
+                s = 1;
+            std::size_t r = d / s;
+
+            if (n_pows < s + 1)
+            {
+                if (pows != nullptr)
+                    delete[] pows;
+                pows = new Matrix<T>[s + 1];
+                n_pows = s + 1;
+            }
+            fit(pows[1], n);
+            copy(pows[1], a);
+            for (std::size_t i = 2; i <= s; ++i)
+                gemm(pows[i - 1], a, pows[i]);
+
+            //Horner on a^s, each coefficient is a polynomial of degree < s
+            block(out, c, r * s, d - r * s);
+            fit(tmp, n);
+            for (std::size_t j = r; j-- > 0;)
+            {
+                gemm(out, pows[s], tmp);
+                out.swap(tmp);
+                addBlock(out, c, j * s, s - 1);
+            }
+            return out;
+        }
+
+    private:
+        static void checkSquare(const Matrix<T>& a)
+        {
+            if (a.rows() != a.cols())
+            {
+                std::cerr << "Matrix function of a non square matrix (" << a.rows() << "x" << a.cols() << ")" << std::endl;
+                exit(-1);
+            }
+        }
+
+        static void fit(Matrix<T>& m, std::size_t n)
+        {
+            if (m.rows() != n || m.cols() != n)
+                m = Matrix<T>(n, n);
+        }
+
+        static void copy(Matrix<T>& dst, const Matrix<T>& src)
+        {
+            std::size_t n = src.rows() * src.cols();
+            if (n == 0)
+                return;
+            T *d = &dst(0, 0);
+            const T *s = &src(0, 0);
+            for (std::size_t i = 0; i < n; ++i)
+                d[i] = s[i];
+        }
+
+        static void identity(Matrix<T>& m, T alpha)
+        {
+            m.forEach([alpha](std::size_t i, std::size_t j, T) { return i == j? alpha: T(); });
+        }
+
+        static void scal(Matrix<T>& m, T alpha)
+        {
+            std::size_t n = m.rows() * m.cols();
+            if (n == 0)
+                return;
+            T *d = &m(0, 0);
+            for (std::size_t i = 0; i < n; ++i)
+                d[i] = d[i] * alpha;
+        }
+
+        //y = y + alpha * x
+        static void axpy(Matrix<T>& y, T alpha, const Matrix<T>& x)
+        {
+            std::size_t n = x.rows() * x.cols();
+            if (n == 0)
+                return;
+            T *d = &y(0, 0);
+            const T *s = &x(0, 0);
+            for (std::size_t i = 0; i < n; ++i)
+                d[i] = d[i] + alpha * s[i];
+        }
+
+        static void addIdentity(Matrix<T>& m, T alpha)
+        {
+            for (std::size_t i = 0; i < m.rows(); ++i)
+                m(i, i) = m(i, i) + alpha;
+        }
+
+        static T norm1(const Matrix<T>& a)
+        {
+            T ret = T();
+            for (std::size_t j = 0; j < a.cols(); ++j)
+            {
+                T col = T();
+                for (std::size_t i = 0; i < a.rows(); ++i)
+                    col = col + std::fabs(a(i, j));
+                if (col > ret)
+                    ret = col;
+            }
+            return ret;
+        }
+
+        //m = c[first] I + c[first + 1] a + ... + c[first + deg] a^deg
+        void block(Matrix<T>& m, const Array<T>& c, std::size_t first, std::size_t deg)
+        {
+            identity(m, c[first]);
+            for (std::size_t i = 1; i <= deg; ++i)
+                axpy(m, c[first + i], pows[i]);
+        }
+
+        void addBlock(Matrix<T>& m, const Array<T>& c, std::size_t first, std::size_t deg)
+        {
+            addIdentity(m, c[first]);
+            for (std::size_t i = 1; i <= deg; ++i)
+                axpy(m, c[first + i], pows[i]);
+        }
+
+        //u = a * (odd part), v = even part, for the diagonal Pade approximant of degree m <= 9
+        void padeLow(const Matrix<T>& a, std::size_t m)
+        {
+            static const double b3[] = {120.0, 60.0, 12.0, 1.0};
+            static const double b5[] = {30240.0, 15120.0, 3360.0, 420.0, 30.0, 1.0};
+            static const double b7[] = {17297280.0, 8648640.0, 1995840.0, 277200.0, 25200.0, 1512.0, 56.0, 1.0};
+            static const double b9[] = {17643225600.0, 8821612800.0, 2075673600.0, 302702400.0, 30270240.0, 
+                                        2162160.0, 110880.0, 3960.0, 90.0, 1.0};
+            const double *b = m == 3? b3: m == 5? b5: m == 7? b7: b9;
+            std::size_t n = a.rows();
+
+            //even powers a^2, a^4, ... are kept in `even`
+            gemm(a, a, a2);
+            Matrix<T> *even[] = {&a2, &a4, &a6, &a8};
+            for (std::size_t k = 2; 2 * k < m; ++k)
+            {
+                fit(*even[k - 1], n);
+                gemm(*even[k - 2], a2, *even[k - 1]);
+            }
+
+            identity(v, T(b[0]));
+            identity(tmp, T(b[1]));
+            for (std::size_t k = 1; 2 * k < m; ++k)
+            {
+                axpy(v, T(b[2 * k]), *even[k - 1]);
+                axpy(tmp, T(b[2 * k + 1]), *even[k - 1]);
+            }
+            gemm(a, tmp, u);
+        }
+
+        void pade13(const Matrix<T>& a)
+        {
+            static const double b[] = {64764752532480000.0, 32382376266240000.0, 7771770303897600.0, 
+                                       1187353796428800.0, 129060195264000.0, 10559470521600.0, 
+                                       670442572800.0, 33522128640.0, 1323241920.0, 40840800.0, 
+                                       960960.0, 16380.0, 182.0, 1.0};
+            std::size_t n = a.rows();
+            fit(a4, n);
+            fit(a6, n);
+            gemm(a, a, a2);
+            gemm(a2, a2, a4);
+            gemm(a4, a2, a6);
+
+            //u = a * (a6 (b13 a6 + b11 a4 + b9 a2) + b7 a6 + b5 a4 + b3 a2 + b1 I)
+            identity(tmp, T());
+            axpy(tmp, T(b[13]), a6);
+            axpy(tmp, T(b[11]), a4);
+            axpy(tmp, T(b[9]), a2);
+            gemm(a6, tmp, v);
+            axpy(v, T(b[7]), a6);
+            axpy(v, T(b[5]), a4);
+            axpy(v, T(b[3]), a2);
+            addIdentity(v, T(b[1]));
+            gemm(a, v, u);
+
+            //v = a6 (b12 a6 + b10 a4 + b8 a2) + b6 a6 + b4 a4 + b2 a2 + b0 I
+            identity(tmp, T());
+            axpy(tmp, T(b[12]), a6);
+            axpy(tmp, T(b[10]), a4);
+            axpy(tmp, T(b[8]), a2);
+            gemm(a6, tmp, v);
+            axpy(v, T(b[6]), a6);
+            axpy(v, T(b[4]), a4);
+            axpy(v, T(b[2]), a2);
+            addIdentity(v, T(b[0]));
+        }
+
+        //out = (v - u)^-1 (v + u)
+        void padeSolve(Matrix<T>& out)
+        {
+            copy(tmp, v);
+            axpy(tmp, T(1), u);
+            axpy(v, T(-1), u);
+            lu.onReset(v);
+            lu.solve(tmp, out);
+        }
+
+        Matrix<T> base, tmp, a2, a4, a6, a8, u, v;
+        Matrix<T> *pows;
+        std::size_t n_pows;
+        LU<T> lu;
+    };
+
+    template <typename T>
+    Matrix<T> pow(const Matrix<T>& a, std::size_t k)
+    {
+        MatrixWorkspace<T> w;
+        Matrix<T> ret;
+        w.pow(a, k, ret);
+        return ret;
+    }
+
+    template <typename T>
+    Matrix<T> expm(const Matrix<T>& a)
+    {
+        MatrixWorkspace<T> w;
+        Matrix<T> ret;
+        w.expm(a, ret);
+        return ret;
+    }
+
+    template <typename T>
+    Matrix<T> polynomial(const Matrix<T>& a, const Array<T>& c)
+    {
+        MatrixWorkspace<T> w;
+        Matrix<T> ret;
+        w.polynomial(a, c, ret);
+        return ret;
+    }
+}
+
+
+//COMPLEX
+namespace stuff
+{
+    template <typename E, typename T>
+    class ComplexExpression
+    {
+    public:
+        constexpr T r() const { return static_cast<const E&>(*this).r(); }
+        constexpr T i() const { return static_cast<const E&>(*this).i(); }
+    };
+
+    template<typename T>
+    class Complex : public ComplexExpression<Complex<T>, T>
+    {
+    public:
+        constexpr Complex(): real(), imag() { }
+
+        constexpr Complex(T real_part, T imag_part): real(real_part), imag(imag_part) { }
+
+        Complex(const Complex<T>& other) = default;
+
+        Complex(Complex<T>&& other) = default;
+
+        template <typename E>
+        constexpr Complex(const ComplexExpression<E, T>& expr): real(expr.r()), imag(expr.i()) { }
+
+        Complex<T>& operator=(const Complex<T>& other) = default;
+
+        Complex<T>& operator=(Complex<T>&& other) = default;
+
+        //both parts are evaluated before writing, expr may be reading from this complex
+        template <typename E>
+        constexpr Complex<T>& operator=(const ComplexExpression<E, T>& expr)
+        {
+            T new_real = expr.r();
+            T new_imag = expr.i();
+            real = new_real;
+            imag = new_imag;
+            return *this;
+        }
+
+        ~Complex() = default;
+        constexpr const T& r() const { return real; }
+        constexpr const T& i() const { return imag; }
+        constexpr T& r() { return real; }
+        constexpr T& i() { return imag; }
+    private:
+        T real, imag;
+    };
+
+    template <typename P1, typename P2, typename T>
+    class ComplexSum : public ComplexExpression<ComplexSum<P1, P2, T>, T>
+    {
+    public:
+        constexpr ComplexSum(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
+        constexpr T r() const { return p1.r() + p2.r(); }
+        constexpr T i() const { return p1.i() + p2.i(); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    constexpr ComplexSum<P1, P2, T> operator+(const ComplexExpression<P1, T>& c1, const ComplexExpression<P2, T>& c2)
+    {
+        return ComplexSum<P1, P2, T> (
+                                  *static_cast<const P1*>(&c1),
+                                  *static_cast<const P2*>(&c2));
+    }
+
+    template <typename P1, typename P2, typename T>
+    class ComplexSub : public ComplexExpression<ComplexSub<P1, P2, T>, T>
+    {
+    public:
+        constexpr ComplexSub(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
+        constexpr T r() const { return p1.r() - p2.r(); }
+        constexpr T i() const { return p1.i() - p2.i(); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    constexpr ComplexSub<P1, P2, T> operator-(const ComplexExpression<P1, T>& c1, const ComplexExpression<P2, T>& c2)
+    {
+        return ComplexSub<P1, P2, T> (
+                                  *static_cast<const P1*>(&c1),
+                                  *static_cast<const P2*>(&c2));
+    }
+
+    template <typename P1, typename P2, typename T>
+    class ComplexMult : public ComplexExpression<ComplexMult<P1, P2, T>, T>
+    {
+    public:
+        constexpr ComplexMult(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
+        constexpr T r() const { return p1.r() * p2.r() - p1.i() * p2.i(); }
+        constexpr T i() const { return p1.r() * p2.i() + p1.i() * p2.r(); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    constexpr ComplexMult<P1, P2, T> operator*(const ComplexExpression<P1, T>& c1, const ComplexExpression<P2, T>& c2)
+    {
+        return ComplexMult<P1, P2, T> (
+                                       *static_cast<const P1*>(&c1),
+                                       *static_cast<const P2*>(&c2));
+    }
+
+    template <typename P1, typename P2, typename T>
+    class ComplexDiv : public ComplexExpression<ComplexDiv<P1, P2, T>, T>
+    {
+    public:
+        constexpr ComplexDiv(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
+        constexpr T r() const { return (p1.r() * p2.r() + p1.i() * p2.i()) / (p2.r() * p2.r() + p2.i() * p2.i()); }
+        constexpr T i() const { return (p1.i() * p2.r() - p1.r() * p2.i()) / (p2.r() * p2.r() + p2.i() * p2.i()); }
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    template <typename P1, typename P2, typename T>
+    constexpr ComplexDiv<P1, P2, T> operator/(const ComplexExpression<P1, T>& c1, const ComplexExpression<P2, T>& c2)
+    {
+        return ComplexDiv<P1, P2, T> (
+                                      *static_cast<const P1*>(&c1),
+                                      *static_cast<const P2*>(&c2));
+    }
+
+    template <typename P1, typename T>
+    class ComplexMultScal : public ComplexExpression<ComplexMultScal<P1, T>, T>
+    {
+    public:
+        constexpr ComplexMultScal(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T r() const { return p1.r() * s; }
+        constexpr T i() const { return p1.i() * s; }
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    constexpr ComplexMultScal<P1, T> operator*(const ComplexExpression<P1, T>& c1, const T& c2)
+    {
+        return ComplexMultScal<P1, T> (
+                                       *static_cast<const P1*>(&c1),
+                                       c2);
+    }
+
+    template <typename P1, typename T>
+    constexpr ComplexMultScal<P1, T> operator*(const T& c2, const ComplexExpression<P1, T>& c1)
+    {
+        return ComplexMultScal<P1, T> (
+                                       *static_cast<const P1*>(&c1),
+                                       c2);
+    }
+
+    template <typename P1, typename T>
+    class ComplexDivScal : public ComplexExpression<ComplexDivScal<P1, T>, T>
+    {
+    public:
+        constexpr ComplexDivScal(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T r() const { return p1.r() / s; }
+        constexpr T i() const { return p1.i() / s; }
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    constexpr ComplexDivScal<P1, T> operator/(const ComplexExpression<P1, T>& c1, const T& c2)
+    {
+        return ComplexDivScal<P1, T> (
+                                      *static_cast<const P1*>(&c1),
+                                      c2);
+    }
+
+    template <typename P1, typename T>
+    class ComplexDivScalI : public ComplexExpression<ComplexDivScalI<P1, T>, T>
+    {
+    public:
+        constexpr ComplexDivScalI(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T r() const { return (s * p1.r()) / (p1.r() * p1.r() + p1.i() * p1.i()); }
+        constexpr T i() const { return (-s * p1.i()) / (p1.r() * p1.r() + p1.i() * p1.i()); }
+    private:
+        const P1& p1;
+        const T& s;
+    };
+
+    template <typename P1, typename T>
+    constexpr ComplexDivScalI<P1, T> operator/(const T& c2, const ComplexExpression<P1, T>& c1)
+    {
+        return ComplexDivScalI<P1, T> (
+                                       *static_cast<const P1*>(&c1),
+                                       c2);
+    }
+
+    template <typename P1, typename T>
+    class ComplexConjug : public ComplexExpression<ComplexConjug<P1, T>, T>
+    {
+    public:
+        constexpr ComplexConjug(const P1& p1_): p1(p1_) { }
+        constexpr T r() const { return p1.r(); }
+        constexpr T i() const { return -p1.i(); }
+    private:
+        const P1& p1;
+    };
+
+    template <typename P1, typename T>
+    constexpr ComplexConjug<P1, T> operator!(const ComplexExpression<P1, T>& c1)
+    {
+        return ComplexConjug<P1, T> (*static_cast<const P1*>(&c1));
+    }
+
+    template <typename P1, typename T>
+    class ComplexMinus : public ComplexExpression<ComplexMinus<P1, T>, T>
+    {
+    public:
+        constexpr ComplexMinus(const P1& p1_): p1(p1_) { }
+        constexpr T r() const { return -p1.r(); }
+        constexpr T i() const { return -p1.i(); }
+    private:
+        const P1& p1;
+    };
+
+    template <typename P1, typename T>
+    constexpr ComplexMinus<P1, T> operator-(const ComplexExpression<P1, T>& c1)
+    {
+        return ComplexMinus<P1, T> (*static_cast<const P1*>(&c1));
+    }
+
+    template <typename T>
+    class ComplexExp : public ComplexExpression<ComplexExp<T>, T>
+    {
+    public:
+        ComplexExp(const T& p1_): p1(p1_) { }
+        T r() const { return cos(p1); }
+        T i() const { return sin(p1); }
+    private:
+        //by value, theta is usually a temporary
+        const T p1;
+    };
+
+    template <typename T>
+    ComplexExp<T> complexExp(const T& theta)
+    {
+        return ComplexExp<T> (theta);
+    }
+
+    template <typename P1, typename T>
+    class ComplexSumSca : public ComplexExpression<ComplexSumSca<P1, T>, T>
+    {
+    public:
+        constexpr ComplexSumSca(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T r() const { return p1.r() + s; }
+        constexpr T i() const { return p1.i(); }
+    private:
+        const P1& p1;
+        const T s;
+    };
+
+    template <typename E, typename T>
+    constexpr ComplexSumSca<E, T> operator+(const ComplexExpression<E, T>& c, const T& s)
+    {
+        return ComplexSumSca<E, T>(*static_cast<const E*>(&c), s);
+    }
+
+    template <typename E, typename T>
+    constexpr ComplexSumSca<E, T> operator+(const T& s, const ComplexExpression<E, T>& c)
+    {
+        return ComplexSumSca<E, T>(*static_cast<const E*>(&c), s);
+    }
+
+    template <typename P1, typename T>
+    class ComplexSubSca : public ComplexExpression<ComplexSubSca<P1, T>, T>
+    {
+    public:
+        constexpr ComplexSubSca(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T r() const { return p1.r() - s; }
+        constexpr T i() const { return p1.i(); }
+    private:
+        const P1& p1;
+        const T s;
+    };
+
+    template <typename E, typename T>
+    constexpr ComplexSubSca<E, T> operator-(const ComplexExpression<E, T>& c, const T& s)
+    {
+        return ComplexSubSca<E, T>(*static_cast<const E*>(&c), s);
+    }
+
+    template <typename P1, typename T>
+    class ComplexSubScaI : public ComplexExpression<ComplexSubScaI<P1, T>, T>
+    {
+    public:
+        constexpr ComplexSubScaI(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
+        constexpr T r() const { return s - p1.r(); }
+        constexpr T i() const { return -p1.i(); }
+    private:
+        const P1& p1;
+        const T s;
+    };
+
+    template <typename E, typename T>
+    constexpr ComplexSubScaI<E, T> operator-(const T& s, const ComplexExpression<E, T>& c)
+    {
+        return ComplexSubScaI<E, T>(*static_cast<const E*>(&c), s);
+    }
+
+    template<typename E, typename T>
+    std::ostream& operator<<(std::ostream& out, const ComplexExpression<E, T>& expr)
+    {
+        out << expr.r() << SEPARATOR << COMPLEX_BET << expr.i() << COMPLEX_IMG;
+        return out;
+    }
+}
+
+
+//SPLIT COMPLEX
+//complex arrays and matrices stored as two planes, real parts and imaginary parts, instead of
+//interleaved stuff::Complex. Expressions are evaluated SPLIT_BLOCK elements at a time: leaves hand
+//their planes over and inner nodes write into blocks on the stack, so every operation runs as a
+//vector kernel over contiguous planes. Element wise only, every kernel reads element i before
+//writing it, so a = a * b works in place
+namespace stuff
+{
+    template <typename T>
+    void splitAdd(const T* ar, const T* ai, const T* br, const T* bi, T* cr, T* ci, std::size_t n)
+    {
+        simdFor<T>(n, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg r = O::add(O::load(ar + i), O::load(br + i));
+            O::store(ci + i, O::add(O::load(ai + i), O::load(bi + i)));
+            O::store(cr + i, r);
+        });
+    }
+
+    template <typename T>
+    void splitSub(const T* ar, const T* ai, const T* br, const T* bi, T* cr, T* ci, std::size_t n)
+    {
+        simdFor<T>(n, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg r = O::sub(O::load(ar + i), O::load(br + i));
+            O::store(ci + i, O::sub(O::load(ai + i), O::load(bi + i)));
+            O::store(cr + i, r);
+        });
+    }
+
+    template <typename T>
+    void splitMul(const T* ar, const T* ai, const T* br, const T* bi, T* cr, T* ci, std::size_t n)
+    {
+        simdFor<T>(n, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg a_r = O::load(ar + i), a_i = O::load(ai + i);
+            typename O::reg b_r = O::load(br + i), b_i = O::load(bi + i);
+            O::store(cr + i, O::sub(O::mul(a_r, b_r), O::mul(a_i, b_i)));
+            O::store(ci + i, O::add(O::mul(a_r, b_i), O::mul(a_i, b_r)));
+        });
+    }
+
+    //same formula as ComplexDiv
+    template <typename T>
+    void splitDiv(const T* ar, const T* ai, const T* br, const T* bi, T* cr, T* ci, std::size_t n)
+    {
+        simdFor<T>(n, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg a_r = O::load(ar + i), a_i = O::load(ai + i);
+            typename O::reg b_r = O::load(br + i), b_i = O::load(bi + i);
+            typename O::reg d = O::add(O::mul(b_r, b_r), O::mul(b_i, b_i));
+            O::store(cr + i, O::div(O::add(O::mul(a_r, b_r), O::mul(a_i, b_i)), d));
+            O::store(ci + i, O::div(O::sub(O::mul(a_i, b_r), O::mul(a_r, b_i)), d));
+        });
+    }
+
+    //(cr, ci) = (ar, ai) * (sr, si), with si = 0 for real scalars
+    template <typename T>
+    void splitScale(const T* ar, const T* ai, T sr, T si, T* cr, T* ci, std::size_t n)
+    {
+        simdFor<T>(n, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg a_r = O::load(ar + i), a_i = O::load(ai + i);
+            typename O::reg s_r = O::set(sr), s_i = O::set(si);
+            O::store(cr + i, O::sub(O::mul(a_r, s_r), O::mul(a_i, s_i)));
+            O::store(ci + i, O::add(O::mul(a_r, s_i), O::mul(a_i, s_r)));
+        });
+    }
+
+    //(cr, ci) = (ar, sign * ai) * sign_r, conjugate for (1, -1), minus for (-1, -1)
+    template <typename T>
+    void splitSign(const T* ar, const T* ai, bool neg_real, T* cr, T* ci, std::size_t n)
+    {
+        simdFor<T>(n, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg a_r = O::load(ar + i);
+            O::store(ci + i, O::neg(O::load(ai + i)));
+            O::store(cr + i, neg_real? O::neg(a_r): a_r);
+        });
+    }
+
+    //sqrt(re^2 + im^2), without the overflow protection of std::hypot
+    template <typename T>
+    void splitAbs(const T* ar, const T* ai, T* out, std::size_t n)
+    {
+        simdFor<T>(n, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg a_r = O::load(ar + i), a_i = O::load(ai + i);
+            O::store(out + i, O::sqrt(O::add(O::mul(a_r, a_r), O::mul(a_i, a_i))));
+        });
+    }
+
+    template <typename E, typename T>
+    class SplitComplexExpression
+    {
+    public:
+        T re(std::size_t i) const { return static_cast<const E&>(*this).re(i); }
+        T im(std::size_t i) const { return static_cast<const E&>(*this).im(i); }
+        std::size_t rows() const { return static_cast<const E&>(*this).rows(); }
+        std::size_t cols() const { return static_cast<const E&>(*this).cols(); }
+        std::size_t size() const { return rows() * cols(); }
+        //writes elements [b, b + n) into cr, ci, n is at most SPLIT_BLOCK
+        void evaluate(std::size_t b, std::size_t n, T* cr, T* ci) const { static_cast<const E&>(*this).evaluate(b, n, cr, ci); }
+    };
+
+    template <typename T>
+    class ComplexArray;
+
+    template <typename T>
+    class ComplexMatrix;
+
+    //planes of elements [b, b + n) of e: evaluated into (sr, si), or straight from the container
+    template <typename E, typename T>
+    void splitOperand(const SplitComplexExpression<E, T>& e, std::size_t b, std::size_t n, T* sr, T* si, const T*& r, const T*& i)
+    {
+        e.evaluate(b, n, sr, si);
+        r = sr;
+        i = si;
+    }
+
+    template <typename T>
+    void splitOperand(const ComplexArray<T>& e, std::size_t b, std::size_t, T*, T*, const T*& r, const T*& i)
+    {
+        r = e.realData() + b;
+        i = e.imagData() + b;
+    }
+
+    template <typename T>
+    void splitOperand(const ComplexMatrix<T>& e, std::size_t b, std::size_t, T*, T*, const T*& r, const T*& i)
+    {
+        r = e.realData() + b;
+        i = e.imagData() + b;
+    }
+
+    //storage shared by ComplexArray and ComplexMatrix
+    template <typename T>
+    class SplitPlanes
+    {
+    protected:
+        SplitPlanes(): re_data(nullptr), im_data(nullptr) { }
+
+        void allocate(std::size_t n, bool zero)
+        {
+            re_data = zero? (T*)memCalloc(n, sizeof(T)): allocElems<T>(n);
+            im_data = zero? (T*)memCalloc(n, sizeof(T)): allocElems<T>(n);
+            array_assert((re_data != NULL && im_data != NULL) || n == 0);
+        }
+
+        void release()
+        {
+            memFree(re_data);
+            memFree(im_data);
+            re_data = im_data = nullptr;
+        }
+
+        void grow(std::size_t n)
+        {
+            re_data = (T*)memRealloc((void*)re_data, n * sizeof(T));
+            im_data = (T*)memRealloc((void*)im_data, n * sizeof(T));
+            array_assert(re_data != NULL && im_data != NULL);
+        }
+
+        void copy(const SplitPlanes<T>& o, std::size_t n)
+        {
+            copyElems(re_data, o.re_data, n);
+            copyElems(im_data, o.im_data, n);
+        }
+
+        void take(SplitPlanes<T>& o)
+        {
+            re_data = o.re_data;
+            im_data = o.im_data;
+            o.re_data = o.im_data = nullptr;
+        }
+
+        //fills n elements from expr, into new planes when the size changes
+        template <typename E>
+        void assign(const SplitComplexExpression<E, T>& expr, std::size_t n, bool same_size)
+        {
+            T *old_re = nullptr, *old_im = nullptr;
+            if (!same_size)
+            {
+                old_re = re_data;
+                old_im = im_data;
+                allocate(n, false);
+            }
+            T *cr = re_data, *ci = im_data;
+            parallelFor(0, n, PARALLEL_GRAIN, [&expr, cr, ci](std::size_t first, std::size_t last)
+            {
+                for (std::size_t b = first; b < last; b += SPLIT_BLOCK)
+                {
+                    std::size_t m = last - b < SPLIT_BLOCK? last - b: SPLIT_BLOCK;
+                    expr.evaluate(b, m, cr + b, ci + b);
+                }
+            });
+            memFree(old_re);
+            memFree(old_im);
+        }
+
+        T *re_data;
+        T *im_data;
+    };
+
+    template <typename T>
+    class ComplexArray : public SplitComplexExpression<ComplexArray<T>, T>, private SplitPlanes<T>
+    {
+    public:
+        ComplexArray(): sz_cached(0), elems(0) { }
+
+        ComplexArray(std::size_t n): sz_cached(n), elems(n) { this->allocate(n, true); }
+
+        template <typename F, typename P = SequencedPolicy>
+        ComplexArray(std::size_t n, const F& func, P policy = P()): sz_cached(n), elems(n)
+        {
+            this->allocate(n, false);
+            policyFor(policy, 0, n, PARALLEL_GRAIN, [this, &func](std::size_t i) { set(i, func(i)); });
+        }
+
+        //splits interleaved complex numbers
+        template <std::size_t M>
+        ComplexArray(const Array<Complex<T>, M>& o): sz_cached(o.len()), elems(o.len())
+        {
+            this->allocate(elems, false);
+            for (std::size_t i = 0; i < elems; ++i)
+                set(i, o[i]);
+        }
+
+        ComplexArray(const ComplexArray<T>& o): sz_cached(o.elems), elems(o.elems)
+        {
+            stats_count(STATS_ARRAY, copies, 1);
+            this->allocate(elems, false);
+            this->copy(o, elems);
+        }
+
+        ComplexArray(ComplexArray<T>&& o): sz_cached(o.sz_cached), elems(o.elems)
+        {
+            stats_count(STATS_ARRAY, moves, 1);
+            this->take(o);
+            o.sz_cached = o.elems = 0;
+        }
+
+        template <typename E>
+        ComplexArray(const SplitComplexExpression<E, T>& expr): sz_cached(0), elems(0)
+        {
+            *this = expr;
+        }
+
+        ComplexArray<T>& operator=(const ComplexArray<T>& o)
+        {
+            stats_count(STATS_ARRAY, copies, 1);
+            if (this == &o)
+                return *this;
+            if (sz_cached < o.elems)
+            {
+                this->release();
+                this->allocate(o.elems, false);
+                sz_cached = o.elems;
+            }
+            elems = o.elems;
+            this->copy(o, elems);
+            return *this;
+        }
+
+        ComplexArray<T>& operator=(ComplexArray<T>&& o)
+        {
+            stats_count(STATS_ARRAY, moves, 1);
+            if (this == &o)
+                return *this;
+            this->release();
+            this->take(o);
+            sz_cached = o.sz_cached;
+            elems = o.elems;
+            o.sz_cached = o.elems = 0;
+            return *this;
+        }
+
+        template <typename E>
+        ComplexArray<T>& operator=(const SplitComplexExpression<E, T>& expr)
+        {
+            stats_count(STATS_ARRAY, materializations, 1);
+            profile_kernel("split assign");
+            std::size_t n = expr.size();
+            this->assign(expr, n, n == elems);
+            if (n != elems)
+                sz_cached = n;
+            elems = n;
+            return *this;
+        }
+
+        ~ComplexArray() { this->release(); }
+
+        std::size_t len() const { return elems; }
+        std::size_t rows() const { return elems; }
+        std::size_t cols() const { return 1; }
+
+        T re(std::size_t i) const { return this->re_data[i]; }
+        T im(std::size_t i) const { return this->im_data[i]; }
+        Complex<T> operator[](std::size_t i) const { return Complex<T>(this->re_data[i], this->im_data[i]); }
+        void set(std::size_t i, const Complex<T>& c)
+        {
+            this->re_data[i] = c.r();
+            this->im_data[i] = c.i();
+        }
+
+        const T* realData() const { return this->re_data; }
+        const T* imagData() const { return this->im_data; }
+        T* realData() { return this->re_data; }
+        T* imagData() { return this->im_data; }
+
+        ComplexArray<T>& insert(const Complex<T>& c)
+        {
+            if (elems == sz_cached)
+            {
+                //same growth as Array
+                std::size_t cap = (std::size_t)(sz_cached * ARRAY_GROWTH_FACTOR);
+                reserve(cap < sz_cached + ARRAY_NEW_SIZE_FACTOR? sz_cached + ARRAY_NEW_SIZE_FACTOR: cap);
+            }
+            set(elems++, c);
+            return *this;
+        }
+
+        ComplexArray<T>& reserve(std::size_t n)
+        {
+            if (n > sz_cached)
+            {
+                this->grow(n);
+                sz_cached = n;
+            }
+            return *this;
+        }
+
+        std::size_t capacity() const { return sz_cached; }
+
+        //interleaves the planes back into complex numbers
+        Array<Complex<T>> toArray() const
+        {
+            Array<Complex<T>> ret(elems);
+            for (std::size_t i = 0; i < elems; ++i)
+                ret[i] = (*this)[i];
+            return ret;
+        }
+
+        void evaluate(std::size_t b, std::size_t n, T* cr, T* ci) const
+        {
+            copyElems(cr, this->re_data + b, n);
+            copyElems(ci, this->im_data + b, n);
+        }
+
+    private:
+        std::size_t sz_cached;
+        std::size_t elems;
+    };
+
+    template <typename T>
+    class ComplexMatrix : public SplitComplexExpression<ComplexMatrix<T>, T>, private SplitPlanes<T>
+    {
+    public:
+        ComplexMatrix(): m_rows(0), m_cols(0) { }
+
+        ComplexMatrix(std::size_t rows_, std::size_t cols_): m_rows(rows_), m_cols(cols_)
+        {
+            this->allocate(m_rows * m_cols, true);
+        }
+
+        template <typename F, typename P = SequencedPolicy>
+        ComplexMatrix(std::size_t rows_, std::size_t cols_, const F& func, P policy = P()): 
+        m_rows(rows_), m_cols(cols_)
+        {
+            this->allocate(m_rows * m_cols, false);
+            policyFor(policy, m_rows, m_cols, [this, &func](std::size_t i, std::size_t j) { set(i, j, func(i, j)); });
+        }
+
+        //splits interleaved complex numbers
+        template <std::size_t M>
+        ComplexMatrix(const Matrix<Complex<T>, M>& o): m_rows(o.rows()), m_cols(o.cols())
+        {
+            this->allocate(m_rows * m_cols, false);
+            for (std::size_t i = 0; i < m_rows; ++i)
+                for (std::size_t j = 0; j < m_cols; ++j)
+                    set(i, j, o(i, j));
+        }
+
+        ComplexMatrix(const ComplexMatrix<T>& o): m_rows(o.m_rows), m_cols(o.m_cols)
+        {
+            stats_count(STATS_MATRIX, copies, 1);
+            this->allocate(m_rows * m_cols, false);
+            this->copy(o, m_rows * m_cols);
+        }
+
+        ComplexMatrix(ComplexMatrix<T>&& o): m_rows(o.m_rows), m_cols(o.m_cols)
+        {
+            stats_count(STATS_MATRIX, moves, 1);
+            this->take(o);
+            o.m_rows = o.m_cols = 0;
+        }
+
+        template <typename E>
+        ComplexMatrix(const SplitComplexExpression<E, T>& expr): m_rows(0), m_cols(0)
+        {
+            *this = expr;
+        }
+
+        ComplexMatrix<T>& operator=(const ComplexMatrix<T>& o)
+        {
+            stats_count(STATS_MATRIX, copies, 1);
+            if (this == &o)
+                return *this;
+            if (m_rows * m_cols != o.m_rows * o.m_cols)
+            {
+                this->release();
+                this->allocate(o.m_rows * o.m_cols, false);
+            }
+            m_rows = o.m_rows;
+            m_cols = o.m_cols;
+            this->copy(o, m_rows * m_cols);
+            return *this;
+        }
+
+        ComplexMatrix<T>& operator=(ComplexMatrix<T>&& o)
+        {
+            stats_count(STATS_MATRIX, moves, 1);
+            if (this == &o)
+                return *this;
+            this->release();
+            this->take(o);
+            m_rows = o.m_rows;
+            m_cols = o.m_cols;
+            o.m_rows = o.m_cols = 0;
+            return *this;
+        }
+
+        template <typename E>
+        ComplexMatrix<T>& operator=(const SplitComplexExpression<E, T>& expr)
+        {
+            stats_count(STATS_MATRIX, materializations, 1);
+            profile_kernel("split assign");
+            std::size_t rows_ = expr.rows(), cols_ = expr.cols();
+            this->assign(expr, rows_ * cols_, rows_ * cols_ == m_rows * m_cols);
+            m_rows = rows_;
+            m_cols = cols_;
+            return *this;
+        }
+
+        ~ComplexMatrix() { this->release(); }
+
+        std::size_t rows() const { return m_rows; }
+        std::size_t cols() const { return m_cols; }
+
+        T re(std::size_t i) const { return this->re_data[i]; }
+        T im(std::size_t i) const { return this->im_data[i]; }
+        Complex<T> operator()(std::size_t i, std::size_t j) const 
+        { 
+            return Complex<T>(this->re_data[i * m_cols + j], this->im_data[i * m_cols + j]); 
+        }
+        void set(std::size_t i, std::size_t j, const Complex<T>& c)
+        {
+            this->re_data[i * m_cols + j] = c.r();
+            this->im_data[i * m_cols + j] = c.i();
+        }
+
+        //row major planes
+        const T* realData() const { return this->re_data; }
+        const T* imagData() const { return this->im_data; }
+        T* realData() { return this->re_data; }
+        T* imagData() { return this->im_data; }
+
+        //interleaves the planes back into complex numbers
+        Matrix<Complex<T>> toMatrix() const
+        {
+            Matrix<Complex<T>> ret(m_rows, m_cols);
+            for (std::size_t i = 0; i < m_rows; ++i)
+                for (std::size_t j = 0; j < m_cols; ++j)
+                    ret(i, j) = (*this)(i, j);
+            return ret;
+        }
+
+        void evaluate(std::size_t b, std::size_t n, T* cr, T* ci) const
+        {
+            copyElems(cr, this->re_data + b, n);
+            copyElems(ci, this->im_data + b, n);
+        }
+
+    private:
+        std::size_t m_rows;
+        std::size_t m_cols;
+    };
+
+    template <typename P1, typename P2>
+    void splitCheckShape(const P1& p1, const P2& p2)
+    {
+        if (p1.rows() != p2.rows() || p1.cols() != p2.cols())
+        {
+            std::cerr << "Trying to operate complex planes with different dimensions (" << p1.rows() << "x" << p1.cols() << ")" <<
+            " and (" << p2.rows() << "x" << p2.cols() << ")" << std::endl;
+            exit(-1);
+        }
+    }
+
+    //binary element wise node, K is the kernel applied to both operand blocks
+    template <typename P1, typename P2, typename T, void (*K)(const T*, const T*, const T*, const T*, T*, T*, std::size_t)>
+    class SplitBinary : public SplitComplexExpression<SplitBinary<P1, P2, T, K>, T>
+    {
+    public:
+        SplitBinary(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { splitCheckShape(p1, p2); }
+
+        T re(std::size_t i) const { T r, im_; element(i, r, im_); return r; }
+        T im(std::size_t i) const { T r, im_; element(i, r, im_); return im_; }
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+
+        void evaluate(std::size_t b, std::size_t n, T* cr, T* ci) const
+        {
+            T ar_s[SPLIT_BLOCK], ai_s[SPLIT_BLOCK], br_s[SPLIT_BLOCK], bi_s[SPLIT_BLOCK];
+            const T *ar, *ai, *br, *bi;
+            splitOperand(p1, b, n, ar_s, ai_s, ar, ai);
+            splitOperand(p2, b, n, br_s, bi_s, br, bi);
+            K(ar, ai, br, bi, cr, ci, n);
+        }
+
+    private:
+        void element(std::size_t i, T& r, T& im_) const
+        {
+            T ar = p1.re(i), ai = p1.im(i), br = p2.re(i), bi = p2.im(i);
+            K(&ar, &ai, &br, &bi, &r, &im_, 1);
+        }
+
+        const P1& p1;
+        const P2& p2;
+    };
+
+    //p1 times the complex scalar (sr, si)
+    template <typename P1, typename T>
+    class SplitScale : public SplitComplexExpression<SplitScale<P1, T>, T>
+    {
+    public:
+        SplitScale(const P1& p1_, T sr_, T si_): p1(p1_), sr(sr_), si(si_) { }
+
+        T re(std::size_t i) const { return p1.re(i) * sr - p1.im(i) * si; }
+        T im(std::size_t i) const { return p1.re(i) * si + p1.im(i) * sr; }
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+
+        void evaluate(std::size_t b, std::size_t n, T* cr, T* ci) const
+        {
+            T ar_s[SPLIT_BLOCK], ai_s[SPLIT_BLOCK];
+            const T *ar, *ai;
+            splitOperand(p1, b, n, ar_s, ai_s, ar, ai);
+            splitScale(ar, ai, sr, si, cr, ci, n);
+        }
+
+    private:
+        const P1& p1;
+        const T sr, si;
+    };
+
+    //conjugate (neg_real false) or minus (neg_real true)
+    template <typename P1, typename T>
+    class SplitSign : public SplitComplexExpression<SplitSign<P1, T>, T>
+    {
+    public:
+        SplitSign(const P1& p1_, bool neg_real_): p1(p1_), neg_real(neg_real_) { }
+
+        T re(std::size_t i) const { return neg_real? -p1.re(i): p1.re(i); }
+        T im(std::size_t i) const { return -p1.im(i); }
+        std::size_t rows() const { return p1.rows(); }
+        std::size_t cols() const { return p1.cols(); }
+
+        void evaluate(std::size_t b, std::size_t n, T* cr, T* ci) const
+        {
+            T ar_s[SPLIT_BLOCK], ai_s[SPLIT_BLOCK];
+            const T *ar, *ai;
+            splitOperand(p1, b, n, ar_s, ai_s, ar, ai);
+            splitSign(ar, ai, neg_real, cr, ci, n);
+        }
+
+    private:
+        const P1& p1;
+        const bool neg_real;
+    };
+
+    template <typename P1, typename P2, typename T>
+    SplitBinary<P1, P2, T, splitAdd<T>> operator+(const SplitComplexExpression<P1, T>& c1, const SplitComplexExpression<P2, T>& c2)
+    {
+        return SplitBinary<P1, P2, T, splitAdd<T>>(*static_cast<const P1*>(&c1), *static_cast<const P2*>(&c2));
+    }
+
+    template <typename P1, typename P2, typename T>
+    SplitBinary<P1, P2, T, splitSub<T>> operator-(const SplitComplexExpression<P1, T>& c1, const SplitComplexExpression<P2, T>& c2)
+    {
+        return SplitBinary<P1, P2, T, splitSub<T>>(*static_cast<const P1*>(&c1), *static_cast<const P2*>(&c2));
+    }
+
+    template <typename P1, typename P2, typename T>
+    SplitBinary<P1, P2, T, splitMul<T>> operator*(const SplitComplexExpression<P1, T>& c1, const SplitComplexExpression<P2, T>& c2)
+    {
+        return SplitBinary<P1, P2, T, splitMul<T>>(*static_cast<const P1*>(&c1), *static_cast<const P2*>(&c2));
+    }
+
+    template <typename P1, typename P2, typename T>
+    SplitBinary<P1, P2, T, splitDiv<T>> operator/(const SplitComplexExpression<P1, T>& c1, const SplitComplexExpression<P2, T>& c2)
+    {
+        return SplitBinary<P1, P2, T, splitDiv<T>>(*static_cast<const P1*>(&c1), *static_cast<const P2*>(&c2));
+    }
+
+    template <typename P1, typename T>
+    SplitScale<P1, T> operator*(const SplitComplexExpression<P1, T>& c1, const T& s)
+    {
+        return SplitScale<P1, T>(*static_cast<const P1*>(&c1), s, T());
+    }
+
+    template <typename P1, typename T>
+    SplitScale<P1, T> operator*(const T& s, const SplitComplexExpression<P1, T>& c1)
+    {
+        return SplitScale<P1, T>(*static_cast<const P1*>(&c1), s, T());
+    }
+
+    template <typename P1, typename T>
+    SplitScale<P1, T> operator/(const SplitComplexExpression<P1, T>& c1, const T& s)
+    {
+        return SplitScale<P1, T>(*static_cast<const P1*>(&c1), T(1) / s, T());
+    }
+
+    template <typename P1, typename E, typename T>
+    SplitScale<P1, T> operator*(const SplitComplexExpression<P1, T>& c1, const ComplexExpression<E, T>& s)
+    {
+        return SplitScale<P1, T>(*static_cast<const P1*>(&c1), s.r(), s.i());
+    }
+
+    template <typename P1, typename E, typename T>
+    SplitScale<P1, T> operator*(const ComplexExpression<E, T>& s, const SplitComplexExpression<P1, T>& c1)
+    {
+        return SplitScale<P1, T>(*static_cast<const P1*>(&c1), s.r(), s.i());
+    }
+
+    template <typename P1, typename T>
+    SplitSign<P1, T> operator!(const SplitComplexExpression<P1, T>& c1)
+    {
+        return SplitSign<P1, T>(*static_cast<const P1*>(&c1), false);
+    }
+
+    template <typename P1, typename T>
+    SplitSign<P1, T> operator-(const SplitComplexExpression<P1, T>& c1)
+    {
+        return SplitSign<P1, T>(*static_cast<const P1*>(&c1), true);
+    }
+
+    //magnitude of every element, in row major order for matrices
+    template <typename E, typename T>
+    Array<T> abs(const SplitComplexExpression<E, T>& expr)
+    {
+        profile_kernel("split abs");
+        const E& e = static_cast<const E&>(expr);
+        std::size_t n = e.size();
+        Array<T> ret(n);
+        T *out = &ret[0];
+        parallelFor(0, n, PARALLEL_GRAIN, [&e, out](std::size_t first, std::size_t last)
+        {
+            T ar_s[SPLIT_BLOCK], ai_s[SPLIT_BLOCK];
+            for (std::size_t b = first; b < last; b += SPLIT_BLOCK)
+            {
+                std::size_t m = last - b < SPLIT_BLOCK? last - b: SPLIT_BLOCK;
+                const T *ar, *ai;
+                splitOperand(e, b, m, ar_s, ai_s, ar, ai);
+                splitAbs(ar, ai, out + b, m);
+            }
+        });
+        return ret;
+    }
+
+    template<typename E, typename T>
+    std::ostream& operator<<(std::ostream& out, const SplitComplexExpression<E, T>& expr)
+    {
+        for (std::size_t i = 0; i < expr.rows(); ++i)
+        {
+            for (std::size_t j = 0; j < expr.cols(); ++j)
+            {
+                std::size_t k = i * expr.cols() + j;
+                out << Complex<T>(expr.re(k), expr.im(k));
+                if (j + 1 < expr.cols())
+                    out << SEPARATOR;
+            }
+            if (i + 1 < expr.rows())
+                out << (expr.cols() == 1? SEPARATOR: "\n");
+        }
+        return out;
+    }
+
+    enum ComplexGemmMethod
+    {
+        //three real products, (ar + ai)(br + bi) gives the imaginary part. About 25% less work, but
+        //the error of the imaginary part is relative to |a||b| instead of to each product
+        COMPLEX_GEMM_3M,
+        //the usual four real products
+        COMPLEX_GEMM_4M
+    };
+
+    //(cr, ci) = (ar, ai) * (br, bi) for split planes, a is n x p and b is p x m, row major. Every
+    //real product runs through gemmBlocked. c may not overlap a or b
+    template <typename T>
+    void complexGemmPlanes(const T* ar, const T* ai, const T* br, const T* bi, T* cr, T* ci, 
+                           std::size_t n, std::size_t m, std::size_t p, ComplexGemmMethod method = COMPLEX_GEMM_3M)
+    {
+        profile_kernel("complex gemm");
+        std::size_t nm = n * m;
+        if (nm == 0)
+            return;
+        std::memset(cr, 0, nm * sizeof(T));
+        std::memset(ci, 0, nm * sizeof(T));
+        Array<T> t(nm);
+        const T *tp = &t[0];
+        gemmBlocked(ar, br, cr, n, m, p);
+        gemmBlocked(ai, bi, &t[0], n, m, p);
+        if (method == COMPLEX_GEMM_4M)
+        {
+            gemmBlocked(ar, bi, ci, n, m, p);
+            gemmBlocked(ai, br, ci, n, m, p);
+            simdFor<T>(nm, [=](auto ops, std::size_t i)
+            {
+                typedef decltype(ops) O;
+                O::store(cr + i, O::sub(O::load(cr + i), O::load(tp + i)));
+            });
+            return;
+        }
+
+        auto sum = [](const T* x, const T* y, T* z, std::size_t len)
+        {
+            simdFor<T>(len, [=](auto ops, std::size_t i)
+            {
+                typedef decltype(ops) O;
+                O::store(z + i, O::add(O::load(x + i), O::load(y + i)));
+            });
+        };
+        Array<T> sa(n * p), sb(p * m);
+        sum(ar, ai, &sa[0], n * p);
+        sum(br, bi, &sb[0], p * m);
+        gemmBlocked(&sa[0], &sb[0], ci, n, m, p);
+        //ci = (ar + ai)(br + bi) - ar br - ai bi, cr = ar br - ai bi
+        simdFor<T>(nm, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg r = O::load(cr + i), s = O::load(tp + i);
+            O::store(ci + i, O::sub(O::sub(O::load(ci + i), r), s));
+            O::store(cr + i, O::sub(r, s));
+        });
+    }
+
+    template <typename T>
+    ComplexMatrix<T>& gemm(const ComplexMatrix<T>& a, const ComplexMatrix<T>& b, ComplexMatrix<T>& c, 
+                           ComplexGemmMethod method = COMPLEX_GEMM_3M)
+    {
+        if (a.cols() != b.rows())
+        {
+            std::cerr << "Cols of Matrix A(" << a.cols() <<  ") doesn't match rows of Matrix B(" << b.rows() << ")" << std::endl;
+            exit(-1);
+        }
+        matrix_assert(&c != &a && &c != &b);
+        if (c.rows() != a.rows() || c.cols() != b.cols())
+            c = ComplexMatrix<T>(a.rows(), b.cols());
+        if (a.rows() > 0 && b.cols() > 0)
+            complexGemmPlanes(a.realData(), a.imagData(), b.realData(), b.imagData(), c.realData(), c.imagData(), 
+                              a.rows(), b.cols(), a.cols(), method);
+        return c;
+    }
+
+    //interleaved complex matrices are split, multiplied with complexGemmPlanes and interleaved back.
+    //Also what c = a * b runs for Matrix<Complex<T>>
+    template <typename T, std::size_t NA, std::size_t NB, std::size_t NC>
+    Matrix<Complex<T>, NC>& gemm(const Matrix<Complex<T>, NA>& a, const Matrix<Complex<T>, NB>& b, Matrix<Complex<T>, NC>& c, 
+                                 ComplexGemmMethod method)
+    {
+        if (a.cols() != b.rows())
+        {
+            std::cerr << "Cols of Matrix A(" << a.cols() <<  ") doesn't match rows of Matrix B(" << b.rows() << ")" << std::endl;
+            exit(-1);
+        }
+        matrix_assert((const void*)&c != (const void*)&a && (const void*)&c != (const void*)&b);
+        std::size_t n = a.rows(), m = b.cols(), p = a.cols();
+        if (c.rows() != n || c.cols() != m)
+            c = Matrix<Complex<T>, NC>(n, m);
+        if (n == 0 || m == 0)
+            return c;
+        if (p == 0)
+        {
+            c.forEach([](std::size_t, std::size_t, Complex<T>) { return Complex<T>(); });
+            return c;
+        }
+
+        Array<T> planes(2 * (n * p + p * m + n * m));
+        T *ar = &planes[0], *ai = ar + n * p, *br = ai + n * p, *bi = br + p * m, *cr = bi + p * m, *ci = cr + n * m;
+        const Complex<T> *da = &a(0, 0), *db = &b(0, 0);
+        for (std::size_t i = 0; i < n * p; ++i)
+        {
+            ar[i] = da[i].r();
+            ai[i] = da[i].i();
+        }
+        for (std::size_t i = 0; i < p * m; ++i)
+        {
+            br[i] = db[i].r();
+            bi[i] = db[i].i();
+        }
+        complexGemmPlanes(ar, ai, br, bi, cr, ci, n, m, p, method);
+        Complex<T> *dc = &c(0, 0);
+        for (std::size_t i = 0; i < n * m; ++i)
+            dc[i] = Complex<T>(cr[i], ci[i]);
+        return c;
+    }
+
+    template <typename T, std::size_t NA, std::size_t NB, std::size_t NC>
+    Matrix<Complex<T>, NC>& gemm(const Matrix<Complex<T>, NA>& a, const Matrix<Complex<T>, NB>& b, Matrix<Complex<T>, NC>& c)
+    {
+        return gemm(a, b, c, COMPLEX_GEMM_3M);
+    }
+
+    enum SincosAccuracy
+    {
+        SINCOS_ACCURATE,
+        SINCOS_FAST
+    };
+
+    //reduction by multiples of pi / 2 (pi / 2 split in three parts, Cody-Waite) and minimax polynomials
+    //on [-pi / 4, pi / 4], fdlibm's for double and cephes' for float. Types without constants use std::sin/cos
+    template <typename T>
+    struct SincosConstants
+    {
+        static constexpr bool available = false;
+        static constexpr std::size_t sin_terms = 1, cos_terms = 1, sin_fast = 1, cos_fast = 1;
+        static constexpr T magic = T(), limit = T(), two_over_pi = T(), pio2_1 = T(), pio2_2 = T(), pio2_3 = T();
+        static const T* sinCoefs() { return nullptr; }
+        static const T* cosCoefs() { return nullptr; }
+    };
+
+    template <>
+    struct SincosConstants<double>
+    {
+        static constexpr bool available = true;
+        static constexpr std::size_t sin_terms = 6, cos_terms = 6, sin_fast = 4, cos_fast = 4;
+        //1.5 * 2^52, x + magic - magic rounds x to an integer
+        static constexpr double magic = 6755399441055744.0;
+        //q * pio2_1 is exact up to here, bigger angles go to std::sin/cos
+        static constexpr double limit = 1.0e5;
+        static constexpr double two_over_pi = 6.36619772367581382433e-01;
+        static constexpr double pio2_1 = 1.57079632673412561417e+00;
+        static constexpr double pio2_2 = 6.07710050630396597660e-11;
+        static constexpr double pio2_3 = 2.02226624879595063154e-21;
+        //the tables are indexed at run time, as function statics they need no definition outside the class before C++17
+        static const double* sinCoefs()
+        {
+            static constexpr double c[6] = {-1.66666666666666324348e-01, 8.33333333332248946124e-03, -1.98412698298579493134e-04,
+                                            2.75573137070700676789e-06, -2.50507602534068634195e-08, 1.58969099521155010221e-10};
+            return c;
+        }
+        static const double* cosCoefs()
+        {
+            static constexpr double c[6] = {4.16666666666666019037e-02, -1.38888888888741095749e-03, 2.48015872894767294178e-05,
+                                            -2.75573143513906633035e-07, 2.08757232129817482790e-09, -1.13596475577881948265e-11};
+            return c;
+        }
+    };
+
+    template <>
+    struct SincosConstants<float>
+    {
+        static constexpr bool available = true;
+        static constexpr std::size_t sin_terms = 3, cos_terms = 3, sin_fast = 2, cos_fast = 2;
+        //1.5 * 2^23
+        static constexpr float magic = 12582912.0f;
+        static constexpr float limit = 8192.0f;
+        static constexpr float two_over_pi = 0.636619772367581382433f;
+        static constexpr float pio2_1 = 1.5703125f;
+        static constexpr float pio2_2 = 4.837512969970703125e-4f;
+        static constexpr float pio2_3 = 7.54978995489188216e-8f;
+        static const float* sinCoefs()
+        {
+            static constexpr float c[3] = {-1.6666654611e-1f, 8.3321608736e-3f, -1.9515295891e-4f};
+            return c;
+        }
+        static const float* cosCoefs()
+        {
+            static constexpr float c[3] = {4.166664568298827e-2f, -1.388731625493765e-3f, 2.443315711809948e-5f};
+            return c;
+        }
+    };
+
+    //s[i] = sin(theta[i]), c[i] = cos(theta[i]), with the first S and C polynomial terms
+    template <typename T, std::size_t S, std::size_t C>
+    void sinCosBlock(const T* theta, T* s, T* c, std::size_t n)
+    {
+        typedef SincosConstants<T> K;
+        simdFor<T>(n, [=](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typedef typename O::reg R;
+            const R magic = O::set(K::magic), one = O::set(T(1)), two = O::set(T(2));
+            R x = O::load(theta + i);
+            //x = q pi / 2 + r, |r| <= pi / 4
+            R q = O::sub(O::add(O::mul(x, O::set(K::two_over_pi)), magic), magic);
+            R r = O::sub(O::sub(O::sub(x, O::mul(q, O::set(K::pio2_1))), O::mul(q, O::set(K::pio2_2))), O::mul(q, O::set(K::pio2_3)));
+            R z = O::mul(r, r);
+            const T *sc = K::sinCoefs(), *cc = K::cosCoefs();
+            R ps = O::set(sc[S - 1]), pc = O::set(cc[C - 1]);
+            for (std::size_t j = S - 1; j-- > 0;)
+                ps = O::add(O::mul(ps, z), O::set(sc[j]));
+            for (std::size_t j = C - 1; j-- > 0;)
+                pc = O::add(O::mul(pc, z), O::set(cc[j]));
+            R sr = O::add(r, O::mul(O::mul(r, z), ps));
+            R cr = O::add(O::sub(one, O::mul(O::set(T(0.5)), z)), O::mul(O::mul(z, z), pc));
+            //quadrant k = q mod 4 and its bits as 0 or 1, so the swaps and signs are products, no branches
+            R k = O::sub(q, O::mul(O::set(T(4)), O::sub(O::add(O::sub(O::mul(q, O::set(T(0.25))), O::set(T(0.375))), magic), magic)));
+            R hi = O::sub(O::add(O::sub(O::mul(k, O::set(T(0.5))), O::set(T(0.25))), magic), magic);
+            R odd = O::sub(k, O::mul(two, hi));
+            R even = O::sub(one, odd);
+            //cos changes sign in quadrants 1 and 2, hi xor odd
+            R hi_c = O::sub(O::add(hi, odd), O::mul(two, O::mul(hi, odd)));
+            O::store(s + i, O::mul(O::add(O::mul(even, sr), O::mul(odd, cr)), O::sub(one, O::mul(two, hi))));
+            O::store(c + i, O::mul(O::add(O::mul(even, cr), O::mul(odd, sr)), O::sub(one, O::mul(two, hi_c))));
+        });
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            if (!(std::abs(theta[i]) <= K::limit))
+            {
+                s[i] = std::sin(theta[i]);
+                c[i] = std::cos(theta[i]);
+            }
+        }
+    }
+
+    //sine and cosine of n angles at once, SINCOS_FAST keeps only the first polynomial terms (about 2e-9
+    //absolute error for double, 4e-5 for float). s, c and theta may not overlap
+    template <typename T>
+    void sinCos(const T* theta, T* s, T* c, std::size_t n, SincosAccuracy accuracy = SINCOS_ACCURATE)
+    {
+        typedef SincosConstants<T> K;
+        profile_kernel("sincos");
+        parallelFor(0, n, PARALLEL_GRAIN, [=](std::size_t first, std::size_t last)
+        {
+            if (!K::available)
+            {
+                for (std::size_t i = first; i < last; ++i)
+                {
+                    s[i] = std::sin(theta[i]);
+                    c[i] = std::cos(theta[i]);
+                }
+            }
+            else if (accuracy == SINCOS_FAST)
+                sinCosBlock<T, K::sin_fast, K::cos_fast>(theta + first, s + first, c + first, last - first);
+            else
+                sinCosBlock<T, K::sin_terms, K::cos_terms>(theta + first, s + first, c + first, last - first);
+        });
+    }
+
+    //e^{i theta} for every angle, computed once per element
+    template <typename T, std::size_t N>
+    ComplexArray<T> complexExp(const Array<T, N>& theta, SincosAccuracy accuracy = SINCOS_ACCURATE)
+    {
+        ComplexArray<T> ret(theta.len());
+        if (theta.len() > 0)
+            sinCos(&theta[0], ret.imagData(), ret.realData(), theta.len(), accuracy);
+        return ret;
+    }
+}
+
+
+//VEC ARRAY
+//collections of stuff::Vec stored as N columns, one per component, instead of an array of Vecs.
+//column(k) of an expression is a small value with the pointers and scalars of component k, its
+//lanes<O>(i) gives elements [i, i + O::width). An assignment is one fused simdFor loop per column
+//without temporaries. Element wise only, so a = a * b works in place
+namespace stuff
+{
+    //operations of the nodes on registers, the I versions take the scalar on the left
+    struct ColumnAdd { template <typename O> static typename O::reg apply(typename O::reg a, typename O::reg b) { return O::add(a, b); } };
+    struct ColumnSub { template <typename O> static typename O::reg apply(typename O::reg a, typename O::reg b) { return O::sub(a, b); } };
+    struct ColumnMul { template <typename O> static typename O::reg apply(typename O::reg a, typename O::reg b) { return O::mul(a, b); } };
+    struct ColumnDiv { template <typename O> static typename O::reg apply(typename O::reg a, typename O::reg b) { return O::div(a, b); } };
+    struct ColumnSubI { template <typename O> static typename O::reg apply(typename O::reg a, typename O::reg b) { return O::sub(b, a); } };
+    struct ColumnDivI { template <typename O> static typename O::reg apply(typename O::reg a, typename O::reg b) { return O::div(b, a); } };
+    struct ColumnNeg { template <typename O> static typename O::reg apply(typename O::reg a, typename O::reg) { return O::neg(a); } };
+
+    template <typename E, std::size_t N, typename T>
+    class VecArrayExpression
+    {
+    public:
+        Vec<N, T> operator[](std::size_t i) const { return static_cast<const E&>(*this)[i]; }
+        std::size_t len() const { return static_cast<const E&>(*this).len(); }
+        auto column(std::size_t k) const { return static_cast<const E&>(*this).column(k); }
+    };
+
+    template <typename T>
+    struct VecArrayColumn
+    {
+        const T *p;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return O::load(p + i); }
+    };
+
+    template <typename C1, typename C2, typename Op>
+    struct VecArrayBinaryColumn
+    {
+        C1 c1;
+        C2 c2;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return Op::template apply<O>(c1.template lanes<O>(i), c2.template lanes<O>(i)); }
+    };
+
+    template <typename C1, typename T, typename Op>
+    struct VecArrayScalarColumn
+    {
+        C1 c1;
+        T s;
+        template <typename O>
+        typename O::reg lanes(std::size_t i) const { return Op::template apply<O>(c1.template lanes<O>(i), O::set(s)); }
+    };
+
+    template <typename T>
+    struct VecArrayConstantColumn
+    {
+        T s;
+        template <typename O>
+        typename O::reg lanes(std::size_t) const { return O::set(s); }
+    };
+
+    //element i of any vec array expression, one lane at a time
+    template <std::size_t N, typename T, typename E>
+    Vec<N, T> vecArrayElement(const E& e, std::size_t i)
+    {
+        Vec<N, T> ret;
+        for (std::size_t k = 0; k < N; ++k)
+            ret[k] = e.column(k).template lanes<ScalarOps<T>>(i);
+        return ret;
+    }
+
+    //element i of a VecArray, reads and writes go to the columns. Stays valid until the array grows
+    template <std::size_t N, typename T>
+    class VecArrayRef : public VecExpression<VecArrayRef<N, T>, T>
+    {
+    public:
+        VecArrayRef(T* const* cols_, std::size_t i_): cols(cols_), i(i_) { }
+
+        VecArrayRef<N, T>& operator=(const VecArrayRef<N, T>& o)
+        {
+            return *this = static_cast<const VecExpression<VecArrayRef<N, T>, T>&>(o);
+        }
+
+        //evaluated first, so the right side can read this element
+        template <typename K>
+        VecArrayRef<N, T>& operator=(const VecExpression<K, T>& expr)
+        {
+            vec_assert(N == expr.dim());
+            T tmp[N];
+            for (std::size_t k = 0; k < N; ++k)
+                tmp[k] = expr[k];
+            for (std::size_t k = 0; k < N; ++k)
+                cols[k][i] = tmp[k];
+            return *this;
+        }
+
+        const T& operator[] (std::size_t k) const { return cols[k][i]; }
+        const T& operator() (std::size_t k) const { return cols[k][i]; }
+        T& operator[] (std::size_t k) { return cols[k][i]; }
+        T& operator() (std::size_t k) { return cols[k][i]; }
+        std::size_t dim() const { return N; }
+
+    private:
+        T* const* cols;
+        std::size_t i;
+    };
+
+    template <std::size_t N, typename T>
+    class VecArray : public VecArrayExpression<VecArray<N, T>, N, T>
+    {
+    public:
+        VecArray(): sz_cached(0), elems(0) { clear(); }
+
+        VecArray(std::size_t n): sz_cached(n), elems(n) { allocate(n, true); }
+
+        template <typename F, typename P = SequencedPolicy>
+        VecArray(std::size_t n, const F& func, P policy = P()): sz_cached(n), elems(n)
+        {
+            allocate(n, false);
+            policyFor(policy, 0, n, PARALLEL_GRAIN, [this, &func](std::size_t i) { (*this)[i] = func(i); });
+        }
+
+        //splits an array of Vecs into columns
+        template <std::size_t M>
+        VecArray(const Array<Vec<N, T>, M>& o): sz_cached(o.len()), elems(o.len())
+        {
+            allocate(elems, false);
+            for (std::size_t i = 0; i < elems; ++i)
+                (*this)[i] = o[i];
+        }
+
+        VecArray(const VecArray<N, T>& o): sz_cached(o.elems), elems(o.elems)
+        {
+            stats_count(STATS_ARRAY, copies, 1);
+            allocate(elems, false);
+            for (std::size_t k = 0; k < N; ++k)
+                copyElems(cols[k], o.cols[k], elems);
+        }
+
+        VecArray(VecArray<N, T>&& o): sz_cached(o.sz_cached), elems(o.elems)
+        {
+            stats_count(STATS_ARRAY, moves, 1);
+            take(o);
+        }
+
+        template <typename E>
+        VecArray(const VecArrayExpression<E, N, T>& expr): sz_cached(0), elems(0)
+        {
+            clear();
+            *this = expr;
+        }
+
+        VecArray<N, T>& operator=(const VecArray<N, T>& o)
+        {
+            stats_count(STATS_ARRAY, copies, 1);
+            if (this == &o)
+                return *this;
+            if (sz_cached < o.elems)
+            {
+                release();
+                allocate(o.elems, false);
+                sz_cached = o.elems;
+            }
+            elems = o.elems;
+            for (std::size_t k = 0; k < N; ++k)
+                copyElems(cols[k], o.cols[k], elems);
+            return *this;
+        }
+
+        VecArray<N, T>& operator=(VecArray<N, T>&& o)
+        {
+            stats_count(STATS_ARRAY, moves, 1);
+            if (this == &o)
+                return *this;
+            release();
+            sz_cached = o.sz_cached;
+            elems = o.elems;
+            take(o);
+            return *this;
+        }
+
+        //into new columns when the length changes, so the expression can read the old ones
+        template <typename E>
+        VecArray<N, T>& operator=(const VecArrayExpression<E, N, T>& expr)
+        {
+            stats_count(STATS_ARRAY, materializations, 1);
+            profile_kernel("vec array assign");
+            const E& e = static_cast<const E&>(expr);
+            std::size_t n = e.len();
+            T *old[N];
+            for (std::size_t k = 0; k < N; ++k)
+                old[k] = nullptr;
+            if (n != elems)
+            {
+                for (std::size_t k = 0; k < N; ++k)
+                    old[k] = cols[k];
+                allocate(n, false);
+                sz_cached = n;
+            }
+            //a column at a time, loops only stream through the columns of one component
+            for (std::size_t k = 0; k < N; ++k)
+            {
+                auto col = e.column(k);
+                T *out = cols[k];
+                parallelFor(0, n, PARALLEL_GRAIN, [col, out](std::size_t first, std::size_t last)
+                {
+                    simdFor<T>(last - first, [col, out, first](auto ops, std::size_t i)
+                    {
+                        typedef decltype(ops) O;
+                        O::store(out + first + i, col.template lanes<O>(first + i));
+                    });
+                });
+            }
+            for (std::size_t k = 0; k < N; ++k)
+                memFree(old[k]);
+            elems = n;
+            return *this;
+        }
+
+        ~VecArray() { release(); }
+
+        std::size_t len() const { return elems; }
+
+        Vec<N, T> operator[](std::size_t i) const { return vecArrayElement<N, T>(*this, i); }
+        VecArrayRef<N, T> operator[](std::size_t i) { return VecArrayRef<N, T>(cols, i); }
+
+        VecArrayColumn<T> column(std::size_t k) const { return VecArrayColumn<T>{cols[k]}; }
+
+        //component k of every element
+        const T* columnData(std::size_t k) const { return cols[k]; }
+        T* columnData(std::size_t k) { return cols[k]; }
+
+        VecArray<N, T>& insert(const Vec<N, T>& v)
+        {
+            if (elems == sz_cached)
+            {
+                //same growth as Array
+                std::size_t cap = (std::size_t)(sz_cached * ARRAY_GROWTH_FACTOR);
+                reserve(cap < sz_cached + ARRAY_NEW_SIZE_FACTOR? sz_cached + ARRAY_NEW_SIZE_FACTOR: cap);
+            }
+            (*this)[elems++] = v;
+            return *this;
+        }
+
+        VecArray<N, T>& reserve(std::size_t n)
+        {
+            if (n > sz_cached)
+            {
+                for (std::size_t k = 0; k < N; ++k)
+                {
+                    cols[k] = (T*)memRealloc((void*)cols[k], n * sizeof(T));
+                    array_assert(cols[k] != NULL);
+                }
+                sz_cached = n;
+            }
+            return *this;
+        }
+
+        std::size_t capacity() const { return sz_cached; }
+
+        //interleaves the columns back into Vecs
+        Array<Vec<N, T>> toArray() const
+        {
+            Array<Vec<N, T>> ret(elems);
+            for (std::size_t i = 0; i < elems; ++i)
+                ret[i] = (*this)[i];
+            return ret;
+        }
+
+    private:
+        void clear()
+        {
+            for (std::size_t k = 0; k < N; ++k)
+                cols[k] = nullptr;
+        }
+
+        void allocate(std::size_t n, bool zero)
+        {
+            for (std::size_t k = 0; k < N; ++k)
+            {
+                cols[k] = zero? (T*)memCalloc(n, sizeof(T)): allocElems<T>(n);
+                array_assert(cols[k] != NULL || n == 0);
+            }
+        }
+
+        void release()
+        {
+            for (std::size_t k = 0; k < N; ++k)
+                memFree(cols[k]);
+            clear();
+        }
+
+        void take(VecArray<N, T>& o)
+        {
+            for (std::size_t k = 0; k < N; ++k)
+                cols[k] = o.cols[k];
+            o.clear();
+            o.sz_cached = o.elems = 0;
+        }
+
+        T *cols[N];
+        std::size_t sz_cached;
+        std::size_t elems;
+    };
+
+    template <typename P1, typename P2>
+    void vecArrayCheckLen(const P1& p1, const P2& p2)
+    {
+        if (p1.len() != p2.len())
+        {
+            std::cerr << "Trying to operate vec arrays with different lengths: " << p1.len() << " x " << p2.len() << std::endl;
+            exit(-1);
+        }
+    }
+
+    //element wise node, Op is applied to every pair of columns
+    template <typename P1, typename P2, std::size_t N, typename T, typename Op>
+    class VecArrayBinary : public VecArrayExpression<VecArrayBinary<P1, P2, N, T, Op>, N, T>
+    {
+    public:
+        VecArrayBinary(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { vecArrayCheckLen(p1, p2); }
+
+        Vec<N, T> operator[](std::size_t i) const { return vecArrayElement<N, T>(*this, i); }
+        std::size_t len() const { return p1.len(); }
+
+        auto column(std::size_t k) const
+        {
+            return VecArrayBinaryColumn<decltype(p1.column(k)), decltype(p2.column(k)), Op>{p1.column(k), p2.column(k)};
+        }
+
+    private:
+        const P1& p1;
+        const P2& p2;
+    };
+
+    //Op applied to every column with a scalar per column: the same one for scalars, the components
+    //of a Vec for element wise operations against a single Vec
+    template <typename P1, std::size_t N, typename T, typename Op>
+    class VecArrayScalar : public VecArrayExpression<VecArrayScalar<P1, N, T, Op>, N, T>
+    {
+    public:
+        VecArrayScalar(const P1& p1_, const Vec<N, T>& s_): p1(p1_), s(s_) { }
+
+        Vec<N, T> operator[](std::size_t i) const { return vecArrayElement<N, T>(*this, i); }
+        std::size_t len() const { return p1.len(); }
+
+        auto column(std::size_t k) const
+        {
+            return VecArrayScalarColumn<decltype(p1.column(k)), T, Op>{p1.column(k), s[k]};
+        }
+
+    private:
+        const P1& p1;
+        const Vec<N, T> s;
+    };
+
+    //the same Vec n times
+    template <std::size_t N, typename T>
+    class VecArrayConstant : public VecArrayExpression<VecArrayConstant<N, T>, N, T>
+    {
+    public:
+        VecArrayConstant(const Vec<N, T>& s_, std::size_t n_): s(s_), n(n_) { }
+
+        Vec<N, T> operator[](std::size_t) const { return s; }
+        std::size_t len() const { return n; }
+
+        VecArrayConstantColumn<T> column(std::size_t k) const { return VecArrayConstantColumn<T>{s[k]}; }
+
+    private:
+        const Vec<N, T> s;
+        const std::size_t n;
+    };
+
+    template <std::size_t N, typename T>
+    Vec<N, T> vecArrayFill(const T& s)
+    {
+        Vec<N, T> ret;
+        for (std::size_t k = 0; k < N; ++k)
+            ret[k] = s;
+        return ret;
+    }
+
+    template <std::size_t N, typename E, typename T>
+    Vec<N, T> vecArrayBroadcast(const VecExpression<E, T>& v)
+    {
+        if (v.dim() != N)
+        {
+            std::cerr << "Trying to operate a vec array of dimension " << N << " with a vec of dimension " << v.dim() << std::endl;
+            exit(-1);
+        }
+        return Vec<N, T>(v);
+    }
+
+    template <typename P1, typename P2, std::size_t N, typename T>
+    VecArrayBinary<P1, P2, N, T, ColumnAdd> operator+(const VecArrayExpression<P1, N, T>& v1, const VecArrayExpression<P2, N, T>& v2)
+    {
+        return VecArrayBinary<P1, P2, N, T, ColumnAdd>(*static_cast<const P1*>(&v1), *static_cast<const P2*>(&v2));
+    }
+
+    template <typename P1, typename P2, std::size_t N, typename T>
+    VecArrayBinary<P1, P2, N, T, ColumnSub> operator-(const VecArrayExpression<P1, N, T>& v1, const VecArrayExpression<P2, N, T>& v2)
+    {
+        return VecArrayBinary<P1, P2, N, T, ColumnSub>(*static_cast<const P1*>(&v1), *static_cast<const P2*>(&v2));
+    }
+
+    template <typename P1, typename P2, std::size_t N, typename T>
+    VecArrayBinary<P1, P2, N, T, ColumnMul> operator*(const VecArrayExpression<P1, N, T>& v1, const VecArrayExpression<P2, N, T>& v2)
+    {
+        return VecArrayBinary<P1, P2, N, T, ColumnMul>(*static_cast<const P1*>(&v1), *static_cast<const P2*>(&v2));
+    }
+
+    template <typename P1, typename P2, std::size_t N, typename T>
+    VecArrayBinary<P1, P2, N, T, ColumnDiv> operator/(const VecArrayExpression<P1, N, T>& v1, const VecArrayExpression<P2, N, T>& v2)
+    {
+        return VecArrayBinary<P1, P2, N, T, ColumnDiv>(*static_cast<const P1*>(&v1), *static_cast<const P2*>(&v2));
+    }
+
+    template <typename P1, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnMul> operator*(const VecArrayExpression<P1, N, T>& v1, const T& s)
+    {
+        return VecArrayScalar<P1, N, T, ColumnMul>(*static_cast<const P1*>(&v1), vecArrayFill<N>(s));
+    }
+
+    template <typename P1, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnMul> operator*(const T& s, const VecArrayExpression<P1, N, T>& v1)
+    {
+        return VecArrayScalar<P1, N, T, ColumnMul>(*static_cast<const P1*>(&v1), vecArrayFill<N>(s));
+    }
+
+    template <typename P1, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnDiv> operator/(const VecArrayExpression<P1, N, T>& v1, const T& s)
+    {
+        return VecArrayScalar<P1, N, T, ColumnDiv>(*static_cast<const P1*>(&v1), vecArrayFill<N>(s));
+    }
+
+    template <typename P1, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnDivI> operator/(const T& s, const VecArrayExpression<P1, N, T>& v1)
+    {
+        return VecArrayScalar<P1, N, T, ColumnDivI>(*static_cast<const P1*>(&v1), vecArrayFill<N>(s));
+    }
+
+    template <typename P1, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnNeg> operator-(const VecArrayExpression<P1, N, T>& v1)
+    {
+        return VecArrayScalar<P1, N, T, ColumnNeg>(*static_cast<const P1*>(&v1), Vec<N, T>());
+    }
+
+    //every element against the same Vec
+    template <typename P1, typename E, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnAdd> operator+(const VecArrayExpression<P1, N, T>& v1, const VecExpression<E, T>& v)
+    {
+        return VecArrayScalar<P1, N, T, ColumnAdd>(*static_cast<const P1*>(&v1), vecArrayBroadcast<N>(v));
+    }
+
+    template <typename P1, typename E, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnAdd> operator+(const VecExpression<E, T>& v, const VecArrayExpression<P1, N, T>& v1)
+    {
+        return VecArrayScalar<P1, N, T, ColumnAdd>(*static_cast<const P1*>(&v1), vecArrayBroadcast<N>(v));
+    }
+
+    template <typename P1, typename E, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnSub> operator-(const VecArrayExpression<P1, N, T>& v1, const VecExpression<E, T>& v)
+    {
+        return VecArrayScalar<P1, N, T, ColumnSub>(*static_cast<const P1*>(&v1), vecArrayBroadcast<N>(v));
+    }
+
+    template <typename P1, typename E, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnSubI> operator-(const VecExpression<E, T>& v, const VecArrayExpression<P1, N, T>& v1)
+    {
+        return VecArrayScalar<P1, N, T, ColumnSubI>(*static_cast<const P1*>(&v1), vecArrayBroadcast<N>(v));
+    }
+
+    template <typename P1, typename E, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnMul> operator*(const VecArrayExpression<P1, N, T>& v1, const VecExpression<E, T>& v)
+    {
+        return VecArrayScalar<P1, N, T, ColumnMul>(*static_cast<const P1*>(&v1), vecArrayBroadcast<N>(v));
+    }
+
+    template <typename P1, typename E, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnMul> operator*(const VecExpression<E, T>& v, const VecArrayExpression<P1, N, T>& v1)
+    {
+        return VecArrayScalar<P1, N, T, ColumnMul>(*static_cast<const P1*>(&v1), vecArrayBroadcast<N>(v));
+    }
+
+    template <typename P1, typename E, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnDiv> operator/(const VecArrayExpression<P1, N, T>& v1, const VecExpression<E, T>& v)
+    {
+        return VecArrayScalar<P1, N, T, ColumnDiv>(*static_cast<const P1*>(&v1), vecArrayBroadcast<N>(v));
+    }
+
+    template <typename P1, typename E, std::size_t N, typename T>
+    VecArrayScalar<P1, N, T, ColumnDivI> operator/(const VecExpression<E, T>& v, const VecArrayExpression<P1, N, T>& v1)
+    {
+        return VecArrayScalar<P1, N, T, ColumnDivI>(*static_cast<const P1*>(&v1), vecArrayBroadcast<N>(v));
+    }
+
+    //dot product of every element, out[i] = v1[i] ^ v2[i]
+    template <typename P1, typename P2, std::size_t N, typename T>
+    Array<T> operator^(const VecArrayExpression<P1, N, T>& v1, const VecArrayExpression<P2, N, T>& v2)
+    {
+        profile_kernel("vec array dot");
+        const P1 *e1 = static_cast<const P1*>(&v1);
+        const P2 *e2 = static_cast<const P2*>(&v2);
+        vecArrayCheckLen(*e1, *e2);
+        std::size_t n = e1->len();
+        Array<T> ret(n);
+        T *out = n == 0? nullptr: &ret[0];
+        parallelFor(0, n, PARALLEL_GRAIN, [e1, e2, out](std::size_t first, std::size_t last)
+        {
+            //a column at a time, out accumulates the products of every component
+            for (std::size_t k = 0; k < N; ++k)
+            {
+                auto c1 = e1->column(k);
+                auto c2 = e2->column(k);
+                simdFor<T>(last - first, [c1, c2, out, first, k](auto ops, std::size_t i)
+                {
+                    typedef decltype(ops) O;
+                    std::size_t j = first + i;
+                    typename O::reg prod = O::mul(c1.template lanes<O>(j), c2.template lanes<O>(j));
+                    O::store(out + j, k == 0? prod: O::add(O::load(out + j), prod));
+                });
+            }
+        });
+        return ret;
+    }
+
+    //dot product of every element with the same Vec
+    template <typename P1, typename E, std::size_t N, typename T>
+    Array<T> operator^(const VecArrayExpression<P1, N, T>& v1, const VecExpression<E, T>& v)
+    {
+        return v1 ^ VecArrayConstant<N, T>(vecArrayBroadcast<N>(v), v1.len());
+    }
+
+    template <typename P1, typename E, std::size_t N, typename T>
+    Array<T> operator^(const VecExpression<E, T>& v, const VecArrayExpression<P1, N, T>& v1)
+    {
+        return v1 ^ v;
+    }
+
+    //one element per line
+    template <typename E, std::size_t N, typename T>
+    std::ostream& operator<<(std::ostream& out, const VecArrayExpression<E, N, T>& expr)
+    {
+        for (std::size_t i = 0; i < expr.len(); ++i)
+        {
+            out << expr[i];
+            if (i + 1 < expr.len())
+                out << "\n";
+        }
+        return out;
+    }
+
+    using Vec3dArray = VecArray<3, double>;
+    using Vec3fArray = VecArray<3, float>;
+}
+
+//TRANSFORMS
+//N x N and (N + 1) x (N + 1) matrices (3x3/4x4 for Vec3) applied to whole sets of Vec<N, T> points.
+//An N x N matrix is linear, a (N + 1) x (N + 1) one works on homogeneous points (p, 1): its last
+//column is the translation and, with TRANSFORM_PROJECT, its last row gives the w each point is
+//divided by. TRANSFORM_NORMALIZE scales the results to unit length. Both steps run in the same pass.
+//Arrays of Vecs are transformed point by point (a register at a time for packed Vecs), VecArrays
+//across points, SimdOps<T>::width points per instruction. Points are split over the thread pool
+namespace stuff
+{
+    enum TransformStep
+    {
+        TRANSFORM_AFFINE = 0,
+        //divide by w = (last row) . (p, 1), (N + 1) x (N + 1) matrices only
+        TRANSFORM_PROJECT = 1,
+        //unit length results, for normals and directions
+        TRANSFORM_NORMALIZE = 2
+    };
+
+    //the matrix by columns, a point goes to cols[N] + sum cols[j] * p[j]
+    template <std::size_t N, typename T>
+    struct PointTransform
+    {
+        template <typename E>
+        PointTransform(const MatrixExpression<E, T>& m, int steps_): steps(steps_)
+        {
+            bool homogeneous = m.rows() == N + 1 && m.cols() == N + 1;
+            if (!homogeneous && (m.rows() != N || m.cols() != N))
+            {
+                std::cerr << "Transforming " << N << "D points with a " << m.rows() << " x " << m.cols() << " matrix" << std::endl;
+                exit(-1);
+            }
+            if ((steps & TRANSFORM_PROJECT) && !homogeneous)
+            {
+                std::cerr << "Projecting " << N << "D points needs a " << N + 1 << " x " << N + 1 << " matrix" << std::endl;
+                exit(-1);
+            }
+            for (std::size_t j = 0; j <= N; ++j)
+            {
+                for (std::size_t i = 0; i < N; ++i)
+                    cols[j][i] = j < N || homogeneous? m(i, j): T();
+                w[j] = homogeneous? m(N, j): T(j == N);
+            }
+        }
+
+        Vec<N, T> apply(const Vec<N, T>& p) const
+        {
+            Vec<N, T> ret;
+            apply(p, ret, std::integral_constant<bool, Vec<N, T>::packed>());
+            return ret;
+        }
+
+        void apply(const Vec<N, T>& p, Vec<N, T>& ret, std::false_type) const
+        {
+            T x[N];
+            for (std::size_t i = 0; i < N; ++i)
+                x[i] = cols[N][i];
+            for (std::size_t j = 0; j < N; ++j)
+                for (std::size_t i = 0; i < N; ++i)
+                    x[i] += cols[j][i] * p[j];
+            //same order as the packed version, the projected point is the one normalized
+            if (steps & TRANSFORM_PROJECT)
+            {
+                T wp = w[N];
+                for (std::size_t j = 0; j < N; ++j)
+                    wp += w[j] * p[j];
+                T scale = T(1) / wp;
+                for (std::size_t i = 0; i < N; ++i)
+                    x[i] = x[i] * scale;
+            }
+            if (steps & TRANSFORM_NORMALIZE)
+            {
+                T n2 = T();
+                for (std::size_t i = 0; i < N; ++i)
+                    n2 += x[i] * x[i];
+                T scale = T(1) / std::sqrt(n2);
+                for (std::size_t i = 0; i < N; ++i)
+                    x[i] = x[i] * scale;
+            }
+            for (std::size_t i = 0; i < N; ++i)
+                ret[i] = x[i];
+        }
+
+        //columns are packed Vecs, so the point is a few registers and the padding stays zero
+        void apply(const Vec<N, T>& p, Vec<N, T>& ret, std::true_type) const
+        {
+            typedef SimdOps<T> O;
+            const std::size_t regs = VecLanes<N, T>::padded / O::width;
+            typename O::reg x[regs];
+            for (std::size_t r = 0; r < regs; ++r)
+                x[r] = cols[N].template lanes<O>(r * O::width);
+            for (std::size_t j = 0; j < N; ++j)
+            {
+                typename O::reg pj = O::set(p[j]);
+                for (std::size_t r = 0; r < regs; ++r)
+                    x[r] = O::add(x[r], O::mul(cols[j].template lanes<O>(r * O::width), pj));
+            }
+            if (steps & TRANSFORM_PROJECT)
+            {
+                T wp = w[N];
+                for (std::size_t j = 0; j < N; ++j)
+                    wp += w[j] * p[j];
+                typename O::reg scale = O::set(T(1) / wp);
+                for (std::size_t r = 0; r < regs; ++r)
+                    x[r] = O::mul(x[r], scale);
+            }
+            if (steps & TRANSFORM_NORMALIZE)
+            {
+                typename O::reg n2 = O::mul(x[0], x[0]);
+                for (std::size_t r = 1; r < regs; ++r)
+                    n2 = O::add(n2, O::mul(x[r], x[r]));
+                typename O::reg scale = O::set(T(1) / std::sqrt(O::hsum(n2)));
+                for (std::size_t r = 0; r < regs; ++r)
+                    x[r] = O::mul(x[r], scale);
+            }
+            //a zero w or length leaves NaNs in the padding
+            x[regs - 1] = O::keep(x[regs - 1], N - (regs - 1) * O::width);
+            for (std::size_t r = 0; r < regs; ++r)
+                O::store(&ret[0] + r * O::width, x[r]);
+        }
+
+        Vec<N, T> cols[N + 1];
+        T w[N + 1];
+        int steps;
+    };
+
+    //dst may be src. The transform is copied into every piece, so writing the points can't alias it
+    template <std::size_t N, typename T>
+    void transformPoints(const PointTransform<N, T>& t, const Vec<N, T>* src, Vec<N, T>* dst, std::size_t n)
+    {
+        profile_kernel("transform");
+        parallelFor(0, n, PARALLEL_GRAIN, [&t, src, dst](std::size_t b, std::size_t e)
+        {
+            PointTransform<N, T> local = t;
+            for (std::size_t i = b; i < e; ++i)
+                dst[i] = local.apply(src[i]);
+        });
+    }
+
+    //columns src[j] to columns dst[j], SimdOps<T>::width points at a time. dst may be src
+    template <std::size_t N, typename T>
+    void transformColumns(const PointTransform<N, T>& t, const T* const* src, T* const* dst, std::size_t n)
+    {
+        profile_kernel("transform");
+        parallelFor(0, n, PARALLEL_GRAIN, [&t, src, dst](std::size_t b, std::size_t e)
+        {
+            T a[N + 1][N], w[N + 1];
+            for (std::size_t j = 0; j <= N; ++j)
+            {
+                for (std::size_t i = 0; i < N; ++i)
+                    a[j][i] = t.cols[j][i];
+                w[j] = t.w[j];
+            }
+            int steps = t.steps;
+            simdFor<T>(e - b, [&a, &w, steps, src, dst, b](auto ops, std::size_t k)
+            {
+                typedef decltype(ops) O;
+                std::size_t i = b + k;
+                typename O::reg p[N], x[N];
+                for (std::size_t j = 0; j < N; ++j)
+                    p[j] = O::load(src[j] + i);
+                for (std::size_t r = 0; r < N; ++r)
+                {
+                    x[r] = O::set(a[N][r]);
+                    for (std::size_t j = 0; j < N; ++j)
+                        x[r] = O::add(x[r], O::mul(O::set(a[j][r]), p[j]));
+                }
+                if (steps & TRANSFORM_PROJECT)
+                {
+                    typename O::reg wp = O::set(w[N]);
+                    for (std::size_t j = 0; j < N; ++j)
+                        wp = O::add(wp, O::mul(O::set(w[j]), p[j]));
+                    typename O::reg scale = O::div(O::set(T(1)), wp);
+                    for (std::size_t r = 0; r < N; ++r)
+                        x[r] = O::mul(x[r], scale);
+                }
+                if (steps & TRANSFORM_NORMALIZE)
+                {
+                    typename O::reg n2 = O::mul(x[0], x[0]);
+                    for (std::size_t r = 1; r < N; ++r)
+                        n2 = O::add(n2, O::mul(x[r], x[r]));
+                    typename O::reg scale = O::div(O::set(T(1)), O::sqrt(n2));
+                    for (std::size_t r = 0; r < N; ++r)
+                        x[r] = O::mul(x[r], scale);
+                }
+                for (std::size_t r = 0; r < N; ++r)
+                    O::store(dst[r] + i, x[r]);
+            });
+        });
+    }
+
+    template <typename E, std::size_t N, typename T>
+    Vec<N, T> transform(const MatrixExpression<E, T>& m, const Vec<N, T>& p, int steps = TRANSFORM_AFFINE)
+    {
+        return PointTransform<N, T>(m, steps).apply(p);
+    }
+
+    template <typename E, std::size_t N, typename T, std::size_t M>
+    Array<Vec<N, T>> transform(const MatrixExpression<E, T>& m, const Array<Vec<N, T>, M>& points, int steps = TRANSFORM_AFFINE)
+    {
+        Array<Vec<N, T>> ret(points.len());
+        transform(m, points, ret, steps);
+        return ret;
+    }
+
+    //into out, reusing its memory (a fresh buffer pays a page fault per page on first write). out may be points
+    template <typename E, std::size_t N, typename T, std::size_t M, std::size_t L>
+    Array<Vec<N, T>, L>& transform(const MatrixExpression<E, T>& m, const Array<Vec<N, T>, M>& points, Array<Vec<N, T>, L>& out, int steps = TRANSFORM_AFFINE)
+    {
+        PointTransform<N, T> t(m, steps);
+        out.resize(points.len());
+        if (points.len() > 0)
+            transformPoints(t, &points[0], &out[0], points.len());
+        return out;
+    }
+
+    template <typename E, std::size_t N, typename T, std::size_t M>
+    Array<Vec<N, T>, M>& transformInPlace(const MatrixExpression<E, T>& m, Array<Vec<N, T>, M>& points, int steps = TRANSFORM_AFFINE)
+    {
+        return transform(m, points, points, steps);
+    }
+
+    template <typename E, std::size_t N, typename T>
+    VecArray<N, T> transform(const MatrixExpression<E, T>& m, const VecArray<N, T>& points, int steps = TRANSFORM_AFFINE)
+    {
+        VecArray<N, T> ret(points.len());
+        transform(m, points, ret, steps);
+        return ret;
+    }
+
+    template <typename E, std::size_t N, typename T>
+    VecArray<N, T>& transform(const MatrixExpression<E, T>& m, const VecArray<N, T>& points, VecArray<N, T>& out, int steps = TRANSFORM_AFFINE)
+    {
+        PointTransform<N, T> t(m, steps);
+        if (out.len() != points.len())
+            out = VecArray<N, T>(points.len());
+        const T *src[N];
+        T *dst[N];
+        for (std::size_t j = 0; j < N; ++j)
+        {
+            src[j] = points.columnData(j);
+            dst[j] = out.columnData(j);
+        }
+        transformColumns(t, src, dst, points.len());
+        return out;
+    }
+
+    template <typename E, std::size_t N, typename T>
+    VecArray<N, T>& transformInPlace(const MatrixExpression<E, T>& m, VecArray<N, T>& points, int steps = TRANSFORM_AFFINE)
+    {
+        return transform(m, points, points, steps);
+    }
+
+    //N x N is m p, (N + 1) x (N + 1) is the affine transform of p (no division by w)
+    template <typename E, std::size_t N, typename T>
+    Vec<N, T> operator*(const MatrixExpression<E, T>& m, const Vec<N, T>& p)
+    {
+        return transform(m, p);
+    }
+}
+
+//FFT
+//mixed radix decimation in time (radix 4 and 2 butterflies, any other prime through a generic one),
+//running on split planes so the butterflies vectorize along the sub transforms. Plans hold the
+//factorization and the twiddles of every stage and are built once per size, then shared by every
+//thread. Inverse transforms swap real and imaginary parts around the forward one and scale by 1 / n
+namespace stuff
+{
+    template <typename T>
+    class FftPlan
+    {
+    public:
+        FftPlan(std::size_t n_): next(nullptr), n(n_), slice(0)
+        {
+            const double two_pi = 6.283185307179586476925286766559;
+            root_r = Array<T>(n);
+            root_i = Array<T>(n);
+            for (std::size_t j = 0; j < n; ++j)
+            {
+                root_r[j] = (T)std::cos(-two_pi * j / n);
+                root_i[j] = (T)std::sin(-two_pi * j / n);
+            }
+
+            std::size_t rest = n, p = 4, total = 0;
+            while (rest > 1)
+            {
+                while (rest % p != 0)
+                {
+                    p = p == 4? 2: p == 2? 3: p + 2;
+                    if (p * p > rest)
+                        p = rest;
+                }
+                rest /= p;
+                radix.insert(p);
+                tw_offset.insert(total);
+                total += (p - 1) * rest;
+                if (p != 2 && p != 4 && 2 * p * SimdOps<T>::width > slice)
+                    slice = 2 * p * SimdOps<T>::width;
+            }
+
+            if (total == 0)
+                return;
+            tw_r = Array<T>(total);
+            tw_i = Array<T>(total);
+            rest = n;
+            for (std::size_t s = 0, fstride = 1; s < radix.len(); fstride *= radix[s], ++s)
+            {
+                rest /= radix[s];
+                for (std::size_t q = 1; q < radix[s]; ++q)
+                {
+                    for (std::size_t k = 0; k < rest; ++k)
+                    {
+                        tw_r[tw_offset[s] + (q - 1) * rest + k] = root_r[q * k * fstride];
+                        tw_i[tw_offset[s] + (q - 1) * rest + k] = root_i[q * k * fstride];
+                    }
+                }
+            }
+        }
+
+        std::size_t len() const { return n; }
+
+        //elements of scratch one transform needs. The plan is shared between threads, so callers
+        //allocate it, on the calling thread, and pass it to transform
+        std::size_t scratchLen() const
+        {
+            return n >= PARALLEL_GRAIN && radix.len() > 0? radix[0] * slice: slice;
+        }
+
+        //unnormalized transform of the n numbers at (in_r, in_i), in_stride elements apart, into the
+        //contiguous planes (out_r, out_i). Input and output must not overlap, scratch holds scratchLen() elements
+        void transform(const T* in_r, const T* in_i, std::size_t in_stride, T* out_r, T* out_i, bool inverse, T* scratch) const
+        {
+            if (inverse)
+            {
+                std::swap(in_r, in_i);
+                std::swap(out_r, out_i);
+            }
+            if (n == 1)
+            {
+                out_r[0] = in_r[0];
+                out_i[0] = in_i[0];
+                return;
+            }
+            if (n > 1)
+                work(out_r, out_i, in_r, in_i, 1, in_stride, 0, n, scratch);
+        }
+
+        FftPlan<T> *next;
+
+    private:
+        void work(T* out_r, T* out_i, const T* in_r, const T* in_i, std::size_t fstride, std::size_t in_stride, 
+                  std::size_t stage, std::size_t len_, T* scratch) const
+        {
+            std::size_t p = radix[stage], m = len_ / p, step = fstride * in_stride;
+            if (m == 1)
+            {
+                for (std::size_t j = 0; j < p; ++j)
+                {
+                    out_r[j] = in_r[j * step];
+                    out_i[j] = in_i[j * step];
+                }
+            }
+            else
+            {
+                //only the first stage is split between threads, its sub transforms are the biggest.
+                //Each of them gets its own slice of scratch then
+                bool split = stage == 0 && n >= PARALLEL_GRAIN;
+                std::size_t sub_slice = split? slice: 0;
+                auto sub = [this, out_r, out_i, in_r, in_i, step, m, fstride, p, in_stride, stage, scratch, sub_slice](std::size_t first, std::size_t last)
+                {
+                    for (std::size_t j = first; j < last; ++j)
+                        work(out_r + j * m, out_i + j * m, in_r + j * step, in_i + j * step, fstride * p, in_stride, stage + 1, m,
+                             scratch + j * sub_slice);
+                };
+                if (split)
+                    parallelFor(0, p, 1, sub);
+                else
+                    sub(0, p);
+            }
+
+            const T *tr = &tw_r[0] + tw_offset[stage], *ti = &tw_i[0] + tw_offset[stage];
+            if (p == 2)
+                butterfly2(out_r, out_i, tr, ti, m);
+            else if (p == 4)
+                butterfly4(out_r, out_i, tr, ti, m);
+            else
+                butterflyGeneric(out_r, out_i, tr, ti, m, p, scratch);
+        }
+
+        static void butterfly2(T* fr, T* fi, const T* tr, const T* ti, std::size_t m)
+        {
+            simdFor<T>(m, [=](auto ops, std::size_t k)
+            {
+                typedef decltype(ops) O;
+                typename O::reg b_r = O::load(fr + m + k), b_i = O::load(fi + m + k);
+                typename O::reg w_r = O::load(tr + k), w_i = O::load(ti + k);
+                typename O::reg t_r = O::sub(O::mul(b_r, w_r), O::mul(b_i, w_i));
+                typename O::reg t_i = O::add(O::mul(b_r, w_i), O::mul(b_i, w_r));
+                typename O::reg a_r = O::load(fr + k), a_i = O::load(fi + k);
+                O::store(fr + m + k, O::sub(a_r, t_r));
+                O::store(fi + m + k, O::sub(a_i, t_i));
+                O::store(fr + k, O::add(a_r, t_r));
+                O::store(fi + k, O::add(a_i, t_i));
+            });
+        }
+
+        static void butterfly4(T* fr, T* fi, const T* tr, const T* ti, std::size_t m)
+        {
+            simdFor<T>(m, [=](auto ops, std::size_t k)
+            {
+                typedef decltype(ops) O;
+                typename O::reg x_r[4], x_i[4];
+                x_r[0] = O::load(fr + k);
+                x_i[0] = O::load(fi + k);
+                for (std::size_t q = 1; q < 4; ++q)
+                {
+                    typename O::reg b_r = O::load(fr + q * m + k), b_i = O::load(fi + q * m + k);
+                    typename O::reg w_r = O::load(tr + (q - 1) * m + k), w_i = O::load(ti + (q - 1) * m + k);
+                    x_r[q] = O::sub(O::mul(b_r, w_r), O::mul(b_i, w_i));
+                    x_i[q] = O::add(O::mul(b_r, w_i), O::mul(b_i, w_r));
+                }
+                //s0 = x0 + x2, s1 = x0 - x2, s2 = x1 + x3, s3 = x1 - x3
+                typename O::reg s0_r = O::add(x_r[0], x_r[2]), s0_i = O::add(x_i[0], x_i[2]);
+                typename O::reg s1_r = O::sub(x_r[0], x_r[2]), s1_i = O::sub(x_i[0], x_i[2]);
+                typename O::reg s2_r = O::add(x_r[1], x_r[3]), s2_i = O::add(x_i[1], x_i[3]);
+                typename O::reg s3_r = O::sub(x_r[1], x_r[3]), s3_i = O::sub(x_i[1], x_i[3]);
+                O::store(fr + k, O::add(s0_r, s2_r));
+                O::store(fi + k, O::add(s0_i, s2_i));
+                O::store(fr + 2 * m + k, O::sub(s0_r, s2_r));
+                O::store(fi + 2 * m + k, O::sub(s0_i, s2_i));
+                //s1 - i s3 and s1 + i s3
+                O::store(fr + m + k, O::add(s1_r, s3_i));
+                O::store(fi + m + k, O::sub(s1_i, s3_r));
+                O::store(fr + 3 * m + k, O::sub(s1_r, s3_i));
+                O::store(fi + 3 * m + k, O::add(s1_i, s3_r));
+            });
+        }
+
+        //O(p^2) butterfly for the odd primes, scratch holds 2 p registers
+        void butterflyGeneric(T* fr, T* fi, const T* tr, const T* ti, std::size_t m, std::size_t p, T* scratch) const
+        {
+            T *sr = scratch, *si = sr + p * SimdOps<T>::width;
+            const T *rr = &root_r[0], *ri = &root_i[0];
+            std::size_t root_step = n / p;
+            simdFor<T>(m, [=](auto ops, std::size_t k)
+            {
+                typedef decltype(ops) O;
+                O::store(sr, O::load(fr + k));
+                O::store(si, O::load(fi + k));
+                for (std::size_t q = 1; q < p; ++q)
+                {
+                    typename O::reg b_r = O::load(fr + q * m + k), b_i = O::load(fi + q * m + k);
+                    typename O::reg w_r = O::load(tr + (q - 1) * m + k), w_i = O::load(ti + (q - 1) * m + k);
+                    O::store(sr + q * O::width, O::sub(O::mul(b_r, w_r), O::mul(b_i, w_i)));
+                    O::store(si + q * O::width, O::add(O::mul(b_r, w_i), O::mul(b_i, w_r)));
+                }
+                for (std::size_t u = 0; u < p; ++u)
+                {
+                    typename O::reg acc_r = O::load(sr), acc_i = O::load(si);
+                    for (std::size_t q = 1; q < p; ++q)
+                    {
+                        std::size_t j = (u * q) % p * root_step;
+                        typename O::reg w_r = O::set(rr[j]), w_i = O::set(ri[j]);
+                        typename O::reg x_r = O::load(sr + q * O::width), x_i = O::load(si + q * O::width);
+                        acc_r = O::add(acc_r, O::sub(O::mul(x_r, w_r), O::mul(x_i, w_i)));
+                        acc_i = O::add(acc_i, O::add(O::mul(x_r, w_i), O::mul(x_i, w_r)));
+                    }
+                    O::store(fr + u * m + k, acc_r);
+                    O::store(fi + u * m + k, acc_i);
+                }
+            });
+        }
+
+        std::size_t n;
+        //W_n^j
+        Array<T> root_r, root_i;
+        Array<std::size_t> radix;
+        //stage s keeps W_n^(q k fstride) at tw_offset[s] + (q - 1) m + k
+        Array<std::size_t> tw_offset;
+        Array<T> tw_r, tw_i;
+        //scratch of the biggest generic butterfly
+        std::size_t slice;
+    };
+
+    //real transforms of even length n run as complex transforms of length n / 2, plus W_n^k for the split
+    template <typename T>
+    class RfftPlan
+    {
+    public:
+        RfftPlan(std::size_t n_);
+
+        std::size_t len() const { return n; }
+
+        const FftPlan<T>& half;
+        Array<T> w_r, w_i;
+        RfftPlan<T> *next;
+
+    private:
+        std::size_t n;
+    };
+
+    //plans are built on first use and kept until exit, references to them stay valid
+    template <typename P>
+    const P& cachedPlan(std::size_t n)
+    {
+        static std::mutex lock;
+        static P *plans = nullptr;
+        std::lock_guard<std::mutex> guard(lock);
+        for (P *p = plans; p != nullptr; p = p->next)
+            if (p->len() == n)
+                return *p;
+        P *plan = new P(n);
+        plan->next = plans;
+        plans = plan;
+        return *plan;
+    }
+
+    template <typename T>
+    const FftPlan<T>& fftPlan(std::size_t n)
+    {
+        return cachedPlan<FftPlan<T>>(n);
+    }
+
+    template <typename T>
+    RfftPlan<T>::RfftPlan(std::size_t n_): half(fftPlan<T>(n_ / 2)), w_r(n_ / 2 + 1), w_i(n_ / 2 + 1), next(nullptr), n(n_)
+    {
+        const double two_pi = 6.283185307179586476925286766559;
+        for (std::size_t k = 0; k <= n / 2; ++k)
+        {
+            w_r[k] = (T)std::cos(-two_pi * k / n);
+            w_i[k] = (T)std::sin(-two_pi * k / n);
+        }
+    }
+
+    //transforms count sequences of n numbers, sequence s starts at in + s * dist and its elements are
+    //stride apart, results go to the same positions of out. in and out may be the same
+    template <typename T>
+    void fftStrided(const Complex<T>* in, Complex<T>* out, std::size_t n, std::size_t count, std::size_t stride, 
+                    std::size_t dist, bool inverse)
+    {
+        static_assert(sizeof(Complex<T>) == 2 * sizeof(T), "Complex<T> must be two packed T");
+        if (n == 0 || count == 0)
+            return;
+        profile_kernel("fft");
+        const FftPlan<T>& plan = fftPlan<T>(n);
+        T scale = inverse? T(1) / (T)n: T(1);
+        //sequences go in blocks, each with its own scratch allocated here on the calling thread
+        std::size_t grain = parallelGrain(5 * n), threads = 4 * currentThreadCount();
+        std::size_t blocks = (count + grain - 1) / grain;
+        blocks = blocks > threads? threads: blocks;
+        std::size_t per_block = (count + blocks - 1) / blocks, block_len = 2 * n + plan.scratchLen();
+        Array<T> scratch(blocks * block_len);
+        T *base = &scratch[0];
+        parallelFor(0, blocks, 1, [&plan, in, out, n, count, stride, dist, inverse, scale, per_block, block_len, base](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                T *sr = base + b * block_len, *si = sr + n;
+                for (std::size_t s = b * per_block; s < count && s < (b + 1) * per_block; ++s)
+                {
+                    const Complex<T> *src = in + s * dist;
+                    plan.transform(&src->r(), &src->i(), 2 * stride, sr, si, inverse, si + n);
+                    Complex<T> *dst = out + s * dist;
+                    for (std::size_t k = 0; k < n; ++k)
+                    {
+                        dst[k * stride].r() = sr[k] * scale;
+                        dst[k * stride].i() = si[k] * scale;
+                    }
+                }
+            }
+        });
+    }
+
+    template <typename T, std::size_t N>
+    void fftInPlace(Array<Complex<T>, N>& a, bool inverse = false)
+    {
+        if (a.len() > 0)
+            fftStrided(&a[0], &a[0], a.len(), 1, 1, 0, inverse);
+    }
+
+    template <typename T, std::size_t N>
+    Array<Complex<T>> fft(const Array<Complex<T>, N>& a)
+    {
+        Array<Complex<T>> ret(a.len());
+        if (a.len() > 0)
+            fftStrided(&a[0], &ret[0], a.len(), 1, 1, 0, false);
+        return ret;
+    }
+
+    template <typename T, std::size_t N>
+    Array<Complex<T>> ifft(const Array<Complex<T>, N>& a)
+    {
+        Array<Complex<T>> ret(a.len());
+        if (a.len() > 0)
+            fftStrided(&a[0], &ret[0], a.len(), 1, 1, 0, true);
+        return ret;
+    }
+
+    //batched: every row of m is transformed on its own
+    template <typename T, std::size_t N>
+    void fftRows(Matrix<Complex<T>, N>& m, bool inverse = false)
+    {
+        if (m.rows() > 0 && m.cols() > 0)
+            fftStrided(&m(0, 0), &m(0, 0), m.cols(), m.rows(), 1, m.cols(), inverse);
+    }
+
+    //2D transform, rows and then columns
+    template <typename T, std::size_t N>
+    void fftInPlace(Matrix<Complex<T>, N>& m, bool inverse = false)
+    {
+        if (m.rows() == 0 || m.cols() == 0)
+            return;
+        fftStrided(&m(0, 0), &m(0, 0), m.cols(), m.rows(), 1, m.cols(), inverse);
+        fftStrided(&m(0, 0), &m(0, 0), m.rows(), m.cols(), m.cols(), 1, inverse);
+    }
+
+    template <typename T, std::size_t N>
+    Matrix<Complex<T>> fft(const Matrix<Complex<T>, N>& m)
+    {
+        Matrix<Complex<T>> ret(m.rows(), m.cols());
+        if (m.rows() == 0 || m.cols() == 0)
+            return ret;
+        fftStrided(&m(0, 0), &ret(0, 0), m.cols(), m.rows(), 1, m.cols(), false);
+        fftStrided(&ret(0, 0), &ret(0, 0), m.rows(), m.cols(), m.cols(), 1, false);
+        return ret;
+    }
+
+    template <typename T, std::size_t N>
+    Matrix<Complex<T>> ifft(const Matrix<Complex<T>, N>& m)
+    {
+        Matrix<Complex<T>> ret(m.rows(), m.cols());
+        if (m.rows() == 0 || m.cols() == 0)
+            return ret;
+        fftStrided(&m(0, 0), &ret(0, 0), m.cols(), m.rows(), 1, m.cols(), true);
+        fftStrided(&ret(0, 0), &ret(0, 0), m.rows(), m.cols(), m.cols(), 1, true);
+        return ret;
+    }
+
+    //split planes are transformed without interleaving
+    template <typename T>
+    void fftInPlace(ComplexArray<T>& a, bool inverse = false)
+    {
+        std::size_t n = a.len();
+        if (n == 0)
+            return;
+        profile_kernel("fft");
+        const FftPlan<T>& plan = fftPlan<T>(n);
+        Array<T> scratch(2 * n + plan.scratchLen());
+        copyElems(&scratch[0], a.realData(), n);
+        copyElems(&scratch[n], a.imagData(), n);
+        plan.transform(&scratch[0], &scratch[n], 1, a.realData(), a.imagData(), inverse, &scratch[2 * n]);
+        if (inverse)
+            a = a / (T)n;
+    }
+
+    template <typename T>
+    ComplexArray<T> fft(const ComplexArray<T>& a)
+    {
+        ComplexArray<T> ret(a.len());
+        if (a.len() > 0)
+        {
+            const FftPlan<T>& plan = fftPlan<T>(a.len());
+            Array<T> scratch(plan.scratchLen() + 1);
+            plan.transform(a.realData(), a.imagData(), 1, ret.realData(), ret.imagData(), false, &scratch[0]);
+        }
+        return ret;
+    }
+
+    template <typename T>
+    ComplexArray<T> ifft(const ComplexArray<T>& a)
     {
-        return MatrixTensor<P1, P2, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const P2*>(&m2)
-        );
+        ComplexArray<T> ret(a.len());
+        if (a.len() > 0)
+        {
+            const FftPlan<T>& plan = fftPlan<T>(a.len());
+            Array<T> scratch(plan.scratchLen() + 1);
+            plan.transform(a.realData(), a.imagData(), 1, ret.realData(), ret.imagData(), true, &scratch[0]);
+            ret = ret / (T)a.len();
+        }
+        return ret;
     }
 
-    template <typename P1, typename T>
-    class MatrixMultS : public MatrixExpression<MatrixMultS<P1, T>, T>
+    //the n / 2 + 1 non redundant coefficients of the transform of real x
+    template <typename T, std::size_t N>
+    Array<Complex<T>> rfft(const Array<T, N>& x)
     {
-    public:
-        MatrixMultS(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+        std::size_t n = x.len();
+        if (n == 0)
+            return Array<Complex<T>>();
+        if (n % 2 != 0)
+        {
+            Array<Complex<T>> full(n, [&x](std::size_t i) { return Complex<T>(x[i], T()); });
+            fftInPlace(full);
+            Array<Complex<T>> ret(n / 2 + 1);
+            for (std::size_t k = 0; k <= n / 2; ++k)
+                ret[k] = full[k];
+            return ret;
+        }
+        profile_kernel("rfft");
+        std::size_t h = n / 2;
+        const RfftPlan<T>& plan = cachedPlan<RfftPlan<T>>(n);
+        //even samples as real parts and odd samples as imaginary parts
+        Array<T> z(2 * h + plan.half.scratchLen());
+        plan.half.transform(&x[0], &x[0] + 1, 2, &z[0], &z[0] + h, false, &z[0] + 2 * h);
+        const T *zr = &z[0], *zi = &z[0] + h;
+        Array<Complex<T>> ret(h + 1);
+        for (std::size_t k = 0; k <= h; ++k)
+        {
+            std::size_t a = k % h, b = (h - k) % h;
+            //even part (Z[k] + conj(Z[h - k])) / 2, odd part (Z[k] - conj(Z[h - k])) / 2i
+            T e_r = (zr[a] + zr[b]) / 2, e_i = (zi[a] - zi[b]) / 2;
+            T o_r = (zi[a] + zi[b]) / 2, o_i = (zr[b] - zr[a]) / 2;
+            ret[k] = Complex<T>(e_r + plan.w_r[k] * o_r - plan.w_i[k] * o_i, e_i + plan.w_r[k] * o_i + plan.w_i[k] * o_r);
+        }
+        return ret;
+    }
 
-        T operator()(std::size_t row, std::size_t col) const 
+    //real signal of length n from its n / 2 + 1 coefficients, as given by rfft
+    template <typename T, std::size_t N>
+    Array<T> irfft(const Array<Complex<T>, N>& c, std::size_t n)
+    {
+        if (n == 0)
+            return Array<T>();
+        if (c.len() != n / 2 + 1)
         {
-            return p1(row, col) * s;
+            std::cerr << "irfft of length " << n << " needs " << n / 2 + 1 << " coefficients, got " << c.len() << std::endl;
+            exit(-1);
+        }
+        if (n % 2 != 0)
+        {
+            Array<Complex<T>> full(n, [&c, n](std::size_t i) { return i <= n / 2? c[i]: Complex<T>(!c[n - i]); });
+            fftInPlace(full, true);
+            return Array<T>(n, [&full](std::size_t i) { return full[i].r(); });
         }
+        profile_kernel("rfft");
+        std::size_t h = n / 2;
+        const RfftPlan<T>& plan = cachedPlan<RfftPlan<T>>(n);
+        Array<T> z(2 * h + plan.half.scratchLen());
+        for (std::size_t k = 0; k < h; ++k)
+        {
+            //even part (X[k] + conj(X[h - k])) / 2, odd part (X[k] - conj(X[h - k])) W_n^-k / 2
+            T e_r = (c[k].r() + c[h - k].r()) / 2, e_i = (c[k].i() - c[h - k].i()) / 2;
+            T d_r = (c[k].r() - c[h - k].r()) / 2, d_i = (c[k].i() + c[h - k].i()) / 2;
+            T o_r = d_r * plan.w_r[k] + d_i * plan.w_i[k], o_i = d_i * plan.w_r[k] - d_r * plan.w_i[k];
+            z[k] = e_r - o_i;
+            z[h + k] = e_i + o_r;
+        }
+        Array<T> ret(n);
+        plan.half.transform(&z[0], &z[0] + h, 1, &ret[0], &ret[0] + h, true, &z[0] + 2 * h);
+        //planes back to interleaved samples
+        Array<T> planes(ret);
+        for (std::size_t k = 0; k < h; ++k)
+        {
+            ret[2 * k] = planes[k] / (T)h;
+            ret[2 * k + 1] = planes[h + k] / (T)h;
+        }
+        return ret;
+    }
+}
 
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
 
-    template <typename P1, typename T>
-    MatrixMultS<P1, T> operator*(const MatrixExpression<P1, T>& m1, const T& s)
+//REDUCTIONS
+//reductions evaluate the expression tree inside the loop, so norm2(a * x - b) never builds
+//the residual. Every reduction keeps REDUCTION_LANES independent accumulators, which breaks
+//the dependency between iterations and lets the compiler use vector registers. Packed Array
+//and Matrix expressions are reduced with SimdOps, REDUCTION_LANES registers at a time.
+//Inputs bigger than PARALLEL_GRAIN (matrices: blocks of rows) are cut in fixed blocks reduced on the
+//thread pool and then combined in order, so the result doesn't depend on the number of threads.
+namespace stuff
+{
+    //op(op(op(init, load(begin)), load(begin + 1)), ...) with REDUCTION_LANES accumulators
+    template <typename T, typename L, typename O>
+    T reduceRange(std::size_t begin, std::size_t end, const T& init, const L& load, const O& op)
     {
-        return MatrixMultS<P1, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const T*>(&s)
-        );
+        T acc[REDUCTION_LANES];
+        for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+            acc[l] = init;
+
+        std::size_t i = begin;
+        for (; i + REDUCTION_LANES <= end; i += REDUCTION_LANES)
+            for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+                acc[l] = op(acc[l], load(i + l));
+        for (; i < end; ++i)
+            acc[0] = op(acc[0], load(i));
+
+        for (std::size_t l = 1; l < REDUCTION_LANES; ++l)
+            acc[0] = op(acc[0], acc[l]);
+        return acc[0];
     }
 
-    template <typename P1, typename T>
-    MatrixMultS<P1, T> operator*(const T& s, const MatrixExpression<P1, T>& m1)
+    //reduces blocks [b * block, (b + 1) * block) of [0, n) with reduce(begin, end) in parallel,
+    //then combines the partial results in order
+    template <typename T, typename R, typename O>
+    T reduceBlocks(std::size_t n, std::size_t block, const R& reduce, const O& op)
     {
-        return MatrixMultS<P1, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const T*>(&s)
-        );
+        std::size_t blocks = (n + block - 1) / block;
+        if (blocks < 2)
+            return reduce(0, n);
+
+        T *partial = allocElems<T>(blocks);
+        matrix_assert(partial != NULL);
+        parallelFor(0, blocks, 1, [partial, n, block, &reduce](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+                partial[b] = reduce(b * block, (b + 1) * block < n? (b + 1) * block: n);
+        });
+        T ret = partial[0];
+        for (std::size_t b = 1; b < blocks; ++b)
+            ret = op(ret, partial[b]);
+        memFree(partial);
+        return ret;
     }
 
-    template <typename P1, typename T>
-    class MatrixDivS : public MatrixExpression<MatrixDivS<P1, T>, T>
+    template <typename T, typename L, typename O>
+    T reduceLinear(std::size_t n, const T& init, const L& load, const O& op)
     {
-    public:
-        MatrixDivS(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+        profile_kernel("reduction");
+        return reduceBlocks<T>(n, PARALLEL_GRAIN, [&init, &load, &op](std::size_t b, std::size_t e)
+        {
+            return reduceRange(b, e, init, load, op);
+        }, op);
+    }
 
-        T operator()(std::size_t row, std::size_t col) const 
+    //same as reduceRange, row by row over rows [begin, end) of a cols wide expression
+    template <typename T, typename L, typename O>
+    T reduceRowRange(std::size_t begin, std::size_t end, std::size_t cols, const T& init, const L& load, const O& op)
+    {
+        T acc[REDUCTION_LANES];
+        for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+            acc[l] = init;
+
+        for (std::size_t r = begin; r < end; ++r)
         {
-            return p1(row, col) / s;
+            std::size_t j = 0;
+            for (; j + REDUCTION_LANES <= cols; j += REDUCTION_LANES)
+                for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+                    acc[l] = op(acc[l], load(r, j + l));
+            for (; j < cols; ++j)
+                acc[0] = op(acc[0], load(r, j));
         }
 
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
-
-    template <typename P1, typename T>
-    MatrixDivS<P1, T> operator/(const MatrixExpression<P1, T>& m1, const T& s)
-    {
-        return MatrixDivS<P1, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const T*>(&s)
-        );
+        for (std::size_t l = 1; l < REDUCTION_LANES; ++l)
+            acc[0] = op(acc[0], acc[l]);
+        return acc[0];
     }
 
-    template <typename P1, typename T>
-    class MatrixDivSI : public MatrixExpression<MatrixDivSI<P1, T>, T>
+    //index of the greatest load(i) in [begin, end), the first one on ties
+    template <typename T, typename L>
+    std::size_t argmaxRange(std::size_t begin, std::size_t end, const L& load)
     {
-    public:
-        MatrixDivSI(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+        T best[REDUCTION_LANES];
+        std::size_t where[REDUCTION_LANES];
+        std::size_t lanes = end - begin < REDUCTION_LANES? end - begin: REDUCTION_LANES;
+        for (std::size_t l = 0; l < lanes; ++l)
+        {
+            best[l] = load(begin + l);
+            where[l] = begin + l;
+        }
 
-        T operator()(std::size_t row, std::size_t col) const 
+        std::size_t i = begin + lanes;
+        for (; i + REDUCTION_LANES <= end; i += REDUCTION_LANES)
+            for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+            {
+                T v = load(i + l);
+                if (v > best[l])
+                {
+                    best[l] = v;
+                    where[l] = i + l;
+                }
+            }
+        for (; i < end; ++i)
         {
-            return s / p1(row, col);
+            T v = load(i);
+            if (v > best[0])
+            {
+                best[0] = v;
+                where[0] = i;
+            }
         }
 
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
+        for (std::size_t l = 1; l < lanes; ++l)
+            if (best[l] > best[0] || (best[l] == best[0] && where[l] < where[0]))
+            {
+                best[0] = best[l];
+                where[0] = where[l];
+            }
+        return where[0];
+    }
 
-    template <typename P1, typename T>
-    MatrixDivSI<P1, T> operator/(const T& s, const MatrixExpression<P1, T>& m1)
+    template <typename T, typename L>
+    std::size_t argmaxLinear(std::size_t n, const L& load)
     {
-        return MatrixDivSI<P1, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const T*>(&s)
-        );
+        profile_kernel("argmax");
+        //blocks are combined in order, so only a strictly greater value moves the winner
+        return reduceBlocks<std::size_t>(n, PARALLEL_GRAIN, [&load](std::size_t b, std::size_t e)
+        {
+            return argmaxRange<T>(b, e, load);
+        }, [&load](std::size_t a, std::size_t b) -> std::size_t
+        {
+            return load(b) > load(a)? b: a;
+        });
     }
 
-    template <typename P1, typename T>
-    class MatrixT : public MatrixExpression<MatrixT<P1, T>, T>
+    template <typename T>
+    struct ReduceOps
     {
-    public:
-        MatrixT(const P1& p1_): p1(p1_){}
+        static T add(const T& a, const T& b) { return a + b; }
+        static T maxAbs(const T& a, const T& b) { T fb = std::fabs(b); return a > fb? a: fb; }
+        static T min(const T& a, const T& b) { return b < a? b: a; }
+        static T max(const T& a, const T& b) { return b > a? b: a; }
+    };
 
-        T operator()(std::size_t row, std::size_t col) const 
+    //the same operations on registers, apply<O>(acc, x) matches ReduceOps<T>::op(acc, x) lane by lane
+    struct ReduceAdd { template <typename O> static typename O::reg apply(typename O::reg acc, typename O::reg x) { return O::add(acc, x); } };
+    struct ReduceMaxAbs { template <typename O> static typename O::reg apply(typename O::reg acc, typename O::reg x) { return O::max(acc, O::abs(x)); } };
+    struct ReduceMin { template <typename O> static typename O::reg apply(typename O::reg acc, typename O::reg x) { return O::min(x, acc); } };
+    struct ReduceMax { template <typename O> static typename O::reg apply(typename O::reg acc, typename O::reg x) { return O::max(x, acc); } };
+
+    //reduceRowRange with REDUCTION_LANES registers, load(ops, r, j) gives elements j to
+    //j + decltype(ops)::width - 1 of row r. The registers are kept across rows and folded lane by lane
+    //at the end, the tail of each row goes one element at a time
+    template <typename T, typename P, typename L>
+    T reducePackedRows(std::size_t begin, std::size_t end, std::size_t cols, const T& init, const L& load)
+    {
+        typedef SimdOps<T> O;
+        typedef ScalarOps<T> S;
+        typename O::reg acc[REDUCTION_LANES];
+        for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+            acc[l] = O::set(init);
+        T tail = init;
+
+        for (std::size_t r = begin; r < end; ++r)
         {
-            return p1(col, row);
+            std::size_t j = 0;
+            for (; j + REDUCTION_LANES * O::width <= cols; j += REDUCTION_LANES * O::width)
+                for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+                    acc[l] = P::template apply<O>(acc[l], load(O(), r, j + l * O::width));
+            for (; j + O::width <= cols; j += O::width)
+                acc[0] = P::template apply<O>(acc[0], load(O(), r, j));
+            for (; j < cols; ++j)
+                tail = P::template apply<S>(tail, load(S(), r, j));
         }
+        for (std::size_t l = 1; l < REDUCTION_LANES; ++l)
+            acc[0] = P::template apply<O>(acc[0], acc[l]);
+
+        T lanes[O::width];
+        O::store(lanes, acc[0]);
+        T ret = lanes[0];
+        for (std::size_t l = 1; l < O::width; ++l)
+            ret = P::template apply<S>(ret, lanes[l]);
+        return P::template apply<S>(ret, tail);
+    }
 
-        std::size_t rows() const { return p1.cols(); }
-        std::size_t cols() const { return p1.rows(); }
-    private:
-        const P1& p1;
-    };
-
-    template <typename P1, typename T>
-    MatrixT<P1, T> operator!(const MatrixExpression<P1, T>& m1)
+    //the same over [begin, end) of a linear input, load(ops, i)
+    template <typename T, typename P, typename L>
+    T reducePackedRange(std::size_t begin, std::size_t end, const T& init, const L& load)
     {
-        return MatrixT<P1, T>(
-            *static_cast<const P1*>(&m1)
-        );
+        typedef SimdOps<T> O;
+        typedef ScalarOps<T> S;
+        typename O::reg acc[REDUCTION_LANES];
+        for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+            acc[l] = O::set(init);
+
+        std::size_t i = begin;
+        for (; i + REDUCTION_LANES * O::width <= end; i += REDUCTION_LANES * O::width)
+            for (std::size_t l = 0; l < REDUCTION_LANES; ++l)
+                acc[l] = P::template apply<O>(acc[l], load(O(), i + l * O::width));
+        for (; i + O::width <= end; i += O::width)
+            acc[0] = P::template apply<O>(acc[0], load(O(), i));
+        for (std::size_t l = 1; l < REDUCTION_LANES; ++l)
+            acc[0] = P::template apply<O>(acc[0], acc[l]);
+
+        T lanes[O::width];
+        O::store(lanes, acc[0]);
+        T ret = lanes[0];
+        for (std::size_t l = 1; l < O::width; ++l)
+            ret = P::template apply<S>(ret, lanes[l]);
+        for (; i < end; ++i)
+            ret = P::template apply<S>(ret, load(S(), i));
+        return ret;
     }
 
-    template <typename P1, typename T>
-    class MatrixNeg : public MatrixExpression<MatrixNeg<P1, T>, T>
+    //reduceLinear over load(ops, i), with SimdOps when the input is packed and ScalarOps otherwise
+    template <typename T, typename P, typename L>
+    T reduceLanes(std::size_t n, const T& init, const L& load, std::true_type)
     {
-    public:
-        MatrixNeg(const P1& p1_): p1(p1_){}
-
-        T operator()(std::size_t row, std::size_t col) const 
+        profile_kernel("reduction");
+        return reduceBlocks<T>(n, PARALLEL_GRAIN, [&init, &load](std::size_t b, std::size_t e)
         {
-            return -p1(row, col);
-        }
+            return reducePackedRange<T, P>(b, e, init, load);
+        }, P::template apply<ScalarOps<T>>);
+    }
 
-        std::size_t rows() const { return p1.cols(); }
-        std::size_t cols() const { return p1.rows(); }
-    private:
-        const P1& p1;
-    };
+    template <typename T, typename P, typename L>
+    T reduceLanes(std::size_t n, const T& init, const L& load, std::false_type)
+    {
+        return reduceLinear(n, init, [&load](std::size_t i) -> T { return load(ScalarOps<T>(), i); }, 
+                            P::template apply<ScalarOps<T>>);
+    }
 
-    template <typename P1, typename T>
-    MatrixNeg<P1, T> operator-(const MatrixExpression<P1, T>& m1)
+    //rows [begin, end) of a cols wide input on the calling thread, load(ops, r, j) as in reducePackedRows
+    template <typename T, typename P, typename L>
+    T reduceRowLanes(std::size_t begin, std::size_t end, std::size_t cols, const T& init, const L& load, std::true_type)
     {
-        return MatrixNeg<P1, T>(
-            *static_cast<const P1*>(&m1)
-        );
+        return reducePackedRows<T, P>(begin, end, cols, init, load);
     }
 
-    template <typename P1, typename T>
-    class MatrixAddI : public MatrixExpression<MatrixAddI<P1, T>, T>
+    template <typename T, typename P, typename L>
+    T reduceRowLanes(std::size_t begin, std::size_t end, std::size_t cols, const T& init, const L& load, std::false_type)
     {
-    public:
-        MatrixAddI(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+        return reduceRowRange(begin, end, cols, init, [&load](std::size_t r, std::size_t j) -> T { return load(ScalarOps<T>(), r, j); },
+                              P::template apply<ScalarOps<T>>);
+    }
 
-        T operator()(std::size_t row, std::size_t col) const 
+    //every row, in blocks of rows on the thread pool
+    template <typename T, typename P, typename L, typename K>
+    T reduceMatrixLanes(std::size_t rows, std::size_t cols, const T& init, const L& load, K packed)
+    {
+        profile_kernel("reduction");
+        return reduceBlocks<T>(rows, parallelGrain(cols), [cols, &init, &load, packed](std::size_t b, std::size_t e)
         {
-            return p1(row, col) + s * (row == col);
-        }
+            return reduceRowLanes<T, P>(b, e, cols, init, load, packed);
+        }, P::template apply<ScalarOps<T>>);
+    }
 
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
+    //VEC
 
-    template <typename P1, typename T>
-    MatrixAddI<P1, T> operator+(const MatrixExpression<P1, T>& m1, const T& s)
+    template <typename E, typename T>
+    T sum(const VecExpression<E, T>& v)
     {
-        return MatrixAddI<P1, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const T*>(&s)
-        );
+        const E& e = static_cast<const E&>(v);
+        return reduceLinear(e.dim(), T(), [&e](std::size_t i) -> T { return e[i]; }, ReduceOps<T>::add);
     }
 
-    template <typename P1, typename T>
-    MatrixAddI<P1, T> operator+(const T& s, const MatrixExpression<P1, T>& m1)
+    template <typename P1, typename P2, typename T>
+    T dotVec(const P1& a, const P2& b, std::false_type)
     {
-        return MatrixAddI<P1, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const T*>(&s)
-        );
+        return reduceLinear(a.dim(), T(), [&a, &b](std::size_t i) -> T { return a[i] * b[i]; }, ReduceOps<T>::add);
     }
 
-    template <typename P1, typename T>
-    class MatrixSubI : public MatrixExpression<MatrixSubI<P1, T>, T>
+    //packed Vecs: products a register at a time (padding masked, it may hold garbage from a division)
+    //and one horizontal add at the end
+    template <typename P1, typename P2, typename T>
+    T dotVec(const P1& a, const P2& b, std::true_type)
     {
-    public:
-        MatrixSubI(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+        typedef SimdOps<T> O;
+        std::size_t i = 0;
+        typename O::reg acc = O::set(T());
+        for (; i + O::width < a.dim(); i += O::width)
+            acc = O::add(acc, O::mul(a.template lanes<O>(i), b.template lanes<O>(i)));
+        acc = O::add(acc, O::keep(O::mul(a.template lanes<O>(i), b.template lanes<O>(i)), a.dim() - i));
+        return O::hsum(acc);
+    }
 
-        T operator()(std::size_t row, std::size_t col) const 
+    template <typename P1, typename P2, typename T>
+    constexpr T dot(const VecExpression<P1, T>& v1, const VecExpression<P2, T>& v2)
+    {
+        vec_assert(v1.dim() == v2.dim());
+        const P1& a = static_cast<const P1&>(v1);
+        const P2& b = static_cast<const P2&>(v2);
+        if (constantEvaluated())
         {
-            return p1(row, col) - s * (row == col);
+            T acc = T();
+            for (std::size_t i = 0; i < a.dim(); ++i)
+                acc = acc + a[i] * b[i];
+            return acc;
         }
+        return dotVec<P1, P2, T>(a, b, std::integral_constant<bool, P1::packed && P2::packed>());
+    }
 
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
-
-    template <typename P1, typename T>
-    MatrixSubI<P1, T> operator-(const MatrixExpression<P1, T>& m1, const T& s)
+    template <typename E, typename T>
+    T norm2(const VecExpression<E, T>& v)
     {
-        return MatrixSubI<P1, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const T*>(&s)
-        );
+        const E& e = static_cast<const E&>(v);
+        if (E::packed)
+            return std::sqrt(dot(v, v));
+        return std::sqrt(reduceLinear(e.dim(), T(), [&e](std::size_t i) -> T { T x = e[i]; return x * x; }, ReduceOps<T>::add));
     }
 
-    template <typename P1, typename T>
-    class MatrixSubII : public MatrixExpression<MatrixSubII<P1, T>, T>
+    template <typename E, typename T>
+    T normInf(const VecExpression<E, T>& v)
     {
-    public:
-        MatrixSubII(const P1& p1_, const T& s_): p1(p1_), s(s_) {}
+        const E& e = static_cast<const E&>(v);
+        return reduceLinear(e.dim(), T(), [&e](std::size_t i) -> T { return e[i]; }, ReduceOps<T>::maxAbs);
+    }
 
-        T operator()(std::size_t row, std::size_t col) const 
-        {
-            return s * (row == col) - p1(row, col);
-        }
+    template <typename E, typename T>
+    T min(const VecExpression<E, T>& v)
+    {
+        const E& e = static_cast<const E&>(v);
+        vec_assert(e.dim() > 0);
+        return reduceLinear(e.dim(), T(e[0]), [&e](std::size_t i) -> T { return e[i]; }, ReduceOps<T>::min);
+    }
 
-        std::size_t rows() const { return p1.rows(); }
-        std::size_t cols() const { return p1.cols(); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
+    template <typename E, typename T>
+    T max(const VecExpression<E, T>& v)
+    {
+        const E& e = static_cast<const E&>(v);
+        vec_assert(e.dim() > 0);
+        return reduceLinear(e.dim(), T(e[0]), [&e](std::size_t i) -> T { return e[i]; }, ReduceOps<T>::max);
+    }
 
-    template <typename P1, typename T>
-    MatrixSubII<P1, T> operator-(const T& s, const MatrixExpression<P1, T>& m1)
+    template <typename E, typename T>
+    std::size_t argmax(const VecExpression<E, T>& v)
     {
-        return MatrixSubII<P1, T>(
-            *static_cast<const P1*>(&m1),
-            *static_cast<const T*>(&s)
-        );
+        const E& e = static_cast<const E&>(v);
+        vec_assert(e.dim() > 0);
+        return argmaxLinear<T>(e.dim(), [&e](std::size_t i) -> T { return e[i]; });
     }
 
+    //ARRAY
+
     template <typename E, typename T>
-    std::ostream& operator<<(std::ostream& out, const MatrixExpression<E, T>& m)
+    T sum(const ArrayExpression<E, T>& v)
     {
-        if (m.rows() == 0 || m.cols() == 0)
-            return out;
-        
-        for (std::size_t i = 0; i < m.rows() - 1; ++i)
+        const E& e = static_cast<const E&>(v);
+        return reduceLanes<T, ReduceAdd>(e.len(), T(), [&e](auto ops, std::size_t i)
         {
-            for (std::size_t j = 0; j < m.cols() - 1; ++j)
-            {
-                out << m(i, j) << SEPARATOR;
-            }
-            std::size_t j = m.cols() - 1;
-            out << m(i, j) << std::endl;
-        }
+            return e.template lanes<decltype(ops)>(i);
+        }, std::integral_constant<bool, E::packed>());
+    }
 
-        std::size_t i = m.rows() - 1;
-        for (std::size_t j = 0; j < m.cols() - 1; ++j)
+    template <typename P1, typename P2, typename T>
+    T dot(const ArrayExpression<P1, T>& v1, const ArrayExpression<P2, T>& v2)
+    {
+        array_assert(v1.len() == v2.len());
+        const P1& a = static_cast<const P1&>(v1);
+        const P2& b = static_cast<const P2&>(v2);
+        return reduceLanes<T, ReduceAdd>(a.len(), T(), [&a, &b](auto ops, std::size_t i)
         {
-            out << m(i, j) << SEPARATOR;
-        }
-        std::size_t j = m.cols() - 1;
-        out << m(i, j);
-
-        return out;
+            typedef decltype(ops) O;
+            return O::mul(a.template lanes<O>(i), b.template lanes<O>(i));
+        }, std::integral_constant<bool, P1::packed && P2::packed>());
     }
-}
 
-
-//COMPLEX
-namespace stuff
-{
     template <typename E, typename T>
-    class ComplexExpression
+    T norm2(const ArrayExpression<E, T>& v)
     {
-    public:
-        T r() const { return static_cast<const E&>(*this).r(); }
-        T i() const { return static_cast<const E&>(*this).i(); }
-    };
+        const E& e = static_cast<const E&>(v);
+        return std::sqrt(reduceLanes<T, ReduceAdd>(e.len(), T(), [&e](auto ops, std::size_t i)
+        {
+            typedef decltype(ops) O;
+            typename O::reg x = e.template lanes<O>(i);
+            return O::mul(x, x);
+        }, std::integral_constant<bool, E::packed>()));
+    }
 
-    template<typename T>
-    class Complex : public ComplexExpression<Complex<T>, T>
+    template <typename E, typename T>
+    T normInf(const ArrayExpression<E, T>& v)
     {
-    public:
-        Complex(): real(), imag() { }
-
-        Complex(T real_part, T imag_part): real(real_part), imag(imag_part) { }
-
-        Complex(const Complex<T>& other) = default;
-
-        Complex(Complex<T>&& other) = default;
-
-        template <typename E>
-        Complex(const ComplexExpression<E, T>& expr): real(expr.r()), imag(expr.i()) { }
+        const E& e = static_cast<const E&>(v);
+        return reduceLanes<T, ReduceMaxAbs>(e.len(), T(), [&e](auto ops, std::size_t i)
+        {
+            return e.template lanes<decltype(ops)>(i);
+        }, std::integral_constant<bool, E::packed>());
+    }
 
-        ~Complex() = default;
-        const T& r() const { return real; }
-        const T& i() const { return imag; }
-        T& r() { return real; }
-        T& i() { return imag; }
-    private:
-        T real, imag;
-    };
+    template <typename E, typename T>
+    T min(const ArrayExpression<E, T>& v)
+    {
+        const E& e = static_cast<const E&>(v);
+        array_assert(e.len() > 0);
+        return reduceLanes<T, ReduceMin>(e.len(), T(e[0]), [&e](auto ops, std::size_t i)
+        {
+            return e.template lanes<decltype(ops)>(i);
+        }, std::integral_constant<bool, E::packed>());
+    }
 
-    template <typename P1, typename P2, typename T>
-    class ComplexSum : public ComplexExpression<ComplexSum<P1, P2, T>, T>
+    template <typename E, typename T>
+    T max(const ArrayExpression<E, T>& v)
     {
-    public:
-        ComplexSum(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
-        T r() const { return p1.r() + p2.r(); }
-        T i() const { return p1.i() + p2.i(); }
-    private:
-        const P1& p1;
-        const P2& p2;
-    };
+        const E& e = static_cast<const E&>(v);
+        array_assert(e.len() > 0);
+        return reduceLanes<T, ReduceMax>(e.len(), T(e[0]), [&e](auto ops, std::size_t i)
+        {
+            return e.template lanes<decltype(ops)>(i);
+        }, std::integral_constant<bool, E::packed>());
+    }
 
-    template <typename P1, typename P2, typename T>
-    ComplexSum<P1, P2, T> operator+(const ComplexExpression<P1, T>& c1, const ComplexExpression<P2, T>& c2)
+    template <typename E, typename T>
+    std::size_t argmax(const ArrayExpression<E, T>& v)
     {
-        return ComplexSum<P1, P2, T> (
-                                  *static_cast<const P1*>(&c1),
-                                  *static_cast<const P2*>(&c2));
+        const E& e = static_cast<const E&>(v);
+        array_assert(e.len() > 0);
+        return argmaxLinear<T>(e.len(), [&e](std::size_t i) -> T { return e[i]; });
     }
 
-    template <typename P1, typename P2, typename T>
-    class ComplexSub : public ComplexExpression<ComplexSub<P1, P2, T>, T>
+    //MATRIX
+
+    template <typename E, typename T>
+    T sum(const MatrixExpression<E, T>& m)
     {
-    public:
-        ComplexSub(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
-        T r() const { return p1.r() - p2.r(); }
-        T i() const { return p1.i() - p2.i(); }
-    private:
-        const P1& p1;
-        const P2& p2;
-    };
+        const E& e = static_cast<const E&>(m);
+        return reduceMatrixLanes<T, ReduceAdd>(e.rows(), e.cols(), T(), [&e](auto ops, std::size_t i, std::size_t j)
+        {
+            return e.template lanes<decltype(ops)>(i, j);
+        }, std::integral_constant<bool, E::packed>());
+    }
 
+    //sum of m1(i, j) * m2(i, j) (Frobenius inner product)
     template <typename P1, typename P2, typename T>
-    ComplexSub<P1, P2, T> operator-(const ComplexExpression<P1, T>& c1, const ComplexExpression<P2, T>& c2)
+    T dot(const MatrixExpression<P1, T>& m1, const MatrixExpression<P2, T>& m2)
     {
-        return ComplexSub<P1, P2, T> (
-                                  *static_cast<const P1*>(&c1),
-                                  *static_cast<const P2*>(&c2));
+        matrix_assert(m1.rows() == m2.rows() && m1.cols() == m2.cols());
+        const P1& a = static_cast<const P1&>(m1);
+        const P2& b = static_cast<const P2&>(m2);
+        return reduceMatrixLanes<T, ReduceAdd>(a.rows(), a.cols(), T(), [&a, &b](auto ops, std::size_t i, std::size_t j)
+        {
+            typedef decltype(ops) O;
+            return O::mul(a.template lanes<O>(i, j), b.template lanes<O>(i, j));
+        }, std::integral_constant<bool, P1::packed && P2::packed>());
     }
 
-    template <typename P1, typename P2, typename T>
-    class ComplexMult : public ComplexExpression<ComplexMult<P1, P2, T>, T>
+    template <typename E, typename T>
+    T frobenius(const MatrixExpression<E, T>& m)
     {
-    public:
-        ComplexMult(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
-        T r() const { return p1.r() * p2.r() - p1.i() * p2.i(); }
-        T i() const { return p1.r() * p2.i() + p1.i() * p2.r(); }
-    private:
-        const P1& p1;
-        const P2& p2;
-    };
+        const E& e = static_cast<const E&>(m);
+        return std::sqrt(reduceMatrixLanes<T, ReduceAdd>(e.rows(), e.cols(), T(), [&e](auto ops, std::size_t i, std::size_t j)
+        {
+            typedef decltype(ops) O;
+            typename O::reg x = e.template lanes<O>(i, j);
+            return O::mul(x, x);
+        }, std::integral_constant<bool, E::packed>()));
+    }
 
-    template <typename P1, typename P2, typename T>
-    ComplexMult<P1, P2, T> operator*(const ComplexExpression<P1, T>& c1, const ComplexExpression<P2, T>& c2)
+    //greatest absolute row sum, blocks of rows in parallel
+    template <typename E, typename T>
+    T normInf(const MatrixExpression<E, T>& m)
     {
-        return ComplexMult<P1, P2, T> (
-                                       *static_cast<const P1*>(&c1),
-                                       *static_cast<const P2*>(&c2));
+        const E& e = static_cast<const E&>(m);
+        std::size_t cols = e.cols();
+        profile_kernel("reduction");
+        return reduceBlocks<T>(e.rows(), parallelGrain(cols), [&e, cols](std::size_t b, std::size_t end)
+        {
+            T ret = T();
+            for (std::size_t i = b; i < end; ++i)
+            {
+                T row = reduceRowLanes<T, ReduceAdd>(i, i + 1, cols, T(), [&e](auto ops, std::size_t r, std::size_t j)
+                {
+                    typedef decltype(ops) O;
+                    return O::abs(e.template lanes<O>(r, j));
+                }, std::integral_constant<bool, E::packed>());
+                ret = ReduceOps<T>::max(ret, row);
+            }
+            return ret;
+        }, ReduceOps<T>::max);
     }
 
-    template <typename P1, typename P2, typename T>
-    class ComplexDiv : public ComplexExpression<ComplexDiv<P1, P2, T>, T>
+    template <typename E, typename T>
+    T trace(const MatrixExpression<E, T>& m)
     {
-    public:
-        ComplexDiv(const P1& p1_, const P2& p2_): p1(p1_), p2(p2_) { }
-        T r() const { return (p1.r() * p2.r() + p1.i() * p2.i()) / (p2.r() * p2.r() + p2.i() * p2.i()); }
-        T i() const { return (p1.i() * p2.r() - p1.r() * p2.i()) / (p2.r() * p2.r() + p2.i() * p2.i()); }
-    private:
-        const P1& p1;
-        const P2& p2;
-    };
+        const E& e = static_cast<const E&>(m);
+        std::size_t n = e.rows() < e.cols()? e.rows(): e.cols();
+        return reduceLinear(n, T(), [&e](std::size_t i) -> T { return e(i, i); }, ReduceOps<T>::add);
+    }
 
-    template <typename P1, typename P2, typename T>
-    ComplexDiv<P1, P2, T> operator/(const ComplexExpression<P1, T>& c1, const ComplexExpression<P2, T>& c2)
+    template <typename E, typename T>
+    T min(const MatrixExpression<E, T>& m)
     {
-        return ComplexDiv<P1, P2, T> (
-                                      *static_cast<const P1*>(&c1),
-                                      *static_cast<const P2*>(&c2));
+        const E& e = static_cast<const E&>(m);
+        matrix_assert(e.rows() > 0 && e.cols() > 0);
+        return reduceMatrixLanes<T, ReduceMin>(e.rows(), e.cols(), T(e(0, 0)), [&e](auto ops, std::size_t i, std::size_t j)
+        {
+            return e.template lanes<decltype(ops)>(i, j);
+        }, std::integral_constant<bool, E::packed>());
     }
 
-    template <typename P1, typename T>
-    class ComplexMultScal : public ComplexExpression<ComplexMultScal<P1, T>, T>
+    template <typename E, typename T>
+    T max(const MatrixExpression<E, T>& m)
     {
-    public:
-        ComplexMultScal(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T r() const { return p1.r() * s; }
-        T i() const { return p1.i() * s; }
-    private:
-        const P1& p1;
-        const T& s;
-    };
+        const E& e = static_cast<const E&>(m);
+        matrix_assert(e.rows() > 0 && e.cols() > 0);
+        return reduceMatrixLanes<T, ReduceMax>(e.rows(), e.cols(), T(e(0, 0)), [&e](auto ops, std::size_t i, std::size_t j)
+        {
+            return e.template lanes<decltype(ops)>(i, j);
+        }, std::integral_constant<bool, E::packed>());
+    }
 
-    template <typename P1, typename T>
-    ComplexMultScal<P1, T> operator*(const ComplexExpression<P1, T>& c1, const T& c2)
+    //row major index (row * cols + col) of the greatest element. Blocks of rows run in parallel and
+    //are combined in order, so only a strictly greater value moves the winner
+    template <typename E, typename T>
+    std::size_t argmax(const MatrixExpression<E, T>& m)
     {
-        return ComplexMultScal<P1, T> (
-                                       *static_cast<const P1*>(&c1),
-                                       c2);
+        const E& e = static_cast<const E&>(m);
+        matrix_assert(e.rows() > 0 && e.cols() > 0);
+        std::size_t cols = e.cols();
+        profile_kernel("argmax");
+        return reduceBlocks<std::size_t>(e.rows(), parallelGrain(cols), [&e, cols](std::size_t b, std::size_t end)
+        {
+            std::size_t best = b * cols;
+            T best_v = e(b, 0);
+            for (std::size_t i = b; i < end; ++i)
+            {
+                std::size_t j = argmaxRange<T>(0, cols, [&e, i](std::size_t c) -> T { return e(i, c); });
+                T v = e(i, j);
+                if (v > best_v)
+                {
+                    best_v = v;
+                    best = i * cols + j;
+                }
+            }
+            return best;
+        }, [&e, cols](std::size_t a, std::size_t b) -> std::size_t
+        {
+            return e(b / cols, b % cols) > e(a / cols, a % cols)? b: a;
+        });
     }
+}
 
-    template <typename P1, typename T>
-    ComplexMultScal<P1, T> operator*(const T& c2, const ComplexExpression<P1, T>& c1)
+//ALGORITHMS
+//scans, sorting, partitions and compaction of arrays. They run in fixed blocks on the thread pool:
+//a first pass gets something per block (a total, a count, a histogram), a short serial step turns
+//those into offsets, and a second pass does the work of every block starting from its offset
+namespace stuff
+{
+    //end of block b when n elements are cut in blocks of `block`
+    inline std::size_t blockEnd(std::size_t b, std::size_t block, std::size_t n)
     {
-        return ComplexMultScal<P1, T> (
-                                       *static_cast<const P1*>(&c1),
-                                       c2);
+        return (b + 1) * block < n? (b + 1) * block: n;
     }
 
-    template <typename P1, typename T>
-    class ComplexDivScal : public ComplexExpression<ComplexDivScal<P1, T>, T>
+    //a[i] = a[0] op a[1] op ... op a[i]. op must be associative, blocks are fixed so the result
+    //doesn't depend on the number of threads
+    template <typename T, std::size_t N, typename O = std::plus<T>>
+    Array<T, N>& inclusiveScanInPlace(Array<T, N>& a, const O& op = O())
     {
-    public:
-        ComplexDivScal(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T r() const { return p1.r() / s; }
-        T i() const { return p1.i() / s; }
-    private:
-        const P1& p1;
-        const T& s;
-    };
+        profile_kernel("scan");
+        std::size_t n = a.len(), blocks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+        if (n == 0)
+            return a;
+        T *d = &a[0];
+        if (blocks < 2)
+        {
+            for (std::size_t i = 1; i < n; ++i)
+                d[i] = op(d[i - 1], d[i]);
+            return a;
+        }
 
-    template <typename P1, typename T>
-    ComplexDivScal<P1, T> operator/(const ComplexExpression<P1, T>& c1, const T& c2)
+        //carry[b] = everything before block b
+        Array<T> carry(blocks);
+        T *c = &carry[0];
+        parallelFor(0, blocks - 1, 1, [d, c, n, &op](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                T s = d[b * PARALLEL_GRAIN];
+                for (std::size_t i = b * PARALLEL_GRAIN + 1; i < blockEnd(b, PARALLEL_GRAIN, n); ++i)
+                    s = op(s, d[i]);
+                c[b + 1] = s;
+            }
+        });
+        for (std::size_t b = 2; b < blocks; ++b)
+            c[b] = op(c[b - 1], c[b]);
+        parallelFor(0, blocks, 1, [d, c, n, &op](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                std::size_t begin = b * PARALLEL_GRAIN;
+                T s = b == 0? d[begin]: op(c[b], d[begin]);
+                d[begin] = s;
+                for (std::size_t i = begin + 1; i < blockEnd(b, PARALLEL_GRAIN, n); ++i)
+                    d[i] = s = op(s, d[i]);
+            }
+        });
+        return a;
+    }
+
+    //a[i] = init op a[0] op ... op a[i - 1]
+    template <typename T, std::size_t N, typename O = std::plus<T>>
+    Array<T, N>& exclusiveScanInPlace(Array<T, N>& a, const T& init = T(), const O& op = O())
     {
-        return ComplexDivScal<P1, T> (
-                                      *static_cast<const P1*>(&c1),
-                                      c2);
+        profile_kernel("scan");
+        std::size_t n = a.len(), blocks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+        if (n == 0)
+            return a;
+        T *d = &a[0];
+        Array<T> carry(blocks);
+        T *c = &carry[0];
+        c[0] = init;
+        parallelFor(0, blocks - 1, 1, [d, c, n, &op](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                T s = d[b * PARALLEL_GRAIN];
+                for (std::size_t i = b * PARALLEL_GRAIN + 1; i < blockEnd(b, PARALLEL_GRAIN, n); ++i)
+                    s = op(s, d[i]);
+                c[b + 1] = s;
+            }
+        });
+        for (std::size_t b = 1; b < blocks; ++b)
+            c[b] = op(c[b - 1], c[b]);
+        parallelFor(0, blocks, 1, [d, c, n, &op](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                T s = c[b];
+                for (std::size_t i = b * PARALLEL_GRAIN; i < blockEnd(b, PARALLEL_GRAIN, n); ++i)
+                {
+                    T t = d[i];
+                    d[i] = s;
+                    s = op(s, t);
+                }
+            }
+        });
+        return a;
     }
 
-    template <typename P1, typename T>
-    class ComplexDivScalI : public ComplexExpression<ComplexDivScalI<P1, T>, T>
+    template <typename E, typename T, typename O = std::plus<T>>
+    Array<T> inclusiveScan(const ArrayExpression<E, T>& expr, const O& op = O())
     {
-    public:
-        ComplexDivScalI(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T r() const { return (s * p1.r()) / (p1.r() * p1.r() + p1.i() * p1.i()); }
-        T i() const { return (-s * p1.i()) / (p1.r() * p1.r() + p1.i() * p1.i()); }
-    private:
-        const P1& p1;
-        const T& s;
-    };
+        Array<T> ret(expr);
+        inclusiveScanInPlace(ret, op);
+        return ret;
+    }
 
-    template <typename P1, typename T>
-    ComplexDivScalI<P1, T> operator/(const T& c2, const ComplexExpression<P1, T>& c1)
+    template <typename E, typename T, typename O = std::plus<T>>
+    Array<T> exclusiveScan(const ArrayExpression<E, T>& expr, const T& init = T(), const O& op = O())
     {
-        return ComplexDivScalI<P1, T> (
-                                       *static_cast<const P1*>(&c1),
-                                       c2);
+        Array<T> ret(expr);
+        exclusiveScanInPlace(ret, init, op);
+        return ret;
     }
 
-    template <typename P1, typename T>
-    class ComplexConjug : public ComplexExpression<ComplexConjug<P1, T>, T>
+    template <std::size_t S>
+    struct RadixUnsigned { typedef void type; };
+    template <>
+    struct RadixUnsigned<1> { typedef std::uint8_t type; };
+    template <>
+    struct RadixUnsigned<2> { typedef std::uint16_t type; };
+    template <>
+    struct RadixUnsigned<4> { typedef std::uint32_t type; };
+    template <>
+    struct RadixUnsigned<8> { typedef std::uint64_t type; };
+
+    //unsigned key type with the same order as T, void for types that are sorted by comparisons
+    template <typename T>
+    struct RadixKey
     {
-    public:
-        ComplexConjug(const P1& p1_): p1(p1_) { }
-        T r() const { return p1.r(); }
-        T i() const { return -p1.i(); }
-    private:
-        const P1& p1;
+        typedef typename std::conditional<std::is_arithmetic<T>::value, typename RadixUnsigned<sizeof(T)>::type, void>::type type;
     };
 
-    template <typename P1, typename T>
-    ComplexConjug<P1, T> operator!(const ComplexExpression<P1, T>& c1)
+    //floating point keys put -nan first and nan last, and -0 before 0
+    template <typename K, typename T>
+    K radixToKey(const T& x)
     {
-        return ComplexConjug<P1, T> (*static_cast<const P1*>(&c1));
+        const K high = (K)((K)1 << (8 * sizeof(K) - 1));
+        K k;
+        memcpy(&k, &x, sizeof(K));
+        if (std::is_floating_point<T>::value)
+            return (k & high)? (K)~k: (K)(k | high);
+        return std::is_signed<T>::value? (K)(k ^ high): k;
     }
 
-    template <typename P1, typename T>
-    class ComplexMinus : public ComplexExpression<ComplexMinus<P1, T>, T>
+    template <typename T, typename K>
+    T radixFromKey(K k)
     {
-    public:
-        ComplexMinus(const P1& p1_): p1(p1_) { }
-        T r() const { return -p1.r(); }
-        T i() const { return -p1.i(); }
-    private:
-        const P1& p1;
-    };
+        const K high = (K)((K)1 << (8 * sizeof(K) - 1));
+        if (std::is_floating_point<T>::value)
+            k = (k & high)? (K)(k & ~high): (K)~k;
+        else if (std::is_signed<T>::value)
+            k = (K)(k ^ high);
+        T x;
+        memcpy(&x, &k, sizeof(K));
+        return x;
+    }
 
-    template <typename P1, typename T>
-    ComplexMinus<P1, T> operator-(const ComplexExpression<P1, T>& c1)
+    //LSD radix sort, 8 bits per pass, ping ponging between keys and tmp. Returns the buffer that
+    //ends up sorted. Digits where the bytes of varying are 0 are the same in every key and skipped
+    template <typename K>
+    K* radixSortKeys(K* keys, K* tmp, std::size_t n, K varying)
     {
-        return ComplexMinus<P1, T> (*static_cast<const P1*>(&c1));
+        std::size_t blocks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN, threads = 4 * currentThreadCount();
+        blocks = blocks > threads? threads: blocks == 0? 1: blocks;
+        std::size_t block = (n + blocks - 1) / blocks;
+        Array<std::size_t> counts(blocks * 256);
+        std::size_t *c = &counts[0];
+        for (std::size_t shift = 0; shift < 8 * sizeof(K); shift += 8)
+        {
+            if (((varying >> shift) & 255) == 0)
+                continue;
+            //counts live on the stack while counting, stores to counts could alias the keys
+            parallelFor(0, blocks, 1, [keys, c, n, block, shift](std::size_t first, std::size_t last)
+            {
+                for (std::size_t b = first; b < last; ++b)
+                {
+                    std::size_t local[256] = {};
+                    for (std::size_t i = b * block; i < blockEnd(b, block, n); ++i)
+                        ++local[(keys[i] >> shift) & 255];
+                    memcpy(c + b * 256, local, sizeof(local));
+                }
+            });
+            //digit by digit, and block by block inside a digit, so equal keys keep their order
+            std::size_t sum = 0;
+            for (std::size_t d = 0; d < 256; ++d)
+            {
+                for (std::size_t b = 0; b < blocks; ++b)
+                {
+                    std::size_t t = c[b * 256 + d];
+                    c[b * 256 + d] = sum;
+                    sum += t;
+                }
+            }
+            parallelFor(0, blocks, 1, [keys, tmp, c, n, block, shift](std::size_t first, std::size_t last)
+            {
+                for (std::size_t b = first; b < last; ++b)
+                {
+                    std::size_t offsets[256];
+                    memcpy(offsets, c + b * 256, sizeof(offsets));
+                    for (std::size_t i = b * block; i < blockEnd(b, block, n); ++i)
+                    {
+                        K k = keys[i];
+                        tmp[offsets[(k >> shift) & 255]++] = k;
+                    }
+                }
+            });
+            std::swap(keys, tmp);
+        }
+        return keys;
     }
 
-    template <typename T>
-    class ComplexExp : public ComplexExpression<ComplexExp<T>, T>
+    //stable merge of [a, a + na) and [b, b + nb) into out, ties are taken from a
+    template <typename T, typename C>
+    void mergeRuns(const T* a, std::size_t na, const T* b, std::size_t nb, T* out, const C& less)
     {
-    public:
-        ComplexExp(const T& p1_): p1(p1_) { }
-        T r() const { return cos(p1); }
-        T i() const { return sin(p1); }
-    private:
-        const T& p1;
-    };
+        std::size_t i = 0, j = 0, k = 0;
+        while (i < na && j < nb)
+            out[k++] = less(b[j], a[i])? b[j++]: a[i++];
+        while (i < na)
+            out[k++] = a[i++];
+        while (j < nb)
+            out[k++] = b[j++];
+    }
 
-    template <typename T>
-    ComplexExp<T> complexExp(const T& theta)
+    //elements taken from a among the first x outputs of mergeRuns(a, na, b, nb)
+    template <typename T, typename C>
+    std::size_t mergeSplit(const T* a, std::size_t na, const T* b, std::size_t nb, std::size_t x, const C& less)
     {
-        return ComplexExp<T> (theta);
+        std::size_t lo = x > nb? x - nb: 0, hi = x < na? x: na;
+        while (lo < hi)
+        {
+            std::size_t i = lo + (hi - lo) / 2;
+            if (less(b[x - i - 1], a[i]))
+                hi = i;
+            else
+                lo = i + 1;
+        }
+        return lo;
     }
 
-    template <typename P1, typename T>
-    class ComplexSumSca : public ComplexExpression<ComplexSumSca<P1, T>, T>
+    //stable merge sort: runs of 32 sorted by insertion, then merged in pairs. Long merges are cut
+    //in pieces of about PARALLEL_GRAIN outputs with mergeSplit, so the last passes stay parallel.
+    //tmp holds n elements
+    template <typename T, typename C>
+    void mergeSort(T* d, T* tmp, std::size_t n, const C& less)
     {
-    public:
-        ComplexSumSca(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T r() const { return p1.r() + s; }
-        T i() const { return p1.i(); }
-    private:
-        const P1& p1;
-        const T s;
-    };
+        const std::size_t run = 32;
+        parallelFor(0, (n + run - 1) / run, parallelGrain(run * run), [d, n, &less](std::size_t first, std::size_t last)
+        {
+            for (std::size_t r = first; r < last; ++r)
+            {
+                std::size_t end = blockEnd(r, run, n);
+                for (std::size_t i = r * run + 1; i < end; ++i)
+                {
+                    T x = d[i];
+                    std::size_t j = i;
+                    for (; j > r * run && less(x, d[j - 1]); --j)
+                        d[j] = d[j - 1];
+                    d[j] = x;
+                }
+            }
+        });
+        T *src = d, *dst = tmp;
+        for (std::size_t width = run; width < n; width *= 2)
+        {
+            std::size_t pairs = (n + 2 * width - 1) / (2 * width);
+            parallelFor(0, pairs, 1, [src, dst, n, width, &less](std::size_t first, std::size_t last)
+            {
+                for (std::size_t p = first; p < last; ++p)
+                {
+                    std::size_t lo = p * 2 * width, mid = lo + width < n? lo + width: n, hi = blockEnd(2 * p + 1, width, n);
+                    const T *ra = src + lo, *rb = src + mid;
+                    std::size_t na = mid - lo, nb = hi - mid, pieces = (hi - lo + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+                    parallelFor(0, pieces, 1, [ra, rb, na, nb, lo, dst, &less](std::size_t pf, std::size_t pl)
+                    {
+                        for (std::size_t q = pf; q < pl; ++q)
+                        {
+                            std::size_t x0 = q * PARALLEL_GRAIN, x1 = blockEnd(q, PARALLEL_GRAIN, na + nb);
+                            std::size_t i0 = mergeSplit(ra, na, rb, nb, x0, less), i1 = mergeSplit(ra, na, rb, nb, x1, less);
+                            mergeRuns(ra + i0, i1 - i0, rb + (x0 - i0), (x1 - i1) - (x0 - i0), dst + lo + x0, less);
+                        }
+                    });
+                }
+            });
+            std::swap(src, dst);
+        }
+        if (src != d)
+            copyElems(d, src, n);
+    }
 
-    template <typename E, typename T>
-    ComplexSumSca<E, T> operator+(const ComplexExpression<E, T>& c, const T& s)
+    //stable sort with a comparison
+    template <typename T, std::size_t N, typename C>
+    Array<T, N>& sort(Array<T, N>& a, const C& less)
     {
-        return ComplexSumSca<E, T>(*static_cast<const E*>(&c), s);
+        profile_kernel("merge sort");
+        std::size_t n = a.len();
+        if (n < 2)
+            return a;
+        T *tmp = allocElems<T>(n);
+        array_assert(tmp != NULL);
+        //the merges assign into tmp, so it has to hold live objects when T isn't trivially copyable
+        if (!std::is_trivially_copyable<T>::value)
+            constructElems(tmp, &a[0], n);
+        mergeSort(&a[0], tmp, n, less);
+        destroyElems(tmp, n);
+        memFree(tmp);
+        return a;
     }
 
-    template <typename E, typename T>
-    ComplexSumSca<E, T> operator+(const T& s, const ComplexExpression<E, T>& c)
+    template <typename T, std::size_t N>
+    Array<T, N>& sortDispatch(Array<T, N>& a, std::false_type)
     {
-        return ComplexSumSca<E, T>(*static_cast<const E*>(&c), s);
+        return sort(a, std::less<T>());
     }
 
-    template <typename P1, typename T>
-    class ComplexSubSca : public ComplexExpression<ComplexSubSca<P1, T>, T>
+    //radix sort of the keys when at most 4 of their bytes vary. Past that the scatters of the radix
+    //passes cost more than the sequential merges, so the keys are merge sorted instead
+    template <typename T, std::size_t N>
+    Array<T, N>& sortDispatch(Array<T, N>& a, std::true_type)
     {
-    public:
-        ComplexSubSca(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T r() const { return p1.r() - s; }
-        T i() const { return p1.i(); }
-    private:
-        const P1& p1;
-        const T s;
-    };
+        typedef typename RadixKey<T>::type K;
+        std::size_t n = a.len(), blocks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+        //small arrays compare the same keys, so -0 and NaNs are ordered the same way at every size
+        if (n < 64)
+            return sort(a, [](const T& x, const T& y) { return radixToKey<K>(x) < radixToKey<K>(y); });
+        profile_kernel("radix sort");
+        T *d = &a[0];
+        K *keys = allocElems<K>(2 * n);
+        array_assert(keys != NULL);
+        //bits set in some key and clear in another: or ^ and of every key
+        Array<K> bits(2 * blocks);
+        K *o = &bits[0];
+        parallelFor(0, blocks, 1, [d, keys, o, n](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                K any = 0, all = (K)~(K)0;
+                for (std::size_t i = b * PARALLEL_GRAIN; i < blockEnd(b, PARALLEL_GRAIN, n); ++i)
+                {
+                    K k = radixToKey<K>(d[i]);
+                    keys[i] = k;
+                    any = (K)(any | k);
+                    all = (K)(all & k);
+                }
+                o[2 * b] = any;
+                o[2 * b + 1] = all;
+            }
+        });
+        K any = 0, all = (K)~(K)0;
+        for (std::size_t b = 0; b < blocks; ++b)
+        {
+            any = (K)(any | o[2 * b]);
+            all = (K)(all & o[2 * b + 1]);
+        }
+        K varying = (K)(any ^ all);
+        std::size_t passes = 0;
+        for (std::size_t shift = 0; shift < 8 * sizeof(K); shift += 8)
+            passes += ((varying >> shift) & 255) != 0? 1: 0;
+
+        K *sorted = keys;
+        if (passes <= 4)
+            sorted = radixSortKeys(keys, keys + n, n, varying);
+        else
+            mergeSort(keys, keys + n, n, std::less<K>());
+        parallelFor(0, n, PARALLEL_GRAIN, [d, sorted](std::size_t b, std::size_t e)
+        {
+            for (std::size_t i = b; i < e; ++i)
+                d[i] = radixFromKey<T>(sorted[i]);
+        });
+        memFree(keys);
+        return a;
+    }
 
-    template <typename E, typename T>
-    ComplexSubSca<E, T> operator-(const ComplexExpression<E, T>& c, const T& s)
+    //ascending order: integer and floating point types are sorted by their keys, the rest by merge sort
+    template <typename T, std::size_t N>
+    Array<T, N>& sort(Array<T, N>& a)
     {
-        return ComplexSubSca<E, T>(*static_cast<const E*>(&c), s);
+        return sortDispatch(a, std::integral_constant<bool, !std::is_void<typename RadixKey<T>::type>::value>());
     }
 
-    template <typename P1, typename T>
-    class ComplexSubScaI : public ComplexExpression<ComplexSubScaI<P1, T>, T>
+    //elements where pred is true first, both groups in their original order. Returns how many passed
+    template <typename T, std::size_t N, typename P>
+    std::size_t stablePartition(Array<T, N>& a, const P& pred)
     {
-    public:
-        ComplexSubScaI(const P1& p1_, const T& s_): p1(p1_), s(s_) { }
-        T r() const { return s - p1.r(); }
-        T i() const { return -p1.i(); }
-    private:
-        const P1& p1;
-        const T s;
-    };
+        profile_kernel("partition");
+        std::size_t n = a.len(), blocks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+        if (n == 0)
+            return 0;
+        T *d = &a[0];
+        Array<std::size_t> passed(blocks + 1);
+        std::size_t *c = &passed[0];
+        parallelFor(0, blocks, 1, [d, c, n, &pred](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                std::size_t k = 0;
+                for (std::size_t i = b * PARALLEL_GRAIN; i < blockEnd(b, PARALLEL_GRAIN, n); ++i)
+                    k += pred(d[i])? 1: 0;
+                c[b + 1] = k;
+            }
+        });
+        for (std::size_t b = 1; b <= blocks; ++b)
+            c[b] += c[b - 1];
+        std::size_t total = c[blocks];
+
+        T *tmp = allocElems<T>(n);
+        array_assert(tmp != NULL);
+        parallelFor(0, blocks, 1, [d, c, tmp, n, total, &pred](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                //the ones that failed before block b are its start minus the ones that passed
+                std::size_t t = c[b], f = total + b * PARALLEL_GRAIN - c[b];
+                for (std::size_t i = b * PARALLEL_GRAIN; i < blockEnd(b, PARALLEL_GRAIN, n); ++i)
+                {
+                    //every slot of tmp is written once, so the copies are constructed there
+                    if (pred(d[i]))
+                        new (tmp + t++) T(d[i]);
+                    else
+                        new (tmp + f++) T(d[i]);
+                }
+            }
+        });
+        parallelFor(0, n, PARALLEL_GRAIN, [d, tmp](std::size_t b, std::size_t e)
+        {
+            copyElems(d + b, tmp + b, e - b);
+            destroyElems(tmp + b, e - b);
+        });
+        memFree(tmp);
+        return total;
+    }
 
-    template <typename E, typename T>
-    ComplexSubScaI<E, T> operator-(const T& s, const ComplexExpression<E, T>& c)
+    //keeps the elements where pred is true, in order, and returns the new length. Blocks are
+    //compacted in parallel and then moved down one after the other
+    template <typename T, std::size_t N, typename P>
+    std::size_t compactInPlace(Array<T, N>& a, const P& pred)
     {
-        return ComplexSubScaI<E, T>(*static_cast<const E*>(&c), s);
+        profile_kernel("compact");
+        std::size_t n = a.len(), blocks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+        if (n == 0)
+            return 0;
+        T *d = &a[0];
+        Array<std::size_t> kept(blocks);
+        std::size_t *c = &kept[0];
+        parallelFor(0, blocks, 1, [d, c, n, &pred](std::size_t first, std::size_t last)
+        {
+            for (std::size_t b = first; b < last; ++b)
+            {
+                std::size_t w = b * PARALLEL_GRAIN;
+                for (std::size_t i = w; i < blockEnd(b, PARALLEL_GRAIN, n); ++i)
+                    if (pred(d[i]))
+                        d[w++] = d[i];
+                c[b] = w - b * PARALLEL_GRAIN;
+            }
+        });
+        std::size_t w = c[0];
+        for (std::size_t b = 1; b < blocks; ++b)
+        {
+            for (std::size_t i = b * PARALLEL_GRAIN; i < b * PARALLEL_GRAIN + c[b]; ++i)
+                d[w++] = d[i];
+        }
+        a.resize(w);
+        return w;
     }
 
-    template<typename E, typename T>
-    std::ostream& operator<<(std::ostream& out, const ComplexExpression<E, T>& expr)
+    //elements of expr where pred is true
+    template <typename E, typename T, typename P>
+    Array<T> compact(const ArrayExpression<E, T>& expr, const P& pred)
     {
-        out << expr.r() << SEPARATOR << COMPLEX_BET << expr.i() << COMPLEX_IMG;
-        return out;
+        Array<T> ret(expr);
+        compactInPlace(ret, pred);
+        return ret;
     }
 }
 
@@ -0,0 +1,415 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include "alglin_stuffed.hpp"
+
+//sh build_benchmarks.sh
+//./benchmarks [json output] [runs] [threads]
+
+//every benchmark adds something here, so the compiler can't drop the work
+static volatile double sink = 0.0;
+
+struct BenchResult
+{
+    const char *name;
+    std::size_t size;
+    std::size_t runs;
+    double flops;
+    double bytes;
+    //seconds per run
+    double min, p50, p90, p99;
+};
+
+//nearest rank percentile of sorted times
+static double percentile(const stuff::Array<double>& sorted, double p)
+{
+    std::size_t rank = (std::size_t)std::ceil(p * sorted.len());
+    return sorted[rank == 0? 0: rank - 1];
+}
+
+//runs f once to warm up and then runs times, flops and bytes are the work done by one run
+template <typename F>
+BenchResult measure(const char* name, std::size_t size, double flops, double bytes, std::size_t runs, const F& f)
+{
+    f();
+    stuff::Array<double> times;
+    for (std::size_t r = 0; r < runs; ++r)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        times.insert(std::chrono::duration<double>(end - start).count());
+    }
+    std::sort(&times[0], &times[0] + times.len());
+
+    BenchResult ret;
+    ret.name = name;
+    ret.size = size;
+    ret.runs = runs;
+    ret.flops = flops;
+    ret.bytes = bytes;
+    ret.min = times[0];
+    ret.p50 = percentile(times, 0.5);
+    ret.p90 = percentile(times, 0.9);
+    ret.p99 = percentile(times, 0.99);
+    return ret;
+}
+
+void benchMatrix(stuff::Array<BenchResult>& results, std::size_t runs)
+{
+    const std::size_t sizes[] = {64, 128, 256, 512};
+    for (std::size_t n : sizes)
+    {
+        stuff::Matrix<double> a(n, n, [](std::size_t i, std::size_t j) { return std::sin((double)(i + j)); });
+        stuff::Matrix<double> b(n, n, [](std::size_t i, std::size_t j) { return std::cos((double)(i * j)); });
+        stuff::Matrix<double> c;
+        double nn = (double)n * n;
+        results.insert(measure("gemm", n, 2.0 * nn * n, 3.0 * nn * sizeof(double), runs, [&]()
+        {
+            c = a * b;
+            sink = sink + c(0, 0);
+        }));
+        results.insert(measure("matrix a + b * 2 - a / 3", n, 4.0 * nn, 3.0 * nn * sizeof(double), runs, [&]()
+        {
+            c = a + b * 2.0 - a / 3.0;
+            sink = sink + c(n - 1, n - 1);
+        }));
+        results.insert(measure("gemm !a * !b", n, 2.0 * nn * n, 3.0 * nn * sizeof(double), runs, [&]()
+        {
+            c = (!a) * (!b);
+            sink = sink + c(0, 0);
+        }));
+        stuff::Diagonal<double> d(stuff::Array<double>(n, [](std::size_t i) { return 1.0 + (double)i; }));
+        results.insert(measure("matrix diagonal d * a", n, nn, 2.0 * nn * sizeof(double), runs, [&]()
+        {
+            c = d * a;
+            sink = sink + c(n - 1, 0);
+        }));
+        results.insert(measure("matrix a + s I", n, n, 2.0 * nn * sizeof(double), runs, [&]()
+        {
+            c = a + 0.5 * stuff::Identity<double>(n);
+            sink = sink + c(n - 1, n - 1);
+        }));
+    }
+
+    //flops of the usual complex product, 8 real flops per multiply add
+    const std::size_t complex_sizes[] = {64, 256};
+    for (std::size_t n : complex_sizes)
+    {
+        typedef stuff::Complex<double> C;
+        stuff::Matrix<C> a(n, n, [](std::size_t i, std::size_t j) { return C(std::sin((double)(i + j)), std::cos((double)i)); });
+        stuff::Matrix<C> b(n, n, [](std::size_t i, std::size_t j) { return C(std::cos((double)(i * j)), std::sin((double)j)); });
+        stuff::Matrix<C> c;
+        double nn = (double)n * n;
+        results.insert(measure("complex gemm 3M", n, 8.0 * nn * n, 3.0 * nn * sizeof(C), runs, [&]()
+        {
+            stuff::gemm(a, b, c, stuff::COMPLEX_GEMM_3M);
+            sink = sink + c(0, 0).r();
+        }));
+        results.insert(measure("complex gemm 4M", n, 8.0 * nn * n, 3.0 * nn * sizeof(C), runs, [&]()
+        {
+            stuff::gemm(a, b, c, stuff::COMPLEX_GEMM_4M);
+            sink = sink + c(0, 0).r();
+        }));
+    }
+
+    const std::size_t tensor_sizes[] = {16, 32};
+    for (std::size_t n : tensor_sizes)
+    {
+        stuff::Matrix<double> a(n, n, [](std::size_t i, std::size_t j) { return (double)(i + j); });
+        stuff::Matrix<double> c;
+        double out = (double)n * n * n * n;
+        results.insert(measure("tensor a % a", n, out, out * sizeof(double), runs, [&]()
+        {
+            c = a % a;
+            sink = sink + c(1, 1);
+        }));
+    }
+}
+
+void benchArray(stuff::Array<BenchResult>& results, std::size_t runs)
+{
+    const std::size_t sizes[] = {1 << 12, 1 << 16, 1 << 20};
+    for (std::size_t n : sizes)
+    {
+        stuff::Array<double> a(n, [](std::size_t i) { return (double)i; });
+        stuff::Array<double> b(n, [n](std::size_t i) { return (double)(n - i); });
+        stuff::Array<double> c;
+        results.insert(measure("array a * b + a / 2", n, 3.0 * n, 3.0 * n * sizeof(double), runs, [&]()
+        {
+            c = a * b + a / 2.0;
+            sink = sink + c[n - 1];
+        }));
+        results.insert(measure("array insert", n, 0.0, (double)n * sizeof(double), runs, [&]()
+        {
+            stuff::Array<double> grow;
+            for (std::size_t i = 0; i < n; ++i)
+                grow.insert((double)i);
+            sink = sink + grow[n - 1];
+        }));
+        results.insert(measure("array append 1024", n, 0.0, (double)n * sizeof(double), runs, [&]()
+        {
+            stuff::Array<double> grow;
+            for (std::size_t i = 0; i + 1024 <= n; i += 1024)
+                grow.append(&a[i], 1024);
+            sink = sink + grow[n - 1];
+        }));
+        //every thread of the pool inserting into one shared array
+        results.insert(measure("array insert mutex parallel", n, 0.0, (double)n * sizeof(double), runs, [&]()
+        {
+            stuff::Array<double> grow;
+            std::mutex lock;
+            stuff::parallelFor(0, n, 1024, [&](std::size_t b, std::size_t e)
+            {
+                for (std::size_t i = b; i < e; ++i)
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    grow.insert((double)i);
+                }
+            });
+            sink = sink + grow[n - 1];
+        }));
+        results.insert(measure("concurrentarray insert parallel", n, 0.0, (double)n * sizeof(double), runs, [&]()
+        {
+            stuff::ConcurrentArray<double> grow;
+            stuff::parallelFor(0, n, 1024, [&](std::size_t b, std::size_t e)
+            {
+                for (std::size_t i = b; i < e; ++i)
+                    grow.insert((double)i);
+            });
+            sink = sink + grow[n - 1];
+        }));
+        results.insert(measure("array dot", n, 2.0 * n, 2.0 * n * sizeof(double), runs, [&]()
+        {
+            sink = sink + stuff::dot(a, b);
+        }));
+        results.insert(measure("array forEach seq", n, 2.0 * n, 2.0 * n * sizeof(double), runs, [&]()
+        {
+            c.forEach([](std::size_t i, double x) { return x * 0.5 + (double)i; });
+            sink = sink + c[n - 1];
+        }));
+        results.insert(measure("array forEach par_unseq", n, 2.0 * n, 2.0 * n * sizeof(double), runs, [&]()
+        {
+            c.forEach([](std::size_t i, double x) { return x * 0.5 + (double)i; }, stuff::par_unseq);
+            sink = sink + c[n - 1];
+        }));
+        results.insert(measure("array inclusiveScan", n, (double)n, 2.0 * n * sizeof(double), runs, [&]()
+        {
+            c = stuff::inclusiveScan(a);
+            sink = sink + c[n - 1];
+        }));
+        //every run sorts a copy of the same input
+        stuff::Array<double> scrambled(n, [n](std::size_t i) { return std::sin((double)i) * (double)n; });
+        results.insert(measure("array sort", n, 0.0, 2.0 * n * sizeof(double), runs, [&]()
+        {
+            c = scrambled;
+            stuff::sort(c);
+            sink = sink + c[0];
+        }));
+        results.insert(measure("array sort(less)", n, 0.0, 2.0 * n * sizeof(double), runs, [&]()
+        {
+            c = scrambled;
+            stuff::sort(c, std::less<double>());
+            sink = sink + c[0];
+        }));
+        results.insert(measure("array stablePartition", n, 0.0, 3.0 * n * sizeof(double), runs, [&]()
+        {
+            c = a;
+            sink = sink + (double)stuff::stablePartition(c, [](double x) { return ((std::size_t)x & 3) == 0; });
+        }));
+    }
+}
+
+void benchVec(stuff::Array<BenchResult>& results, std::size_t runs)
+{
+    const std::size_t n = 1 << 20;
+    stuff::Vec3d p(1.0, 2.0, 3.0), dir(0.5, 0.25, 0.125);
+    results.insert(measure("vec3 p = p * 0.5 + dir", n, 6.0 * n, 0.0, runs, [&]()
+    {
+        stuff::Vec3d acc = p;
+        for (std::size_t i = 0; i < n; ++i)
+            acc = acc * 0.5 + dir;
+        sink = sink + acc[0];
+    }));
+    results.insert(measure("vec3 dot", n, 6.0 * n, 0.0, runs, [&]()
+    {
+        double acc = 0.0;
+        stuff::Vec3d v = p;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            acc = acc + (v ^ dir);
+            v[0] = acc;
+        }
+        sink = sink + acc;
+    }));
+    stuff::Vec3f pf(1.0f, 2.0f, 3.0f), dirf(0.5f, 0.25f, 0.125f);
+    results.insert(measure("vec3f dot", n, 6.0 * n, 0.0, runs, [&]()
+    {
+        float acc = 0.0f;
+        stuff::Vec3f v = pf;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            acc = acc * 0.5f + (v ^ dirf);
+            v[0] = acc;
+        }
+        sink = sink + acc;
+    }));
+
+    //particles as an Array of Vec3 against the same update over columns
+    stuff::Array<stuff::Vec3d> aos_p(n, [](std::size_t i) { return stuff::Vec3d((double)i, 1.0, 2.0); });
+    stuff::Array<stuff::Vec3d> aos_v(n, [](std::size_t i) { return stuff::Vec3d(0.5, (double)i, 1.0); });
+    stuff::Vec3dArray soa_p(aos_p), soa_v(aos_v);
+    stuff::Array<double> dots;
+    results.insert(measure("array<vec3> p = p + v * dt", n, 6.0 * n, 9.0 * n * sizeof(double), runs, [&]()
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            aos_p[i] = aos_p[i] + aos_v[i] * 0.01;
+        sink = sink + aos_p[n - 1][0];
+    }));
+    results.insert(measure("vecarray p = p + v * dt", n, 6.0 * n, 9.0 * n * sizeof(double), runs, [&]()
+    {
+        soa_p = soa_p + soa_v * 0.01;
+        sink = sink + soa_p[n - 1][0];
+    }));
+    results.insert(measure("array<vec3> p ^ v", n, 5.0 * n, 7.0 * n * sizeof(double), runs, [&]()
+    {
+        dots.resize(n);
+        for (std::size_t i = 0; i < n; ++i)
+            dots[i] = aos_p[i] ^ aos_v[i];
+        sink = sink + dots[n - 1];
+    }));
+    results.insert(measure("vecarray p ^ v", n, 5.0 * n, 7.0 * n * sizeof(double), runs, [&]()
+    {
+        dots = soa_p ^ soa_v;
+        sink = sink + dots[n - 1];
+    }));
+
+    //affine 4x4 transform of every point, by hand against the batched kernels
+    stuff::Matrix<double> xf(4, 4, [](std::size_t i, std::size_t j) { return i == j? 1.0: i < 3 && j == 3? 0.5: 0.1 * (double)(i + j); });
+    stuff::Array<stuff::Vec3d> moved(n);
+    results.insert(measure("array<vec3> transform by hand", n, 18.0 * n, 6.0 * n * sizeof(double), runs, [&]()
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            const stuff::Vec3d& q = aos_p[i];
+            for (std::size_t r = 0; r < 3; ++r)
+                moved[i][r] = xf(r, 0) * q[0] + xf(r, 1) * q[1] + xf(r, 2) * q[2] + xf(r, 3);
+        }
+        sink = sink + moved[n - 1][0];
+    }));
+    results.insert(measure("array<vec3> transform", n, 18.0 * n, 6.0 * n * sizeof(double), runs, [&]()
+    {
+        stuff::transform(xf, aos_p, moved);
+        sink = sink + moved[n - 1][0];
+    }));
+    stuff::Vec3dArray soa_moved;
+    results.insert(measure("vecarray transform", n, 18.0 * n, 6.0 * n * sizeof(double), runs, [&]()
+    {
+        stuff::transform(xf, soa_p, soa_moved);
+        sink = sink + soa_moved.columnData(0)[n - 1];
+    }));
+    results.insert(measure("vecarray transform project", n, 26.0 * n, 6.0 * n * sizeof(double), runs, [&]()
+    {
+        stuff::transform(xf, soa_p, soa_moved, stuff::TRANSFORM_PROJECT);
+        sink = sink + soa_moved.columnData(0)[n - 1];
+    }));
+}
+
+void benchComplex(stuff::Array<BenchResult>& results, std::size_t runs)
+{
+    const std::size_t n = 1 << 20;
+    stuff::Complex<double> w(0.999, 0.001), start(1.0, 0.0);
+    //z = z * w + start: 4 mul + 4 add
+    results.insert(measure("complex z * w + c", n, 8.0 * n, 0.0, runs, [&]()
+    {
+        stuff::Complex<double> z = start;
+        for (std::size_t i = 0; i < n; ++i)
+            z = z * w + start;
+        sink = sink + z.r();
+    }));
+
+    const std::size_t m_angles = 1 << 16;
+    stuff::Array<double> angles(m_angles, [](std::size_t i) { return 0.001 * i; });
+    stuff::ComplexArray<double> phases;
+    results.insert(measure("complexExp(array)", m_angles, 0.0, 3.0 * m_angles * sizeof(double), runs, [&]()
+    {
+        phases = stuff::complexExp(angles);
+        sink = sink + phases.re(m_angles - 1);
+    }));
+    results.insert(measure("complexExp(array) fast", m_angles, 0.0, 3.0 * m_angles * sizeof(double), runs, [&]()
+    {
+        phases = stuff::complexExp(angles, stuff::SINCOS_FAST);
+        sink = sink + phases.re(m_angles - 1);
+    }));
+
+    //usual 5 n log2(n) flop count of a complex transform
+    const std::size_t fft_sizes[] = {1 << 10, 1 << 16, 3 * 5 * 7 * 64};
+    for (std::size_t m : fft_sizes)
+    {
+        stuff::Array<stuff::Complex<double>> x(m, [](std::size_t i) { return stuff::Complex<double>(std::sin((double)i), 0.5); });
+        results.insert(measure("fft", m, 5.0 * m * std::log2((double)m), 2.0 * m * sizeof(x[0]), runs, [&]()
+        {
+            stuff::fftInPlace(x);
+            sink = sink + x[0].r();
+        }));
+    }
+}
+
+void printResults(const stuff::Array<BenchResult>& results, std::ostream& out=std::cout)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "%-28s %8s %12s %12s %12s %10s %10s",
+             "benchmark", "size", "p50 (us)", "p90 (us)", "p99 (us)", "GFLOP/s", "GB/s");
+    out << line << std::endl;
+    for (std::size_t i = 0; i < results.len(); ++i)
+    {
+        const BenchResult& r = results[i];
+        snprintf(line, sizeof(line), "%-28s %8zu %12.2f %12.2f %12.2f %10.3f %10.3f",
+                 r.name, r.size, r.p50 * 1e6, r.p90 * 1e6, r.p99 * 1e6,
+                 r.flops / r.p50 * 1e-9, r.bytes / r.p50 * 1e-9);
+        out << line << std::endl;
+    }
+}
+
+void writeJson(const stuff::Array<BenchResult>& results, std::size_t threads, std::ostream& out)
+{
+    out << "{" << std::endl;
+    out << "  \"threads\": " << threads << "," << std::endl;
+    out << "  \"compiler\": \"" << __VERSION__ << "\"," << std::endl;
+    out << "  \"benchmarks\": [" << std::endl;
+    for (std::size_t i = 0; i < results.len(); ++i)
+    {
+        const BenchResult& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"size\": " << r.size << ", \"runs\": " << r.runs
+            << ", \"min\": " << r.min << ", \"p50\": " << r.p50 << ", \"p90\": " << r.p90 << ", \"p99\": " << r.p99
+            << ", \"gflops\": " << r.flops / r.p50 * 1e-9 << ", \"gbytes\": " << r.bytes / r.p50 * 1e-9 << "}"
+            << (i + 1 < results.len()? ",": "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    const char *json = argc > 1? argv[1]: "benchmarks.json";
+    std::size_t runs = argc > 2? (std::size_t)atoi(argv[2]): 20;
+    if (argc > 3)
+        stuff::setThreadCount((std::size_t)atoi(argv[3]));
+    if (runs == 0)
+        runs = 1;
+
+    stuff::Array<BenchResult> results;
+    benchMatrix(results, runs);
+    benchArray(results, runs);
+    benchVec(results, runs);
+    benchComplex(results, runs);
+
+    printResults(results);
+    std::fstream file_json(json, std::fstream::out);
+    writeJson(results, stuff::defaultThreadPool().size(), file_json);
+    file_json.close();
+
+    return 0;
+}
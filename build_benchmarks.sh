@@ -0,0 +1,4 @@
+#!/bin/sh
+set -xe
+g++ -std=c++17 -O3 -march=native -DNDEBUG -Wall -Wextra -pedantic -pthread -o benchmarks benchmarks.cpp
+./benchmarks benchmarks.json
\ No newline at end of file
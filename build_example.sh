@@ -1,4 +1,4 @@
 #!/bin/sh
 set -xe
-g++ -O0 -Wall -Wextra -pedantic -DNO_ASSERTIONS_ -o examples examples.cpp
+g++ -std=c++14 -O0 -Wall -Wextra -pedantic -pthread -DNO_ASSERTIONS_ -o examples examples.cpp
 ./examples
\ No newline at end of file
@@ -28,6 +28,12 @@ void exampleVecs(std::ostream &out=std::cout)
     out << "v1 / 1.5 = " << v1 / 1.5 << std::endl;
     out << "1.4 / v1 = " << 1.4 / v1 << std::endl;
     out << "-v1 = " << -v1 << std::endl;
+    stuff::Vec3dArray points(3, [](std::size_t i) { return stuff::Vec3d(i * 1.0, i * 2.0, 1.0); });
+    stuff::Vec3d dir(0.5, 0.0, -1.0);
+    points[2] = points[1] * 2.0;
+    out << "points:" << std::endl << points << std::endl;
+    out << "points + dir * 2.0:" << std::endl << points + dir * 2.0 << std::endl;
+    out << "points ^ dir: " << (points ^ dir) << std::endl;
     out << "----------------------------------" << std::endl;
 
 }
@@ -56,11 +62,17 @@ void exampleArrays(std::ostream &out=std::cout)
     out << "array1 / 2.0: " << array1 / 2.0 << std::endl;
     out << "2.0 / array1: " << 2.0 / array1 << std::endl;
     out << "-array1: " << -array1 << std::endl;
+    out << "stuff::sum(array1 * array2): " << stuff::sum(array1 * array2) << std::endl;
+    out << "stuff::norm2(array1 - array2): " << stuff::norm2(array1 - array2) << std::endl;
+    out << "stuff::argmax(array1 / array2): " << stuff::argmax(array1 / array2) << std::endl;
     out << "array1.pop(): " << array1.pop() << std::endl;
     out << "array1 after pop(): " << array1 << std::endl;
     out << "array1.forEach([](std::size_t i, double elem) { return elem * elem }): " 
               << array1.forEach([](std::size_t, double elem) { return elem * elem; }) 
               << std::endl;
+    stuff::Array<double, 4> small;
+    small.insert(1.0); small.insert(2.0); small.insert(3.0);
+    out << "stuff::Array<double, 4> (no heap allocation): " << small + small << std::endl;
     out << "----------------------------------" << std::endl;
 
 }
@@ -127,11 +139,54 @@ void exampleMatrix(std::ostream &out=std::cout)
     out << "-m1: " << std::endl;
     out << -m1 << std::endl << std::endl;
 
+    out << "stuff::trace(m1 * m2): " << stuff::trace(m1 * m2) << std::endl;
+    out << "stuff::frobenius(m1 - m2): " << stuff::frobenius(m1 - m2) << std::endl << std::endl;
+
+    out << "stuff::pow(m2, 3): " << std::endl;
+    out << stuff::pow(m2, 3) << std::endl << std::endl;
+
+    out << "stuff::expm(m2 / 4.0): " << std::endl;
+    out << stuff::expm(stuff::Matrix<double>(m2 / 4.0)) << std::endl << std::endl;
+
+    out << "stuff::polynomial(m2, {1.0, 2.0, 3.0}): " << std::endl;
+    out << stuff::polynomial(m2, stuff::Array<double>(3, [](std::size_t i) { return i + 1.0; })) << std::endl << std::endl;
+
     out << "m1.forEach([](std::size_t i, std::size_t j, double elem) { return i == j; }): " << std::endl;
     out << m1.forEach([](std::size_t i, std::size_t j, double ) { return i == j; }) << std::endl << std::endl;
     out << "----------------------------------" << std::endl;
 }
 
+void exampleFactorization(std::ostream &out=std::cout)
+{
+    out << "----------------------------------" << std::endl;
+    out << "Factorization example: " << std::endl << std::endl;
+    stuff::Matrix<double> a(3, 2, [](std::size_t i, std::size_t j) { return (double)(i + 1) * (j + 1) + (i == j); });
+    stuff::QR<double> qr;
+    a.attach(qr);
+    stuff::Array<double> b(3, [](std::size_t i) { return (double)i; });
+    out << "Matrix a: " << std::endl << a << std::endl << std::endl;
+    out << "qr.solve(a, b): " << qr.solve(a, b) << std::endl;
+
+    a.insertRow(stuff::Vec<2, double>(1.0, -1.0));
+    b.insert(2.0);
+    out << "a.insertRow(stuff::Vec<2, double>(1.0, -1.0)), b.insert(2.0): " << std::endl;
+    out << "qr.solve(a, b): " << qr.solve(a, b) << std::endl;
+
+    a.removeRow(0);
+    b = stuff::Array<double>(3, [](std::size_t i) { return (double)i + 1; });
+    out << "a.removeRow(0), b = {1, 2, 3}: " << std::endl;
+    out << "qr.solve(a, b): " << qr.solve(a, b) << std::endl;
+
+    stuff::Matrix<double> s(2, 2, [](std::size_t i, std::size_t j) { return 1.0 + 3.0 * (i == j); });
+    stuff::Cholesky<double> chol;
+    s.attach(chol);
+    s.insertRow(stuff::Vec<2, double>(1.0, 1.0));
+    s.insertCol(stuff::Vec<3, double>(1.0, 1.0, 4.0));
+    out << "Matrix s: " << std::endl << s << std::endl << std::endl;
+    out << "chol.solve({1, 1, 1}): " << chol.solve(stuff::Array<double>(3, [](std::size_t) { return 1.0; })) << std::endl;
+    out << "----------------------------------" << std::endl;
+}
+
 void exampleComplex(std::ostream &out=std::cout)
 {
     stuff::Complex<double> c1(1.0, 2.0), c2(2.0, -1.0);
@@ -152,6 +207,16 @@ void exampleComplex(std::ostream &out=std::cout)
     out << "!c1: " << !c1 << std::endl;
     out << "c1 * !c1: " << c1 * !c1 << std::endl;
     out << "stuff::complexExp(M_PI): " << stuff::complexExp(M_PI) << std::endl;
+    stuff::ComplexArray<double> s1(4, [](std::size_t i) { return stuff::Complex<double>(1.0, (double)i); });
+    out << "split s1: " << s1 << std::endl;
+    out << "split s1 * !s1: " << s1 * !s1 << std::endl;
+    out << "split abs(s1 / 2.0): " << stuff::abs(s1 / 2.0) << std::endl;
+    stuff::Array<double> angles(4, [](std::size_t i) { return i * 0.5; });
+    out << "stuff::complexExp(angles): " << stuff::complexExp(angles) << std::endl;
+    stuff::Array<stuff::Complex<double>> signal(4, [](std::size_t i) { return stuff::Complex<double>(i + 1.0, 0.0); });
+    out << "signal: " << signal << std::endl;
+    out << "stuff::fft(signal): " << stuff::fft(signal) << std::endl;
+    out << "stuff::ifft(stuff::fft(signal)): " << stuff::ifft(stuff::fft(signal)) << std::endl;
     out << "----------------------------------" << std::endl;
 }
 
@@ -161,12 +226,14 @@ int main()
     exampleVecs();
     exampleArrays();
     exampleMatrix();
+    exampleFactorization();
 
     std::fstream file_examples("output_examples", std::fstream::out);
     exampleComplex(file_examples);
     exampleVecs(file_examples);
     exampleArrays(file_examples);
     exampleMatrix(file_examples);
+    exampleFactorization(file_examples);
     file_examples.close();
 
     return 0;